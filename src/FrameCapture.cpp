@@ -0,0 +1,282 @@
+// -*- mode:c++; indent-tabs-mode:nil; c-basic-offset:4; -*-
+//======================================================================================
+/*
+    This file is part of DIMPLE, the Dynamic Interactive Musically PhysicaL Environment,
+
+    This code is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License("GPL") version 2
+    as published by the Free Software Foundation.  See the file LICENSE
+    for more information.
+
+    sinclair@music.mcgill.ca
+    http://www.music.mcgill.ca/~sinclair/content/dimple
+*/
+//======================================================================================
+
+#include "FrameCapture.h"
+
+// Most frames waiting for the encoder before new ones are dropped
+#define CAPTURE_MAX_FRAMES 4
+
+FrameCapture::FrameCapture(const char *name)
+    : m_name(name), m_bActive(false), m_nIndex(0),
+      m_nWidth(0), m_nHeight(0), m_nDropped(0),
+      m_bFinish(false), m_pFile(NULL), m_bPipe(false), m_nWritten(0)
+{
+    m_pbo[0] = m_pbo[1] = 0;
+    m_bPending[0] = m_bPending[1] = false;
+}
+
+FrameCapture::~FrameCapture()
+{
+    // The pixel buffers go away with the GL context.
+    stop();
+    join();
+}
+
+bool FrameCapture::start(const char *target)
+{
+    stop();
+
+    // Waits for the previous capture's last few frames to be written.
+    join();
+
+    m_target = target;
+    m_bPipe = (target[0] == '|');
+    m_pFile = NULL;
+
+    int conversions = m_bPipe ? 0 : patternConversions(target);
+    if (m_bPipe)
+        m_pFile = popen(target + 1, "w");
+    else if (conversions == 0)
+        m_pFile = fopen(target, "wb");
+
+    if (conversions < 0 || (conversions == 0 && !m_pFile)) {
+        printf("[%s] Unable to open %s for capturing frames.\n",
+               m_name.c_str(), target);
+        return false;
+    }
+
+    m_nWritten = 0;
+    m_nDropped = 0;
+    m_bFinish = false;
+    m_thread = std::thread(FrameCapture::encode, this);
+    m_bActive = true;
+
+    printf("[%s] Capturing frames to %s.\n", m_name.c_str(), target);
+    return true;
+}
+
+void FrameCapture::stop()
+{
+    if (!m_bActive)
+        return;
+
+    m_bActive = false;
+    finish();
+
+    printf("[%s] Stopped capturing to %s, %u frames dropped.\n",
+           m_name.c_str(), m_target.c_str(), m_nDropped);
+}
+
+void FrameCapture::capture(int width, int height)
+{
+    if (!m_bActive) {
+        // Release the pixel buffers after a capture has stopped,
+        // discarding the frame still being read.
+        if (m_pbo[0]) {
+            glDeleteBuffers(2, m_pbo);
+            m_pbo[0] = m_pbo[1] = 0;
+            m_bPending[0] = m_bPending[1] = false;
+        }
+        return;
+    }
+
+    if (!m_pbo[0] || width != m_nWidth || height != m_nHeight)
+    {
+        if (!m_pbo[0])
+            glGenBuffers(2, m_pbo);
+        for (int i = 0; i < 2; i++) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pbo[i]);
+            glBufferData(GL_PIXEL_PACK_BUFFER, width * height * 4,
+                         NULL, GL_STREAM_READ);
+            m_bPending[i] = false;
+        }
+        m_nWidth = width;
+        m_nHeight = height;
+        m_nIndex = 0;
+    }
+
+    // Start reading this frame into one buffer; glReadPixels returns
+    // without waiting since the destination is a buffer object.
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pbo[m_nIndex]);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    m_bPending[m_nIndex] = true;
+
+    // The other buffer was filled a frame ago, so it should be ready
+    // to map by now.
+    m_nIndex = 1 - m_nIndex;
+    if (m_bPending[m_nIndex])
+        collect(m_nIndex);
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+void FrameCapture::collect(int i)
+{
+    m_bPending[i] = false;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pbo[i]);
+    const unsigned char *pixels = (const unsigned char*)
+        glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    if (!pixels)
+        return;
+
+    Frame *frame = NULL;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_free.empty()) {
+            frame = m_free.back();
+            m_free.pop_back();
+        }
+        else if (m_frames.size() < CAPTURE_MAX_FRAMES) {
+            frame = new Frame();
+            m_frames.push_back(frame);
+        }
+    }
+
+    if (frame) {
+        frame->width = m_nWidth;
+        frame->height = m_nHeight;
+        frame->rgba.assign(pixels, pixels + m_nWidth * m_nHeight * 4);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back(frame);
+        m_condvar.notify_one();
+    }
+    else
+        m_nDropped++;
+
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+}
+
+void FrameCapture::finish()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_bFinish = true;
+    m_condvar.notify_one();
+}
+
+void FrameCapture::join()
+{
+    if (m_thread.joinable())
+        m_thread.join();
+
+    std::vector<Frame*>::iterator it;
+    for (it = m_frames.begin(); it != m_frames.end(); it++)
+        delete *it;
+    m_frames.clear();
+    m_free.clear();
+    m_queue.clear();
+}
+
+void* FrameCapture::encode(void* param)
+{
+    FrameCapture *me = static_cast<FrameCapture*>(param);
+    bool ok = true;
+
+    while (true)
+    {
+        Frame *frame;
+        {
+            std::unique_lock<std::mutex> lock(me->m_mutex);
+            while (me->m_queue.empty() && !me->m_bFinish)
+                me->m_condvar.wait(lock);
+            if (me->m_queue.empty())
+                break;
+            frame = me->m_queue.front();
+            me->m_queue.pop_front();
+        }
+
+        // After an error, keep returning frames until stopped.
+        if (ok) {
+            ok = me->write(frame);
+            if (ok)
+                me->m_nWritten++;
+            else
+                printf("[%s] Error writing frame %u to %s.\n",
+                       me->m_name.c_str(), me->m_nWritten,
+                       me->m_target.c_str());
+        }
+
+        std::lock_guard<std::mutex> lock(me->m_mutex);
+        me->m_free.push_back(frame);
+    }
+
+    if (me->m_pFile) {
+        if (me->m_bPipe)
+            pclose(me->m_pFile);
+        else
+            fclose(me->m_pFile);
+        me->m_pFile = NULL;
+    }
+
+    printf("[%s] Wrote %u frames to %s.\n", me->m_name.c_str(),
+           me->m_nWritten, me->m_target.c_str());
+
+    return 0;
+}
+
+bool FrameCapture::write(Frame *frame)
+{
+    if (m_pFile) {
+        bool ok = writePPM(m_pFile, &frame->rgba[0],
+                           frame->width, frame->height);
+        return (fflush(m_pFile) == 0) && ok;
+    }
+
+    // A printf-style pattern gives one file per frame, checked by
+    // start() to hold a single integer conversion.
+    char filename[1024];
+    snprintf(filename, sizeof(filename), m_target.c_str(), (int)m_nWritten);
+    FILE *f = fopen(filename, "wb");
+    if (!f)
+        return false;
+
+    bool ok = writePPM(f, &frame->rgba[0], frame->width, frame->height);
+    return (fclose(f) == 0) && ok;
+}
+
+int FrameCapture::patternConversions(const char *pattern)
+{
+    int count = 0;
+    for (const char *p = pattern; *p; p++) {
+        if (*p != '%')
+            continue;
+        if (*++p == '%')
+            continue;
+        while (*p >= '0' && *p <= '9')
+            p++;
+        if (*p != 'd' || ++count > 1)
+            return -1;
+    }
+    return count;
+}
+
+bool FrameCapture::writePPM(FILE *f, const unsigned char *rgba,
+                            int width, int height)
+{
+    // PPM rows are top to bottom, GL rows are bottom to top.
+    std::vector<unsigned char> row(width * 3);
+    bool ok = fprintf(f, "P6\n%d %d\n255\n", width, height) > 0;
+    for (int y = height-1; ok && y >= 0; y--) {
+        const unsigned char *p = rgba + y * width * 4;
+        for (int x = 0; x < width; x++) {
+            row[x*3+0] = p[x*4+0];
+            row[x*3+1] = p[x*4+1];
+            row[x*3+2] = p[x*4+2];
+        }
+        ok = fwrite(&row[0], row.size(), 1, f) == 1;
+    }
+    return ok;
+}
@@ -0,0 +1,126 @@
+// -*- mode:c++; indent-tabs-mode:nil; c-basic-offset:4; -*-
+//======================================================================================
+/*
+    This file is part of DIMPLE, the Dynamic Interactive Musically PhysicaL Environment,
+
+    This code is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License("GPL") version 2
+    as published by the Free Software Foundation.  See the file LICENSE
+    for more information.
+
+    sinclair@music.mcgill.ca
+    http://www.music.mcgill.ca/~sinclair/content/dimple
+*/
+//======================================================================================
+
+#ifndef _FRAME_CAPTURE_H_
+#define _FRAME_CAPTURE_H_
+
+#include "config.h"
+
+#ifdef HAVE_MINGW_STD_THREADS
+#include <mingw.thread.h>
+#include <mingw.mutex.h>
+#include <mingw.condition_variable.h>
+#else
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
+
+#include <stdio.h>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <graphics/COpenGLHeaders.h>
+
+//! A FrameCapture records rendered frames as PPM images without
+//! waiting for them.  Each frame is read into one of two pixel
+//! buffers and only copied out a frame later, when the transfer has
+//! finished, and is then written by an encoder thread.  If the
+//! encoder falls behind, frames are dropped rather than holding up
+//! the renderer.
+//!
+//! The target is a file receiving a stream of PPM images, a
+//! printf-style pattern such as "frame%05d.ppm" for one file per
+//! frame, or "|" followed by a command that is given the stream on
+//! its standard input, for example a video encoder.
+class FrameCapture
+{
+  public:
+    FrameCapture(const char *name);
+    virtual ~FrameCapture();
+
+    //! Begin capturing to a target, ending any previous capture.
+    //! Waits for the previous capture's encoder to finish, so it
+    //! must not be called while holding a lock the renderer needs.
+    bool start(const char *target);
+
+    //! Stop capturing; the frames in flight are still written.
+    void stop();
+
+    //! True while frames are being captured.
+    bool active() { return m_bActive; }
+
+    //! Read back the frame just rendered into the current GL
+    //! context.  Must be called on the rendering thread after each
+    //! frame, before buffers are swapped.
+    void capture(int width, int height);
+
+    //! Write an RGBA image, bottom row first, to a stream as PPM.
+    static bool writePPM(FILE *f, const unsigned char *rgba,
+                         int width, int height);
+
+    //! Count the integer conversions ("%d", "%05d") in a file name
+    //! pattern, or return -1 if it has more than one or any other
+    //! conversion than "%%", since it is given to snprintf.
+    static int patternConversions(const char *pattern);
+
+  protected:
+    struct Frame {
+        std::vector<unsigned char> rgba;
+        int width, height;
+    };
+
+    //! Copy a finished read-back into the encoder queue.
+    void collect(int i);
+
+    //! Let the encoder thread finish once its queue is empty.
+    void finish();
+
+    //! Wait for the encoder thread of the last capture to exit.
+    void join();
+
+    //! Function for the encoder thread.
+    static void* encode(void* param);
+
+    //! Write one frame to the target, on the encoder thread.
+    bool write(Frame *frame);
+
+    std::string m_name;          //! prefix for messages
+    std::string m_target;
+
+    // Render thread
+    std::atomic<bool> m_bActive;
+    GLuint m_pbo[2];
+    bool m_bPending[2];
+    int m_nIndex;                //! buffer to read into next
+    int m_nWidth, m_nHeight;     //! size of the pixel buffers
+    unsigned int m_nDropped;
+
+    // Encoder thread
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_condvar;
+    std::deque<Frame*> m_queue;  //! frames waiting to be written
+    std::vector<Frame*> m_free;  //! frames available to fill
+    std::vector<Frame*> m_frames;
+    bool m_bFinish;
+    FILE *m_pFile;
+    bool m_bPipe;
+    unsigned int m_nWritten;
+};
+
+#endif // _FRAME_CAPTURE_H_
@@ -2,11 +2,33 @@
 
 #include "dimple.h"
 #include "HapticsSim.h"
+#include "VisualSim.h"
+#include "MeshCache.h"
+#include "MeshAsset.h"
 #include "devices/CGenericHapticDevice.h"
 #include "devices/CHapticDeviceHandler.h"
 #include "tools/CToolCursor.h"
 #include <memory>
 #include <algorithm>
+#include <math.h>
+#include <string.h>
+
+// Size of the cells of the haptic culling grid, in world units.
+#define HAPTICS_GRID_CELL_SIZE 0.1
+
+// Distance from the cursor within which objects are haptically
+// enabled, in addition to the cursor radius.  Must exceed the
+// distance the cursor can travel in one step.
+#define HAPTICS_GRID_MARGIN 0.05
+
+// Objects covering more cells than this are never culled.
+#define HAPTICS_GRID_MAX_CELLS 4096
+
+// Seconds of haptic steps summarized in each line printed by --timing.
+#define STEP_TIMING_PERIOD 1.0
+
+// Most shapes of each kind kept for reuse
+#define CHAI_POOL_MAX 1024
 
 bool HapticsPrismFactory::create(const char *name, float x, float y, float z)
 {
@@ -64,7 +86,8 @@ bool HapticsMeshFactory::create(const char *name, const char *filename,
 
 HapticsSim::HapticsSim(const char *port)
     : Simulation(port, ST_HAPTICS),
-      m_workspaceScale(1,1,1)
+      m_workspaceScale(1,1,1),
+      m_grid(HAPTICS_GRID_CELL_SIZE)
 {
     m_pPrismFactory = new HapticsPrismFactory(this);
     m_pSphereFactory = new HapticsSphereFactory(this);
@@ -75,6 +98,13 @@ HapticsSim::HapticsSim(const char *port)
 
     m_fTimestep = haptics_timestep_ms/1000.0;
     printf("CHAI timestep: %f\n", m_fTimestep);
+
+    m_bReclaimDone = false;
+
+    m_fStepTimeTotal = 0;
+    m_fStepTimeMax = 0;
+    m_nTimedSteps = 0;
+    m_stepClock.start();
 }
 
 HapticsSim::~HapticsSim()
@@ -83,6 +113,14 @@ HapticsSim::~HapticsSim()
     // is still running and may dereference them.
     stop();
 
+    {
+        std::lock_guard<std::mutex> lock(m_reclaimMutex);
+        m_bReclaimDone = true;
+    }
+    m_reclaimCond.notify_one();
+    if (m_reclaimThread.joinable())
+        m_reclaimThread.join();
+
     if (m_chaiWorld) delete m_chaiWorld;
 }
 
@@ -150,9 +188,70 @@ void HapticsSim::initialize()
 
     m_pGrabbedObject = NULL;
 
+    m_reclaimThread = std::thread(HapticsSim::reclaimer, this);
+
     Simulation::initialize();
 }
 
+void HapticsSim::reclaim(double seconds)
+{
+    if (m_retiredObjects.empty() && m_retiredConstraints.empty())
+        return;
+
+    // Never wait for the reclaimer, try again after the next step.
+    std::unique_lock<std::mutex> lock(m_reclaimMutex, std::try_to_lock);
+    if (!lock.owns_lock())
+        return;
+
+    m_reclaimConstraints.insert(m_reclaimConstraints.end(),
+                                m_retiredConstraints.begin(),
+                                m_retiredConstraints.end());
+    m_reclaimObjects.insert(m_reclaimObjects.end(),
+                            m_retiredObjects.begin(),
+                            m_retiredObjects.end());
+    m_retiredConstraints.clear();
+    m_retiredObjects.clear();
+
+    lock.unlock();
+    m_reclaimCond.notify_one();
+}
+
+void* HapticsSim::reclaimer(void* param)
+{
+    HapticsSim *me = static_cast<HapticsSim*>(param);
+    std::vector<OscConstraint*> constraints;
+    std::vector<OscObject*> objects;
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(me->m_reclaimMutex);
+            while (!me->m_bReclaimDone && me->m_reclaimObjects.empty()
+                   && me->m_reclaimConstraints.empty())
+                me->m_reclaimCond.wait(lock);
+            if (me->m_bReclaimDone)
+                break;
+            constraints.swap(me->m_reclaimConstraints);
+            objects.swap(me->m_reclaimObjects);
+        }
+
+        // Retired objects have already left the world and the haptics
+        // step, so they can be deleted while it runs.  Constraints go
+        // first, since they refer to their objects.
+        std::vector<OscConstraint*>::iterator c;
+        for (c = constraints.begin(); c != constraints.end(); c++)
+            delete *c;
+        constraints.clear();
+
+        std::vector<OscObject*>::iterator o;
+        for (o = objects.begin(); o != objects.end(); o++)
+            delete *o;
+        objects.clear();
+    }
+
+    return 0;
+}
+
 void HapticsSim::updateWorkspace(cVector3d &pos, cVector3d &vel)
 {
     int i;
@@ -198,9 +297,47 @@ void HapticsSim::updateWorkspace(cVector3d &pos, cVector3d &vel)
     }
 }
 
+void HapticsSim::mark_dirty(CHAIObject *obj)
+{
+    if (!obj->m_bDirty) {
+        obj->m_bDirty = true;
+        m_dirty.push_back(obj);
+    }
+}
+
+void HapticsSim::clear_dirty(CHAIObject *obj)
+{
+    if (obj->m_bDirty) {
+        m_dirty.erase(std::remove(m_dirty.begin(), m_dirty.end(), obj),
+                      m_dirty.end());
+        obj->m_bDirty = false;
+    }
+}
+
+void HapticsSim::updateGlobalPositions()
+{
+    // Instead of traversing the whole world, only recompute the
+    // frames of objects that were moved since the last step.  All
+    // objects are direct children of the world.
+    cVector3d pos(m_chaiWorld->getGlobalPos());
+    cMatrix3d rot(m_chaiWorld->getGlobalRot());
+
+    std::vector<CHAIObject*>::iterator it;
+    for (it = m_dirty.begin(); it != m_dirty.end(); it++) {
+        (*it)->m_bDirty = false;
+        (*it)->chai_object()->computeGlobalPositions(true, pos, rot);
+    }
+    m_dirty.clear();
+
+    // The cursor moves with the device on every step.
+    m_cursor->object()->computeGlobalPositions(true, pos, rot);
+}
+
 void HapticsSim::step()
 {
-    m_chaiWorld->computeGlobalPositions(true);
+    double stepStart = m_stepClock.getCurrentTimeSeconds();
+
+    updateGlobalPositions();
 
     cToolCursor *cursor = m_cursor->object();
     cursor->updateFromDevice();
@@ -222,6 +359,10 @@ void HapticsSim::step()
         cursor->setDeviceGlobalForce(0,0,0);
         m_cursor->addCursorGrabbedForce(m_pGrabbedObject);
     } else {
+        // Only objects near the cursor take part in force computation.
+        m_grid.cull(cursor->m_hapticPoint->getGlobalPosProxy(), pos,
+                    m_cursor->m_radius.m_value + HAPTICS_GRID_MARGIN);
+
         cursor->computeInteractionForces();
 
         // Compensate for workspace scaling
@@ -296,6 +437,27 @@ void HapticsSim::step()
                              - m_cursor->m_velocity).length());
         }
     }
+
+    if (haptics_timing)
+        recordStepTime(m_stepClock.getCurrentTimeSeconds() - stepStart);
+}
+
+void HapticsSim::recordStepTime(double seconds)
+{
+    m_fStepTimeTotal += seconds;
+    m_fStepTimeMax = std::max(seconds, m_fStepTimeMax);
+    m_nTimedSteps++;
+
+    if (m_nTimedSteps * m_fTimestep < STEP_TIMING_PERIOD)
+        return;
+
+    printf("[%s] Step time: mean %.1f us, max %.1f us, %d objects\n",
+           type_str(), m_fStepTimeTotal / m_nTimedSteps * 1e6,
+           m_fStepTimeMax * 1e6, (int)world_objects.size());
+
+    m_fStepTimeTotal = 0;
+    m_fStepTimeMax = 0;
+    m_nTimedSteps = 0;
 }
 
 void HapticsSim::findContactObject()
@@ -338,10 +500,11 @@ void HapticsSim::set_grabbed(OscObject *pGrabbed)
     // return previous object to normal state
     if (m_pGrabbedObject) {
         ob = dynamic_cast<CHAIObject*>(m_pGrabbedObject->special());
-        if (ob) ob->chai_object()->setHapticEnabled(true, true);
+        if (ob) ob->chai_object()->setHapticEnabled(ob->is_near(), true);
     }
 
     Simulation::set_grabbed(pGrabbed);
+    m_grid.set_grabbed(m_pGrabbedObject);
 
     // remove new object from haptic contact
     ob = NULL;
@@ -361,10 +524,13 @@ const cHapticDeviceInfo& HapticsSim::getSpecs()
     return m_cursor->getSpecs();
 }
 
-void HapticsSim::clear_contact_object(CHAIObject *pCHAIObject)
+void HapticsSim::forget(CHAIObject *obj)
 {
-    m_pContactObject = nullptr;
-    m_cursor->object()->m_hapticPoint->clearFromContact(pCHAIObject->chai_object());
+    clear_dirty(obj);
+    if (m_pContactObject == obj->obj())
+        m_pContactObject = nullptr;
+    if (m_cursor)
+        m_cursor->object()->m_hapticPoint->clearFromContact(obj->chai_object());
 }
 
 void HapticsSim::on_workspace_size()
@@ -399,6 +565,168 @@ void HapticsSim::on_workspace_standard()
     m_workspace_center.setValue(0,0,0);
 }
 
+/****** HapticsGrid ******/
+
+HapticsGrid::HapticsGrid(double cellSize)
+    : m_fCellSize(cellSize), m_nStamp(0), m_pGrabbed(NULL)
+{
+}
+
+static inline uint64_t grid_key(int x, int y, int z)
+{
+    return ((uint64_t)(x & 0x1fffff) << 42)
+        | ((uint64_t)(y & 0x1fffff) << 21)
+        | (uint64_t)(z & 0x1fffff);
+}
+
+void HapticsGrid::cells(const cVector3d &pos, double radius, int *lo, int *hi)
+{
+    double p[3] = { pos.x(), pos.y(), pos.z() };
+    for (int i=0; i<3; i++) {
+        lo[i] = (int)floor((p[i] - radius) / m_fCellSize);
+        hi[i] = (int)floor((p[i] + radius) / m_fCellSize);
+    }
+}
+
+void HapticsGrid::link(CHAIObject *obj, const int *lo, const int *hi)
+{
+    for (int x=lo[0]; x<=hi[0]; x++)
+        for (int y=lo[1]; y<=hi[1]; y++)
+            for (int z=lo[2]; z<=hi[2]; z++)
+                m_cells[grid_key(x,y,z)].push_back(obj);
+
+    memcpy(obj->m_gridLo, lo, sizeof(obj->m_gridLo));
+    memcpy(obj->m_gridHi, hi, sizeof(obj->m_gridHi));
+    obj->m_bInGrid = true;
+}
+
+void HapticsGrid::unlink(CHAIObject *obj)
+{
+    if (!obj->m_bInGrid)
+        return;
+
+    const int *lo = obj->m_gridLo, *hi = obj->m_gridHi;
+    for (int x=lo[0]; x<=hi[0]; x++)
+        for (int y=lo[1]; y<=hi[1]; y++)
+            for (int z=lo[2]; z<=hi[2]; z++)
+            {
+                std::unordered_map<uint64_t, std::vector<CHAIObject*> >
+                    ::iterator it = m_cells.find(grid_key(x,y,z));
+                if (it == m_cells.end())
+                    continue;
+                std::vector<CHAIObject*> &v = it->second;
+                v.erase(std::remove(v.begin(), v.end(), obj), v.end());
+            }
+
+    obj->m_bInGrid = false;
+}
+
+void HapticsGrid::set_near(CHAIObject *obj, bool bNear)
+{
+    obj->m_bNear = bNear;
+    if (obj->obj() != m_pGrabbed)
+        obj->chai_object()->setHapticEnabled(bNear, true);
+}
+
+void HapticsGrid::update(CHAIObject *obj)
+{
+    int lo[3], hi[3];
+    cells(obj->chai_object()->getLocalPos(), obj->m_fBoundingRadius, lo, hi);
+
+    if (obj->m_bInGrid
+        && memcmp(lo, obj->m_gridLo, sizeof(lo)) == 0
+        && memcmp(hi, obj->m_gridHi, sizeof(hi)) == 0)
+        return;
+
+    bool wasInGrid = obj->m_bInGrid;
+    unlink(obj);
+
+    // Objects in the grid are in m_near exactly when they are
+    // enabled; objects too large to index are always enabled.
+    double count = (double)(hi[0]-lo[0]+1) * (hi[1]-lo[1]+1) * (hi[2]-lo[2]+1);
+    if (count > HAPTICS_GRID_MAX_CELLS) {
+        if (wasInGrid && obj->m_bNear)
+            m_near.erase(std::remove(m_near.begin(), m_near.end(), obj),
+                         m_near.end());
+        if (!obj->m_bNear)
+            set_near(obj, true);
+        return;
+    }
+
+    link(obj, lo, hi);
+
+    if (!wasInGrid && obj->m_bNear)
+        m_near.push_back(obj);
+}
+
+void HapticsGrid::remove(CHAIObject *obj)
+{
+    if (obj->m_bInGrid && obj->m_bNear)
+        m_near.erase(std::remove(m_near.begin(), m_near.end(), obj),
+                     m_near.end());
+    unlink(obj);
+}
+
+// Distance from p to the segment from a to b.
+static double segment_distance(const cVector3d &p, const cVector3d &a,
+                               const cVector3d &b)
+{
+    cVector3d ab = b - a;
+    double len2 = ab.lengthsq();
+    double t = (len2 > 0) ? cClamp((p - a).dot(ab) / len2, 0.0, 1.0) : 0.0;
+    return (p - (a + ab * t)).length();
+}
+
+void HapticsGrid::cull(const cVector3d &proxy, const cVector3d &device,
+                       double margin)
+{
+    m_nStamp++;
+    m_nearNext.clear();
+
+    // Cells of the box around the segment, widened by the margin.
+    int lo[3], hi[3], lo2[3], hi2[3];
+    cells(proxy, margin, lo, hi);
+    cells(device, margin, lo2, hi2);
+    for (int i=0; i<3; i++) {
+        lo[i] = std::min(lo[i], lo2[i]);
+        hi[i] = std::max(hi[i], hi2[i]);
+    }
+
+    for (int x=lo[0]; x<=hi[0]; x++)
+        for (int y=lo[1]; y<=hi[1]; y++)
+            for (int z=lo[2]; z<=hi[2]; z++)
+            {
+                std::unordered_map<uint64_t, std::vector<CHAIObject*> >
+                    ::iterator it = m_cells.find(grid_key(x,y,z));
+                if (it == m_cells.end())
+                    continue;
+
+                std::vector<CHAIObject*>::iterator o;
+                for (o = it->second.begin(); o != it->second.end(); o++)
+                {
+                    CHAIObject *obj = *o;
+                    if (obj->m_nGridStamp == m_nStamp)
+                        continue;
+                    if (segment_distance(obj->chai_object()->getLocalPos(),
+                                         proxy, device)
+                        > obj->m_fBoundingRadius + margin)
+                        continue;
+
+                    obj->m_nGridStamp = m_nStamp;
+                    m_nearNext.push_back(obj);
+                    if (!obj->m_bNear)
+                        set_near(obj, true);
+                }
+            }
+
+    std::vector<CHAIObject*>::iterator o;
+    for (o = m_near.begin(); o != m_near.end(); o++)
+        if ((*o)->m_nGridStamp != m_nStamp)
+            set_near(*o, false);
+
+    m_near.swap(m_nearNext);
+}
+
 /****** CHAIObject ******/
 
 CHAIObject::CHAIObject(OscObject *obj, cGenericObject *chai_obj, cWorld *world)
@@ -406,9 +734,29 @@ CHAIObject::CHAIObject(OscObject *obj, cGenericObject *chai_obj, cWorld *world)
     m_object = obj;
     m_chai_object = chai_obj;
 
+    m_pHaptics = NULL;
+    m_pVisual = NULL;
+    m_bDirty = false;
+    m_bCull = false;
+    m_fBoundingRadius = 0;
+    m_nGridStamp = 0;
+    m_bInGrid = false;
+    m_bNear = true;
+    m_nPickNode = -1;
+
     if (!obj || !chai_obj)
         return;
 
+    m_pHaptics = dynamic_cast<HapticsSim*>(obj->simulation());
+    m_pVisual = dynamic_cast<VisualSim*>(obj->simulation());
+
+    // The cursor and virtual device are never culled.
+    m_bCull = obj->name() != "cursor" && obj->name() != "device";
+
+    // Compute the initial global frame.
+    if (m_pHaptics)
+        m_pHaptics->mark_dirty(this);
+
     obj->m_position.setSetCallback(CHAIObject::on_set_position, this);
     obj->m_rotation.setSetCallback(CHAIObject::on_set_rotation, this);
     obj->m_visible.setSetCallback(CHAIObject::on_set_visible, this);
@@ -419,6 +767,81 @@ CHAIObject::CHAIObject(OscObject *obj, cGenericObject *chai_obj, cWorld *world)
 
 CHAIObject::~CHAIObject()
 {
+    if (m_pHaptics) {
+        m_pHaptics->clear_dirty(this);
+        if (m_bCull)
+            m_pHaptics->grid().remove(this);
+    }
+    if (m_pVisual) {
+        m_pVisual->clear_pose(this);
+        m_pVisual->pickTree().remove(this);
+    }
+}
+
+void CHAIObject::detach()
+{
+    // Haptic objects are deleted on the reclaimer thread, so nothing
+    // of the haptics step may refer to them afterwards.
+    if (m_pHaptics) {
+        if (m_bCull)
+            m_pHaptics->grid().remove(this);
+        m_pHaptics->forget(this);
+        if (m_chai_object->getParent())
+            m_chai_object->getParent()->removeChild(m_chai_object);
+    }
+    if (m_pVisual) {
+        m_pVisual->clear_pose(this);
+        m_pVisual->pickTree().remove(this);
+    }
+
+    m_chai_object->setHapticEnabled(false, true);
+    m_chai_object->setShowEnabled(false, true);
+}
+
+void CHAIObject::on_set_position(void* me, OscVector3 &p)
+{
+    CHAIObject *o = (CHAIObject*)me;
+
+    // The visual simulation applies poses at the start of a frame.
+    if (o->m_pVisual) {
+        o->m_pVisual->set_pose(o, &p, NULL);
+        return;
+    }
+
+    o->chai_object()->setLocalPos(p);
+    if (o->m_pHaptics) {
+        o->m_pHaptics->mark_dirty(o);
+        if (o->m_bCull) o->m_pHaptics->grid().update(o);
+    }
+}
+
+void CHAIObject::on_set_rotation(void* me, OscMatrix3 &r)
+{
+    CHAIObject *o = (CHAIObject*)me;
+
+    if (o->m_pVisual) {
+        o->m_pVisual->set_pose(o, NULL, &r);
+        return;
+    }
+
+    o->chai_object()->setLocalRot(r);
+    if (o->m_pHaptics) o->m_pHaptics->mark_dirty(o);
+}
+
+void CHAIObject::on_bounds()
+{
+    if (!m_chai_object)
+        return;
+
+    // Bounding sphere about the object origin, valid for any rotation.
+    cVector3d vmin(m_chai_object->getBoundaryMin());
+    cVector3d vmax(m_chai_object->getBoundaryMax());
+    m_fBoundingRadius = std::max(vmin.length(), vmax.length());
+
+    if (m_pVisual)
+        m_pVisual->pickTree().update(this);
+    else if (m_pHaptics && m_bCull)
+        m_pHaptics->grid().update(this);
 }
 
 void CHAIObject::on_set_stiffness(void* _me, OscScalar &s)
@@ -473,12 +896,85 @@ void CHAIObject::on_set_texture_image(void* _me, OscString &s)
     }
 }
 
+/****** CHAIShapePool ******/
+
+CHAIShapePool::~CHAIShapePool()
+{
+    std::vector<cGenericObject*>::iterator it;
+    for (it = m_spheres.begin(); it != m_spheres.end(); it++)
+        delete *it;
+    for (it = m_boxes.begin(); it != m_boxes.end(); it++)
+        delete *it;
+}
+
+cGenericObject *CHAIShapePool::take(std::vector<cGenericObject*> &shapes)
+{
+    cGenericObject *shape;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (shapes.empty())
+            return NULL;
+        shape = shapes.back();
+        shapes.pop_back();
+    }
+
+    // Undo anything the previous object's values may have changed.
+    shape->setLocalPos(0, 0, 0);
+    shape->setLocalRot(cIdentity3d());
+    shape->m_material = cMaterial::create();
+    shape->m_texture = nullptr;
+    shape->m_normalMap = nullptr;
+    shape->setUseTexture(false);
+    shape->setShowEnabled(true, true);
+    shape->setHapticEnabled(true, true);
+    return shape;
+}
+
+void CHAIShapePool::give(cGenericObject *shape,
+                         std::vector<cGenericObject*> &shapes)
+{
+    // The virtual device's sphere, and the shapes of haptic objects,
+    // have already left the world.
+    cGenericObject *parent = shape->getParent();
+    if (parent)
+        parent->removeChild(shape);
+    shape->m_userData = NULL;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (shapes.size() < CHAI_POOL_MAX) {
+            shapes.push_back(shape);
+            return;
+        }
+    }
+    delete shape;
+}
+
+// Pool of shapes of an object's simulation, if it keeps one.
+static CHAIShapePool *shape_pool(Simulation *sim)
+{
+    HapticsSim *hap = dynamic_cast<HapticsSim*>(sim);
+    if (hap)
+        return &hap->shapes();
+    VisualSim *vis = dynamic_cast<VisualSim*>(sim);
+    if (vis)
+        return &vis->shapes();
+    return NULL;
+}
+
 /****** OscSphereCHAI ******/
 
 OscSphereCHAI::OscSphereCHAI(cWorld *world, const char *name, OscBase *parent)
     : OscSphere(NULL, name, parent)
 {
-    m_pSphere = new cShapeSphere(m_radius.m_value);
+    CHAIShapePool *pool = shape_pool(simulation());
+    m_pSphere = pool ? pool->takeSphere() : NULL;
+    if (m_pSphere)
+        m_pSphere->setRadius(m_radius.m_value);
+    else {
+        m_pSphere = new cShapeSphere(m_radius.m_value);
+        m_pSphere->createEffectSurface();
+    }
     world->addChild(m_pSphere);
 
     // User data points to the OscObject, used for identification
@@ -489,8 +985,6 @@ OscSphereCHAI::OscSphereCHAI(cWorld *world, const char *name, OscBase *parent)
     // m_pSphere->setUserData(this, 1);
     // How to replace in Chai3d 3.2?
 
-    m_pSphere->createEffectSurface();
-
     HapticsSim *hap = dynamic_cast<HapticsSim*>(simulation());
     if (hap)
     {
@@ -500,12 +994,23 @@ OscSphereCHAI::OscSphereCHAI(cWorld *world, const char *name, OscBase *parent)
     }
 
     m_pSpecial = new CHAIObject(this, m_pSphere, world);
+    ((CHAIObject*)m_pSpecial)->on_bounds();
 }
 
 OscSphereCHAI::~OscSphereCHAI()
 {
-    if (m_pSphere)
+    if (!m_pSphere)
+        return;
+
+    // Spheres given children, like the virtual device's, are not
+    // reused.
+    CHAIShapePool *pool = shape_pool(simulation());
+    if (pool && m_pSphere->getNumChildren() == 0)
+        pool->give(m_pSphere);
+    else if (m_pSphere->getParent())
         m_pSphere->getParent()->deleteChild(m_pSphere);
+    else
+        delete m_pSphere;
 }
 
 void OscSphereCHAI::on_radius()
@@ -516,6 +1021,9 @@ void OscSphereCHAI::on_radius()
         return;
 
     m_pSphere->setRadius(m_radius.m_value);
+
+    if (m_pSpecial)
+        ((CHAIObject*)m_pSpecial)->on_bounds();
 }
 
 void OscSphereCHAI::on_grab()
@@ -528,9 +1036,16 @@ void OscSphereCHAI::on_grab()
 OscPrismCHAI::OscPrismCHAI(cWorld *world, const char *name, OscBase *parent)
     : OscPrism(NULL, name, parent)
 {
-    m_pPrism = new cMesh();
-    createPrism();
-    m_pPrism->computeBoundaryBox();
+    // Prisms are analytic boxes: contact and penetration are computed
+    // in closed form instead of by testing each triangle of a mesh.
+    CHAIShapePool *pool = shape_pool(simulation());
+    m_pPrism = pool ? pool->takeBox() : NULL;
+    if (m_pPrism)
+        m_pPrism->setSize(m_size.x(), m_size.y(), m_size.z());
+    else {
+        m_pPrism = new cShapeBox(m_size.x(), m_size.y(), m_size.z());
+        m_pPrism->createEffectSurface();
+    }
     m_pPrism->m_material->setBlueLight();
 
     world->addChild(m_pPrism);
@@ -539,14 +1054,6 @@ OscPrismCHAI::OscPrismCHAI(cWorld *world, const char *name, OscBase *parent)
     // during object contact.
     m_pPrism->m_userData = this;
 
-    // We use two force algorithms because the finger proxy algorithm
-    // handles better near corners, but potential field recovers
-    // better from pop-through issues.
-    m_pPrism->createBruteForceCollisionDetector();
-    m_pPrism->createEffectSurface();
-
-    // We divide the stiffness by 2 because there are two force
-    // algorithms engaged which are additive.
     HapticsSim *hap = dynamic_cast<HapticsSim*>(simulation());
     if (hap)
     {
@@ -556,177 +1063,28 @@ OscPrismCHAI::OscPrismCHAI(cWorld *world, const char *name, OscBase *parent)
     }
 
     m_pSpecial = new CHAIObject(this, m_pPrism, world);
+    ((CHAIObject*)m_pSpecial)->on_bounds();
 }
 
 OscPrismCHAI::~OscPrismCHAI()
 {
-    HapticsSim *hap = dynamic_cast<HapticsSim*>(simulation());
-    if (hap && hap->contact_object() == this)
-    {
-        hap->clear_contact_object((CHAIObject*)m_pSpecial);
-    }
-
+    // The haptic contact was already cleared when the object was
+    // retired.
     if (m_pPrism) {
-        m_pPrism->getParent()->deleteChild(m_pPrism);
-    }
-}
-
-// This function borrowed from dynamic_ode example in CHAI.
-void OscPrismCHAI::createPrism(bool openbox)
-{
-    int n;
-    int cur_index = 0;
-    int start_index = 0;
-
-    // +x face
-    m_pPrism->newVertex( m_size.x()/2,  m_size.y()/2, -m_size.z()/2);
-    m_pPrism->newVertex( m_size.x()/2,  m_size.y()/2,  m_size.z()/2);
-    m_pPrism->newVertex( m_size.x()/2, -m_size.y()/2, -m_size.z()/2);
-    m_pPrism->newTriangle(cur_index,cur_index+1,cur_index+2);
-    cur_index+=3;
-
-    m_pPrism->newVertex( m_size.x()/2, -m_size.y()/2, -m_size.z()/2);
-    m_pPrism->newVertex( m_size.x()/2,  m_size.y()/2,  m_size.z()/2);
-    m_pPrism->newVertex( m_size.x()/2, -m_size.y()/2,  m_size.z()/2);
-    m_pPrism->newTriangle(cur_index,cur_index+1,cur_index+2);
-    cur_index+=3;
-
-    for(n=start_index; n<cur_index; n++) {
-        m_pPrism->m_vertices->setTexCoord(n,
-            (m_pPrism->m_vertices->getLocalPos(n).y() + m_size.x()/2) / (2.0 * m_size.z()/2),
-            (m_pPrism->m_vertices->getLocalPos(n).z() + m_size.x()/2) / (2.0 * m_size.y()/2)
-            );
-        m_pPrism->m_vertices->setNormal(n,1,0,0);
-    }
-
-    start_index += 6;
-
-    // -x face
-    m_pPrism->newVertex(-m_size.x()/2,  m_size.y()/2,  m_size.z()/2);
-    m_pPrism->newVertex(-m_size.x()/2,  m_size.y()/2, -m_size.z()/2);
-    m_pPrism->newVertex(-m_size.x()/2, -m_size.y()/2, -m_size.z()/2);
-    m_pPrism->newTriangle(cur_index,cur_index+1,cur_index+2);
-    cur_index+=3;
-
-    m_pPrism->newVertex(-m_size.x()/2,  m_size.y()/2,  m_size.z()/2);
-    m_pPrism->newVertex(-m_size.x()/2, -m_size.y()/2, -m_size.z()/2);
-    m_pPrism->newVertex(-m_size.x()/2, -m_size.y()/2,  m_size.z()/2);
-    m_pPrism->newTriangle(cur_index,cur_index+1,cur_index+2);
-    cur_index+=3;
-
-    for(n=start_index; n<cur_index; n++) {
-        m_pPrism->m_vertices->setTexCoord(n,
-            (m_pPrism->m_vertices->getLocalPos(n).y() + m_size.x()/2) / (2.0 * m_size.z()/2),
-            (m_pPrism->m_vertices->getLocalPos(n).z() + m_size.x()/2) / (2.0 * m_size.y()/2)
-            );
-        m_pPrism->m_vertices->setNormal(n,-1,0,0);
-    }
-
-    start_index += 6;
-
-    // +y face
-    m_pPrism->newVertex(m_size.x()/2,  m_size.y()/2,  m_size.z()/2);
-    m_pPrism->newVertex(m_size.x()/2,  m_size.y()/2, -m_size.z()/2);
-    m_pPrism->newVertex(-m_size.x()/2, m_size.y()/2, -m_size.z()/2);
-    m_pPrism->newTriangle(cur_index,cur_index+1,cur_index+2);
-    cur_index+=3;
-
-    m_pPrism->newVertex(m_size.x()/2,  m_size.y()/2,  m_size.z()/2);
-    m_pPrism->newVertex(-m_size.x()/2, m_size.y()/2, -m_size.z()/2);
-    m_pPrism->newVertex(-m_size.x()/2, m_size.y()/2,  m_size.z()/2);
-    m_pPrism->newTriangle(cur_index,cur_index+1,cur_index+2);
-    cur_index+=3;
-
-    for(n=start_index; n<cur_index; n++) {
-        m_pPrism->m_vertices->setTexCoord(n,
-            (m_pPrism->m_vertices->getLocalPos(n).x() + m_size.y()/2) / (2.0 * m_size.z()/2),
-            (m_pPrism->m_vertices->getLocalPos(n).z() + m_size.x()/2) / (2.0 * m_size.y()/2)
-            );
-        m_pPrism->m_vertices->setNormal(n,0,1,0);
-    }
-
-    start_index += 6;
-
-    // -y face
-    m_pPrism->newVertex(m_size.x()/2,  -m_size.y()/2,  m_size.z()/2);
-    m_pPrism->newVertex(-m_size.x()/2, -m_size.y()/2, -m_size.z()/2);
-    m_pPrism->newVertex(m_size.x()/2,  -m_size.y()/2, -m_size.z()/2);
-    m_pPrism->newTriangle(cur_index,cur_index+1,cur_index+2);
-    cur_index+=3;
-
-    m_pPrism->newVertex(-m_size.x()/2, -m_size.y()/2, -m_size.z()/2);
-    m_pPrism->newVertex(m_size.x()/2,  -m_size.y()/2,  m_size.z()/2);
-    m_pPrism->newVertex(-m_size.x()/2, -m_size.y()/2,  m_size.z()/2);
-    m_pPrism->newTriangle(cur_index,cur_index+1,cur_index+2);
-    cur_index+=3;
-
-    for(n=start_index; n<cur_index; n++) {
-        m_pPrism->m_vertices->setTexCoord(n,
-            (m_pPrism->m_vertices->getLocalPos(n).x() + m_size.y()/2) / (2.0 * m_size.z()/2),
-            (m_pPrism->m_vertices->getLocalPos(n).z() + m_size.x()/2) / (2.0 * m_size.y()/2)
-            );
-        m_pPrism->m_vertices->setNormal(n,0,-1,0);
-    }
-
-    start_index += 6;
-
-    // -z face
-    m_pPrism->newVertex(-m_size.x()/2, -m_size.y()/2, -m_size.z()/2);
-    m_pPrism->newVertex(m_size.x()/2,   m_size.y()/2, -m_size.z()/2);
-    m_pPrism->newVertex(m_size.x()/2,  -m_size.y()/2, -m_size.z()/2);
-    m_pPrism->newTriangle(cur_index,cur_index+1,cur_index+2);
-    cur_index+=3;
-
-    m_pPrism->newVertex( m_size.x()/2,  m_size.y()/2, -m_size.z()/2);
-    m_pPrism->newVertex(-m_size.x()/2, -m_size.y()/2, -m_size.z()/2);
-    m_pPrism->newVertex(-m_size.x()/2,  m_size.y()/2, -m_size.z()/2);
-    m_pPrism->newTriangle(cur_index,cur_index+1,cur_index+2);
-    cur_index+=3;
-
-    for(n=start_index; n<cur_index; n++) {
-        m_pPrism->m_vertices->setTexCoord(n,
-            (m_pPrism->m_vertices->getLocalPos(n).x() + m_size.y()/2) / (2.0 * m_size.z()/2),
-            (m_pPrism->m_vertices->getLocalPos(n).y() + m_size.x()/2) / (2.0 * m_size.y()/2)
-            );
-        m_pPrism->m_vertices->setNormal(n,0,0,-1);
-    }
-
-    start_index += 6;
-
-    if (!openbox) {
-
-        // +z face
-        m_pPrism->newVertex(-m_size.x()/2, -m_size.y()/2, m_size.z()/2);
-        m_pPrism->newVertex(m_size.x()/2,  -m_size.y()/2, m_size.z()/2);
-        m_pPrism->newVertex(m_size.x()/2,  m_size.y()/2,  m_size.z()/2);
-        m_pPrism->newTriangle(cur_index,cur_index+1,cur_index+2);
-        cur_index+=3;
-
-        m_pPrism->newVertex(-m_size.x()/2, -m_size.y()/2, m_size.z()/2);
-        m_pPrism->newVertex( m_size.x()/2,  m_size.y()/2, m_size.z()/2);
-        m_pPrism->newVertex(-m_size.x()/2,  m_size.y()/2, m_size.z()/2);
-        m_pPrism->newTriangle(cur_index,cur_index+1,cur_index+2);
-        cur_index+=3;
-
-        for(n=start_index; n<cur_index; n++) {
-            m_pPrism->m_vertices->setTexCoord(n,
-                (m_pPrism->m_vertices->getLocalPos(n).x() + m_size.y()/2) / (2.0 * m_size.z()/2),
-                (m_pPrism->m_vertices->getLocalPos(n).y() + m_size.x()/2) / (2.0 * m_size.y()/2)
-                );
-            m_pPrism->m_vertices->setNormal(n,0,0,1);
-        }
-
-        start_index += 6;
+        CHAIShapePool *pool = shape_pool(simulation());
+        if (pool)
+            pool->give(m_pPrism);
+        else if (m_pPrism->getParent())
+            m_pPrism->getParent()->deleteChild(m_pPrism);
+        else
+            delete m_pPrism;
     }
 }
 
 void OscPrismCHAI::on_size()
 {
-    cVector3d curSize = m_pPrism->getBoundaryMax() - m_pPrism->getBoundaryMin();
-    cVector3d scale(1.0/curSize.x(), 1.0/curSize.y(), 1.0/curSize.z());
-    m_pPrism->scaleXYZ(scale.x()*m_size.x(),
-                       scale.y()*m_size.y(),
-                       scale.z()*m_size.z());
+    m_pPrism->setSize(m_size.x(), m_size.y(), m_size.z());
+    ((CHAIObject*)m_pSpecial)->on_bounds();
 }
 
 void OscPrismCHAI::on_grab()
@@ -738,14 +1096,19 @@ void OscPrismCHAI::on_grab()
 
 OscMeshCHAI::OscMeshCHAI(cWorld *world, const char *name, const char *filename,
                          OscBase *parent)
-    : OscMesh(NULL, name, filename, parent)
+    : OscMesh(NULL, name, filename, parent),
+      m_filename(filename), m_bShared(false), m_nLevels(0), m_nLevel(0)
 {
-    m_pMesh = new cMultiMesh();
+    HapticsSim *hap = dynamic_cast<HapticsSim*>(simulation());
 
-    if (!m_pMesh->loadFromFile(filename)) {
+    // Geometry is shared between all instances of the same file in
+    // all simulations.  The haptics simulation does not need the
+    // materials stored in the file, so it may use an asset restored
+    // from the mesh cache instead of parsing the file.
+    m_asset = MeshAsset::acquire(filename, m_collision_radius.m_value, !hap);
+    if (!m_asset) {
         printf("[%s] Unable to load %s for object %s.\n",
                simulation()->type_str(), filename, name);
-        delete m_pMesh;
         m_pMesh = NULL;
         return;
     }
@@ -753,19 +1116,10 @@ OscMeshCHAI::OscMeshCHAI(cWorld *world, const char *name, const char *filename,
     printf("[%s] Loaded %s for object %s.\n",
            simulation()->type_str(), filename, name);
 
-    // center the mesh
-    m_pMesh->computeBoundaryBox();
-    cVector3d vmin = m_pMesh->getBoundaryMin();
-    cVector3d vmax = m_pMesh->getBoundaryMax();
-    m_pMesh->translate((vmax-vmin*3)/2);
-
-    // size it to 0.1 without changing proportions
-    float size = (vmax-vmin).length();
-    m_size.setValue(0.1/size, 0.1/size, 0.1/size);
-    on_size();
-
-    /* setup collision detector */
-    m_pMesh->createAABBCollisionDetector(0.01 /* TODO make variable OSC-accessible? */);
+    m_pMesh = m_asset->instantiate(m_collision_radius.m_value);
+    m_pMesh->computeBoundaryBox(true);
+    m_size.setValue(m_asset->size(), false);
+    m_bShared = true;
 
     world->addChild(m_pMesh);
 
@@ -775,7 +1129,6 @@ OscMeshCHAI::OscMeshCHAI(cWorld *world, const char *name, const char *filename,
 
     // We do not call createEffectSurface() for cMesh since
     // finger-proxy algorithm is engaged.
-    HapticsSim *hap = dynamic_cast<HapticsSim*>(simulation());
     if (hap)
     {
         m_pMesh->m_material->setStiffness(
@@ -784,23 +1137,129 @@ OscMeshCHAI::OscMeshCHAI(cWorld *world, const char *name, const char *filename,
     }
 
     m_pSpecial = new CHAIObject(this, m_pMesh, world);
+    ((CHAIObject*)m_pSpecial)->on_bounds();
+
+    // The visual simulation draws distant meshes with fewer triangles.
+    VisualSim *vis = dynamic_cast<VisualSim*>(simulation());
+    if (vis) {
+        createLevels();
+        if (m_nLevels > 0)
+            vis->add_lod_mesh(this);
+    }
 }
 
 OscMeshCHAI::~OscMeshCHAI()
 {
-    if (m_pMesh)
-        m_pMesh->getParent()->deleteChild(m_pMesh);
+    VisualSim *vis = dynamic_cast<VisualSim*>(simulation());
+    if (vis)
+        vis->remove_lod_mesh(this);
+
+    if (m_pMesh) {
+        if (m_pMesh->getParent())
+            m_pMesh->getParent()->deleteChild(m_pMesh);
+        else
+            delete m_pMesh;
+    }
+}
+
+void OscMeshCHAI::createLevels()
+{
+    m_levels.clear();
+    m_levels.resize(m_pMesh->getNumMeshes());
+    m_nLevels = 0;
+    m_nLevel = 0;
+
+    for (int i = 0; i < m_pMesh->getNumMeshes(); i++)
+    {
+        cMesh *mesh = m_pMesh->getMesh(i);
+        m_levels[i].push_back(mesh->m_triangles);
+
+        for (int l = 1; l <= m_asset->numLevels(i); l++) {
+            const std::vector<unsigned int> &tris = m_asset->level(i, l);
+            cTriangleArrayPtr triangles = cTriangleArray::create(mesh->m_vertices);
+            for (unsigned int t = 0; t + 2 < tris.size(); t += 3)
+                triangles->newTriangle(tris[t], tris[t+1], tris[t+2]);
+            m_levels[i].push_back(triangles);
+        }
+
+        m_nLevels = std::max(m_nLevels, m_asset->numLevels(i));
+    }
+}
+
+bool OscMeshCHAI::setLevel(int level)
+{
+    level = std::min(std::max(level, 0), m_nLevels);
+    if (level == m_nLevel)
+        return false;
+
+    for (unsigned int i = 0; i < m_levels.size(); i++) {
+        int l = std::min(level, (int)m_levels[i].size() - 1);
+        m_pMesh->getMesh(i)->m_triangles = m_levels[i][l];
+    }
+
+    m_nLevel = level;
+    return true;
 }
 
 void OscMeshCHAI::on_size()
 {
+    // Modify the full-resolution triangles.
+    setLevel(0);
+
+    // Resizing modifies vertices, so stop sharing them with the asset.
+    double radius = m_collision_radius.m_value;
+    if (m_bShared) {
+        for (int i = 0; i < m_pMesh->getNumMeshes(); i++)
+            MeshAsset::detach(m_pMesh->getMesh(i), radius);
+        m_bShared = false;
+    }
+
     m_pMesh->computeBoundaryBox(true);
     cVector3d vmin(m_pMesh->getBoundaryMin());
     cVector3d vmax(m_pMesh->getBoundaryMax());
-    cVector3d scale(vmax - vmin);
-    m_pMesh->scaleXYZ(m_size.x() / scale.x(),
-                      m_size.y() / scale.y(),
-                      m_size.z() / scale.z());
+    cVector3d scale(m_size.x() / (vmax.x() - vmin.x()),
+                    m_size.y() / (vmax.y() - vmin.y()),
+                    m_size.z() / (vmax.z() - vmin.z()));
+    m_pMesh->scaleXYZ(scale.x(), scale.y(), scale.z());
+
+    // The collision trees are scaled with the vertices rather than
+    // rebuilt, which would take too long on the haptics thread.
+    rescaleCollisionDetector(scale, radius);
+
+    // Simplified levels must use the new vertices.
+    if (!m_levels.empty())
+        createLevels();
+
+    ((CHAIObject*)m_pSpecial)->on_bounds();
+}
+
+void OscMeshCHAI::on_collision_radius()
+{
+    if (m_pMesh)
+        rescaleCollisionDetector(cVector3d(1, 1, 1),
+                                 m_collision_radius.m_value);
+}
+
+void OscMeshCHAI::rescaleCollisionDetector(const cVector3d &scale,
+                                           double radius)
+{
+    // Each instance owns its trees, which are always over the
+    // full-resolution triangles.
+    int level = m_nLevel;
+    setLevel(0);
+
+    for (int i = 0; i < m_pMesh->getNumMeshes(); i++)
+    {
+        cMesh *sub = m_pMesh->getMesh(i);
+        cCollisionAABBCached *c =
+            dynamic_cast<cCollisionAABBCached*>(sub->getCollisionDetector());
+        if (c)
+            c->rescale(scale, radius);
+        else
+            cCollisionAABBCached::copy(NULL, sub, radius);
+    }
+
+    setLevel(level);
 }
 
 /****** OscCursorCHAI ******/
@@ -15,9 +15,84 @@
 #include <tools/CToolCursor.h>
 #include <devices/CGenericHapticDevice.h>
 
+#include <stdint.h>
+#include <unordered_map>
+
 class OscCursorCHAI;
 class OscHapticsVirtdevCHAI;
 class CHAIObject;
+class MeshAsset;
+class VisualSim;
+
+//! A uniform grid over the haptic objects of the world, used to
+//! enable haptic interaction only for objects near the cursor, so
+//! that the cost of each haptic step depends on how many objects are
+//! nearby rather than on the size of the scene.
+class HapticsGrid
+{
+  public:
+    HapticsGrid(double cellSize);
+
+    //! Insert or move an object according to its position and
+    //! bounding radius.
+    void update(CHAIObject *obj);
+
+    //! Remove an object from the grid.
+    void remove(CHAIObject *obj);
+
+    //! Enable haptics for objects within margin of the segment from
+    //! the proxy to the device position, and disable it for objects
+    //! that are no longer near, so that whatever holds the proxy back
+    //! stays enabled however far the device goes.  The grabbed object
+    //! is left disabled.
+    void cull(const cVector3d &proxy, const cVector3d &device,
+              double margin);
+
+    //! Set the object whose haptics are left disabled, so that
+    //! neither cull() nor update() enables it while it is grabbed.
+    void set_grabbed(OscObject *pGrabbed) { m_pGrabbed = pGrabbed; }
+
+  protected:
+    void cells(const cVector3d &pos, double radius, int *lo, int *hi);
+    void link(CHAIObject *obj, const int *lo, const int *hi);
+    void unlink(CHAIObject *obj);
+    void set_near(CHAIObject *obj, bool bNear);
+
+    double m_fCellSize;
+    unsigned int m_nStamp;
+    OscObject *m_pGrabbed;
+    std::unordered_map<uint64_t, std::vector<CHAIObject*> > m_cells;
+    std::vector<CHAIObject*> m_near;      //! objects currently enabled
+    std::vector<CHAIObject*> m_nearNext;
+};
+
+//! Shapes of destroyed spheres and prisms, removed from the world and
+//! kept for reuse by new objects of the same kind, so that objects
+//! created and destroyed continually do not rebuild them each time.
+class CHAIShapePool
+{
+  public:
+    virtual ~CHAIShapePool();
+
+    //! Take a shape with default material, pose and texture, or
+    //! return NULL if there are none.
+    cShapeSphere *takeSphere() { return static_cast<cShapeSphere*>(take(m_spheres)); }
+    cShapeBox *takeBox() { return static_cast<cShapeBox*>(take(m_boxes)); }
+
+    //! Remove a shape from its parent and keep it for reuse.
+    void give(cShapeSphere *sphere) { give(sphere, m_spheres); }
+    void give(cShapeBox *box) { give(box, m_boxes); }
+
+  protected:
+    cGenericObject *take(std::vector<cGenericObject*> &shapes);
+    void give(cGenericObject *shape, std::vector<cGenericObject*> &shapes);
+
+    std::vector<cGenericObject*> m_spheres;
+    std::vector<cGenericObject*> m_boxes;
+
+    //! Shapes are given back by the haptics reclaimer thread.
+    std::mutex m_mutex;
+};
 
 class HapticsSim : public Simulation
 {
@@ -28,7 +103,10 @@ class HapticsSim : public Simulation
     cWorld *world() { return m_chaiWorld; }
 
     OscObject *contact_object() { return m_pContactObject; }
-    void clear_contact_object(CHAIObject *pCHAIObject);
+
+    //! Drop every reference the haptics step keeps to an object that
+    //! is being retired.
+    void forget(CHAIObject *obj);
 
     //! Set the grabbed object or ungrab by setting to NULL.
     virtual void set_grabbed(OscObject *pGrabbed);
@@ -43,11 +121,20 @@ class HapticsSim : public Simulation
 
     const cHapticDeviceInfo& getSpecs();
 
+    HapticsGrid& grid() { return m_grid; }
+    CHAIShapePool& shapes() { return m_shapes; }
+
+    //! Schedule an object's global frame to be recomputed at the
+    //! next step.
+    void mark_dirty(CHAIObject *obj);
+    void clear_dirty(CHAIObject *obj);
+
   protected:
     virtual void initialize();
     virtual void step();
 
     void findContactObject();
+    void updateGlobalPositions();
     void updateWorkspace(cVector3d &pos, cVector3d &vel);
 
     OscObject *m_pContactObject;
@@ -63,10 +150,37 @@ class HapticsSim : public Simulation
     //! A step counter
     int m_counter;
 
+    //! Time taken by steps since the last line printed by --timing.
+    void recordStepTime(double seconds);
+    cPrecisionClock m_stepClock;
+    double m_fStepTimeTotal;
+    double m_fStepTimeMax;
+    int m_nTimedSteps;
+
     cWorld* m_chaiWorld;            //! the world in which we will create our environment
     OscCursorCHAI* m_cursor;    //! An OscObject representing the 3D cursor.
     OscHapticsVirtdevCHAI* m_pVirtdev;
 
+    //! Spatial index used to cull haptic objects far from the cursor.
+    HapticsGrid m_grid;
+
+    //! Shapes of destroyed objects.
+    CHAIShapePool m_shapes;
+
+    //! Objects whose position or rotation changed since the last step.
+    std::vector<CHAIObject*> m_dirty;
+
+    //! Retired objects are handed to a background thread for
+    //! deletion, so that the haptic loop never pays for it.
+    virtual void reclaim(double seconds);
+    static void* reclaimer(void* param);
+    std::thread m_reclaimThread;
+    std::mutex m_reclaimMutex;
+    std::condition_variable m_reclaimCond;
+    std::vector<OscObject*> m_reclaimObjects;
+    std::vector<OscConstraint*> m_reclaimConstraints;
+    bool m_bReclaimDone;
+
     friend OscHapticsVirtdevCHAI;
 };
 
@@ -113,17 +227,48 @@ public:
     CHAIObject(OscObject *obj, cGenericObject *chai_obj, cWorld *world);
     virtual ~CHAIObject();
 
+    //! Hide the shape and disable its haptics when destroyed.
+    virtual void detach();
+
     virtual OscObject *obj() { return m_object; }
     virtual cGenericObject *chai_object() { return m_chai_object; }
 
+    //! Update the haptic culling grid, or the visual picking tree,
+    //! after the object's extent has changed.
+    void on_bounds();
+
+    //! False if haptics are culled because the cursor is far away.
+    bool is_near() { return m_bNear; }
+
 protected:
     OscObject *m_object;
     cGenericObject *m_chai_object;
 
-    static void on_set_position(void* me, OscVector3 &p)
-        { ((CHAIObject*)me)->chai_object()->setLocalPos(p); }
-    static void on_set_rotation(void* me, OscMatrix3 &r)
-        { ((CHAIObject*)me)->chai_object()->setLocalRot(r); }
+    //! The haptics simulation, or NULL in the visual simulation.
+    HapticsSim *m_pHaptics;
+
+    //! The visual simulation, or NULL in the haptics simulation.
+    VisualSim *m_pVisual;
+
+    //! True if the global frame must be recomputed.
+    bool m_bDirty;
+    friend class HapticsSim;
+
+    // State of this object in the HapticsGrid
+    bool m_bCull;
+    double m_fBoundingRadius;
+    int m_gridLo[3], m_gridHi[3];
+    unsigned int m_nGridStamp;
+    bool m_bInGrid;
+    bool m_bNear;
+    friend class HapticsGrid;
+
+    // State of this object in the visual PickTree
+    int m_nPickNode;
+    friend class PickTree;
+
+    static void on_set_position(void* me, OscVector3 &p);
+    static void on_set_rotation(void* me, OscMatrix3 &r);
     static void on_set_visible(void* me, OscBoolean &v)
         { ((CHAIObject*)me)->chai_object()->setShowEnabled(v.m_value, true); }
     static void on_set_stiffness(void* me, OscScalar &s);
@@ -171,7 +316,7 @@ public:
     OscPrismCHAI(cWorld *world, const char *name, OscBase *parent=NULL);
     virtual ~OscPrismCHAI();
 
-    virtual cMesh *object() { return m_pPrism; }
+    virtual cShapeBox *object() { return m_pPrism; }
 
 protected:
     virtual void on_size();
@@ -184,10 +329,7 @@ protected:
         { object()->m_material->setDynamicFriction(m_friction_dynamic.m_value); }
     virtual void on_grab();
 
-    //! Create a cMesh with a prism structure.
-    void createPrism(bool openbox=false);
-
-    cMesh *m_pPrism;
+    cShapeBox *m_pPrism;
 };
 
 class OscMeshCHAI : public OscMesh
@@ -199,6 +341,13 @@ public:
 
     virtual cMultiMesh *object() { return m_pMesh; }
 
+    //! Draw the given level of detail, 0 being full resolution.
+    //! Returns true if this changed what is drawn.
+    bool setLevel(int level);
+
+    //! Number of simplified levels of detail available.
+    int numLevels() { return m_nLevels; }
+
 protected:
     virtual void on_color()
         { object()->m_material->m_diffuse.set(m_color.x(), m_color.y(), m_color.z()); }
@@ -207,8 +356,27 @@ protected:
     virtual void on_friction_dynamic()
         { object()->m_material->setDynamicFriction(m_friction_dynamic.m_value); }
     virtual void on_size();
+    virtual void on_collision_radius();
+
+    //! Adapt the AABB collision trees to the vertices being scaled
+    //! by a factor per axis and to a collision radius.
+    void rescaleCollisionDetector(const cVector3d &scale, double radius);
+
+    //! Create triangle arrays for the asset's levels of detail over
+    //! the current vertices of each sub-mesh.
+    void createLevels();
 
     cMultiMesh *m_pMesh;
+    std::string m_filename;
+    std::shared_ptr<MeshAsset> m_asset;
+    bool m_bShared;     //! True while vertices are shared with m_asset.
+
+    //! Triangles of each level of detail, [sub-mesh][level].  Only the
+    //! triangle arrays differ, the vertices are shared.  The collision
+    //! tree always refers to level 0.
+    std::vector<std::vector<cTriangleArrayPtr> > m_levels;
+    int m_nLevels;
+    int m_nLevel;
 };
 
 class OscCursorCHAI : public OscSphere
@@ -4,6 +4,33 @@
 #include "InterfaceSim.h"
 #include "HapticsSim.h"
 
+#include <algorithm>
+
+// Most records forwarded in one create_many message, to keep each
+// message small in the queues of the other simulations.
+#define CREATE_MANY_CHUNK 128
+
+//! Forward a create_many batch of count records of n values each to
+//! the other simulations, in chunks that give the index of their
+//! first record.  Objects is the object prefix of ball joints, or
+//! NULL for prisms and spheres.
+static void forward_many(Simulation *sim, const char *path,
+                         const char *prefix, const char *objects,
+                         lo_blob blob, int count, int n, int first)
+{
+    const char *data = (const char*)lo_blob_dataptr(blob);
+    for (int i=0; i < count; i += CREATE_MANY_CHUNK)
+    {
+        int chunk = std::min(CREATE_MANY_CHUNK, count - i);
+        lo_blob b = lo_blob_new(chunk*n*4, data + i*n*4);
+        if (objects)
+            sim->send(0, path, "ssbi", prefix, objects, b, first + i);
+        else
+            sim->send(0, path, "sbi", prefix, b, first + i);
+        lo_blob_free(b);
+    }
+}
+
 bool InterfacePrismFactory::create(const char *name, float x, float y, float z)
 {
     printf("InterfacePrismFactory (%s) is creating a prism object called '%s'\n",
@@ -22,6 +49,35 @@ bool InterfacePrismFactory::create(const char *name, float x, float y, float z)
     return true;
 }
 
+void InterfacePrismFactory::create_many(const char *prefix,
+                                        const lo_pcast32 *records,
+                                        int count, int first, lo_blob blob)
+{
+    char name[256];
+    for (int i=0; i<count; i++)
+    {
+        const lo_pcast32 *r = records + i*6;
+        snprintf(name, sizeof(name), "%s%d", prefix, first+i);
+
+        if (simulation()->find_object(name)) {
+            printf("[%s] Already an object named %s\n",
+                   simulation()->type_str(), name);
+            continue;
+        }
+
+        OscPrism *obj = new OscPrismInterface(NULL, name, m_parent);
+        if (!(obj && simulation()->add_object(*obj)))
+            continue;
+
+        obj->m_position.setValue(r[0].f, r[1].f, r[2].f, false);
+        obj->setSize(r[3].f, r[4].f, r[5].f, false);
+        obj->traceOn();
+    }
+
+    forward_many(simulation(), "/world/prism/create_many", prefix, NULL,
+                 blob, count, 6, first);
+}
+
 bool InterfaceSphereFactory::create(const char *name, float x, float y, float z)
 {
     OscSphere *obj = new OscSphereInterface(NULL, name, m_parent);
@@ -37,6 +93,35 @@ bool InterfaceSphereFactory::create(const char *name, float x, float y, float z)
     return true;
 }
 
+void InterfaceSphereFactory::create_many(const char *prefix,
+                                         const lo_pcast32 *records,
+                                         int count, int first, lo_blob blob)
+{
+    char name[256];
+    for (int i=0; i<count; i++)
+    {
+        const lo_pcast32 *r = records + i*4;
+        snprintf(name, sizeof(name), "%s%d", prefix, first+i);
+
+        if (simulation()->find_object(name)) {
+            printf("[%s] Already an object named %s\n",
+                   simulation()->type_str(), name);
+            continue;
+        }
+
+        OscSphere *obj = new OscSphereInterface(NULL, name, m_parent);
+        if (!(obj && simulation()->add_object(*obj)))
+            continue;
+
+        obj->m_position.setValue(r[0].f, r[1].f, r[2].f, false);
+        obj->setRadius(r[3].f, false);
+        obj->traceOn();
+    }
+
+    forward_many(simulation(), "/world/sphere/create_many", prefix, NULL,
+                 blob, count, 4, first);
+}
+
 bool InterfaceMeshFactory::create(const char *name, const char *filename,
                                   float x, float y, float z)
 {
@@ -153,6 +238,35 @@ bool InterfaceBallJointFactory::create(const char *name, OscObject *object1,
     return true;
 }
 
+void InterfaceBallJointFactory::create_many(const char *prefix,
+                                            const char *objects,
+                                            const lo_pcast32 *records,
+                                            int count, int first,
+                                            lo_blob blob)
+{
+    char name[256];
+    for (int i=0; i<count; i++)
+    {
+        const lo_pcast32 *r = records + i*5;
+        snprintf(name, sizeof(name), "%s%d", prefix, first+i);
+
+        OscObject *object1, *object2;
+        if (!find_objects(name, objects, r[0].i, r[1].i, object1, object2))
+            continue;
+
+        OscBallJoint *cons = new OscBallJointInterface(name, m_parent,
+                                                       object1, object2,
+                                                       r[2].f, r[3].f, r[4].f);
+        if (!(cons && simulation()->add_constraint(*cons)))
+            continue;
+
+        cons->traceOn();
+    }
+
+    forward_many(simulation(), "/world/ball/create_many", prefix, objects,
+                 blob, count, 5, first);
+}
+
 bool InterfaceSlideFactory::create(const char *name, OscObject *object1,
                                        OscObject *object2, double ax,
                                        double ay, double az)
@@ -222,7 +336,9 @@ bool InterfaceUniversalFactory::create(const char *name, OscObject *object1,
 /****** InterfaceSim ******/
 
 InterfaceSim::InterfaceSim(const char *port)
-    : Simulation(port, ST_INTERFACE)
+    : Simulation(port, ST_INTERFACE),
+      m_frame_time("frame_time", this),
+      m_render_delay("render/delay", this)
 {
     m_pPrismFactory = new InterfacePrismFactory(this);
     m_pSphereFactory = new InterfaceSphereFactory(this);
@@ -243,6 +359,9 @@ InterfaceSim::InterfaceSim(const char *port)
     m_workspace_center.setGetCallback(on_get_workspace_center, this);
     m_workspace_size.m_magnitude.setGetCallback(on_get_workspace_size_mag, this);
     m_workspace_center.m_magnitude.setGetCallback(on_get_workspace_center_mag, this);
+    m_frame_time.setGetCallback(on_get_frame_time, this);
+    m_render_delay.setSetCallback(set_render_delay, this);
+    m_render_delay.setGetCallback(on_get_render_delay, this);
 
     m_fTimestep = 1;
 }
@@ -298,6 +417,66 @@ void InterfaceSim::on_add_receiver(const char *type)
     free(url);
 }
 
+bool InterfaceSim::add_object(OscObject& obj)
+{
+    if (!Simulation::add_object(obj))
+        return false;
+
+    std::map<std::string, PatternRequest>::iterator it;
+    it = m_patternRequests.begin();
+    while (it != m_patternRequests.end()) {
+        if (forward_pattern(obj, it->first.c_str(),
+                            it->second.pattern.c_str(),
+                            it->second.field.c_str(), it->second.interval))
+            m_patternRequests.erase(it++);
+        else
+            it++;
+    }
+
+    return true;
+}
+
+void InterfaceSim::on_get_pattern(const char *path, const char *pattern,
+                                  const char *field, int interval)
+{
+    m_patternRequests.erase(path);
+
+    object_iterator it;
+    for (it = world_objects.begin(); it != world_objects.end(); it++)
+        if (forward_pattern(*it->second, path, pattern, field, interval))
+            return;
+
+    // Until an object with the field is created, it is not known
+    // where to send the request.  Requests for once are dropped,
+    // since no object would be in the answer.
+    if (interval > 0) {
+        PatternRequest &r = m_patternRequests[path];
+        r.pattern = pattern;
+        r.field = field;
+        r.interval = interval;
+    }
+}
+
+bool InterfaceSim::forward_pattern(OscObject& obj, const char *path,
+                                   const char *pattern, const char *field,
+                                   int interval)
+{
+    OscValue *value = obj.findValue(field);
+    if (!value)
+        return false;
+
+    lo_message msg = lo_message_new();
+    if (interval >= 0)
+        lo_message_add_int32(msg, interval);
+    bool forwarded = value->forward_request(path, msg, interval);
+    lo_message_free(msg);
+
+    // Values without a get callback are only kept here.
+    if (!forwarded)
+        Simulation::on_get_pattern(path, pattern, field, interval);
+    return true;
+}
+
 int OscPrismInterface::push_handler(const char *path, const char *types,
                                     lo_arg **argv, int argc, void *data,
                                     void *user_data)
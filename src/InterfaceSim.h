@@ -7,28 +7,23 @@
 #include "OscObject.h"
 
 // Macros for defining forwarding handlers for OscValue instances to
-// the other simulations.
+// the other simulations.  Requests to get or watch a value are passed
+// on as received.
 
 #define FWD_OSCSCALAR(o,t)                                              \
     virtual void on_##o() {                                             \
         simulation()->send(0,m_##o.c_path(), "f",                       \
                            m_##o.m_value); }                            \
     static void on_get_##o(void *me, OscScalar &o, int interval) {      \
-        ((OscBase*)me)->simulation()->sendtotype(t,0,                   \
-                                       (o.path()+"/get").c_str(),       \
-                                       (interval>=0)?"i":"", interval); }
+        ((OscBase*)me)->simulation()->forward(t, o); }
 #define FWD_OSCVECTOR3(o,t)                                             \
     virtual void on_##o() {                                             \
         simulation()->send(0,m_##o.c_path(), "fff",                     \
                            m_##o.x(), m_##o.y(), m_##o.z()); }          \
     static void on_get_##o(void *me, OscVector3 &o, int interval){      \
-        ((OscBase*)me)->simulation()->sendtotype(t,0,                   \
-                                        (o.path()+"/get").c_str(),      \
-                                        (interval>=0)?"i":"", interval);}\
+        ((OscBase*)me)->simulation()->forward(t, o); }                  \
     static void on_get_##o##_mag(void *me, OscScalar &o, int interval){ \
-        ((OscBase*)me)->simulation()->sendtotype(t,0,                   \
-                                        (o.path()+"/get").c_str(),      \
-                                        (interval>=0)?"i":"", interval);}
+        ((OscBase*)me)->simulation()->forward(t, o); }
 #define FWD_OSCMATRIX3(o,t)                                             \
     virtual void on_##o() {                                             \
         simulation()->send(0,m_##o.c_path(), "fffffffff",               \
@@ -36,25 +31,19 @@
                            m_##o(1,0), m_##o(1,1), m_##o(1,2),          \
                            m_##o(2,0), m_##o(2,1), m_##o(2,2));}        \
     static void on_get_##o(void *me, OscMatrix3 &o, int interval){      \
-        ((OscBase*)me)->simulation()->sendtotype(t,0,                   \
-                                        (o.path()+"/get").c_str(),      \
-                                        (interval>=0)?"i":"", interval);}
+        ((OscBase*)me)->simulation()->forward(t, o); }
 #define FWD_OSCBOOLEAN(o,t)                                              \
     virtual void on_##o() {                                             \
         simulation()->send(0,m_##o.c_path(), "i",                       \
                            m_##o.m_value!=0); }                         \
     static void on_get_##o(void *me, OscBoolean &o, int interval) {     \
-        ((OscBase*)me)->simulation()->sendtotype(t,0,                   \
-                                       (o.path()+"/get").c_str(),       \
-                                       (interval>=0)?"i":"", interval); }
+        ((OscBase*)me)->simulation()->forward(t, o); }
 #define FWD_OSCSTRING(o,t)                                              \
     virtual void on_##o() {                                             \
         simulation()->send(0,m_##o.c_path(), "s",                       \
                            m_##o.c_str()); }                            \
     static void on_get_##o(void *me, OscString &o, int interval){       \
-        ((OscBase*)me)->simulation()->sendtotype(t,0,                   \
-                                        (o.path()+"/get").c_str(),      \
-                                        (interval>=0)?"i":"", interval);}
+        ((OscBase*)me)->simulation()->forward(t, o); }
 
 class OscCameraInterface;
 class OscCursorInterface;
@@ -102,8 +91,26 @@ class InterfaceSim : public Simulation
         Simulation::on_workspace_standard();
     }
 
+    virtual void on_capture_start(const char *target) {
+        sendtotype(Simulation::ST_VISUAL, 0, "/world/capture/start", "s", target);
+    }
+
+    virtual void on_capture_stop() {
+        sendtotype(Simulation::ST_VISUAL, 0, "/world/capture/stop", "");
+    }
+
+    virtual void on_stream_start(const char *target) {
+        sendtotype(Simulation::ST_PHYSICS, 0, "/world/stream/start", "s", target);
+    }
+
+    virtual void on_stream_stop() {
+        sendtotype(Simulation::ST_PHYSICS, 0, "/world/stream/stop", "");
+    }
+
     virtual void on_add_receiver(const char *type);
 
+    virtual bool add_object(OscObject& obj);
+
     FWD_OSCVECTOR3(workspace_size, Simulation::ST_HAPTICS);
     FWD_OSCVECTOR3(workspace_center, Simulation::ST_HAPTICS);
 
@@ -112,10 +119,35 @@ class InterfaceSim : public Simulation
     FWD_OSCSCALAR(grab_damping,Simulation::ST_HAPTICS);
     FWD_OSCSCALAR(grab_feedback,Simulation::ST_HAPTICS);
 
+    //! Frame time and render delay belong to the visual simulation.
+    OSCSCALAR(InterfaceSim, frame_time) {};
+    OSCSCALAR(InterfaceSim, render_delay) {
+        send(0, m_render_delay.c_path(), "f", m_render_delay.m_value); }
+    static void on_get_frame_time(void *me, OscScalar &o, int interval) {
+        ((OscBase*)me)->simulation()->forward(Simulation::ST_VISUAL, o); }
+    static void on_get_render_delay(void *me, OscScalar &o, int interval) {
+        ((OscBase*)me)->simulation()->forward(Simulation::ST_VISUAL, o); }
+
   protected:
     OscCameraInterface *m_camera;
     OscCursorInterface *m_cursor;
     virtual void step();
+
+    //! Pass requests for a pattern of objects on to the simulation
+    //! that has the field, learned from any object.
+    virtual void on_get_pattern(const char *path, const char *pattern,
+                                const char *field, int interval);
+
+    //! Pass on a pattern request, or answer it here if the object's
+    //! field is not forwarded.  Returns false if the object does not
+    //! have the field.
+    bool forward_pattern(OscObject& obj, const char *path,
+                         const char *pattern, const char *field,
+                         int interval);
+
+    //! Pattern requests waiting for an object with their field.
+    struct PatternRequest { std::string pattern, field; int interval; };
+    std::map<std::string, PatternRequest> m_patternRequests;
 };
 
 class InterfacePrismFactory : public PrismFactory
@@ -128,6 +160,8 @@ public:
 
 protected:
     bool create(const char *name, float x, float y, float z);
+    void create_many(const char *prefix, const lo_pcast32 *records,
+                     int count, int first, lo_blob blob);
 };
 
 class InterfaceSphereFactory : public SphereFactory
@@ -140,6 +174,8 @@ public:
 
 protected:
     bool create(const char *name, float x, float y, float z);
+    void create_many(const char *prefix, const lo_pcast32 *records,
+                     int count, int first, lo_blob blob);
 };
 
 class InterfaceMeshFactory : public MeshFactory
@@ -218,6 +254,9 @@ public:
 protected:
     bool create(const char *name, OscObject *object1, OscObject *object2,
                 double x, double y, double z);
+    void create_many(const char *prefix, const char *objects,
+                     const lo_pcast32 *records, int count, int first,
+                     lo_blob blob);
 };
 
 class InterfaceSlideFactory : public SlideFactory
@@ -400,6 +439,7 @@ public:
             m_color.setGetCallback(on_get_color, this);
             m_force.setGetCallback(on_get_force, this);
             m_size.setGetCallback(on_get_size, this);
+            m_collision_radius.setGetCallback(on_get_collision_radius, this);
             m_mass.setGetCallback(on_get_mass, this);
             m_density.setGetCallback(on_get_density, this);
             m_friction_static.setGetCallback(on_get_friction_static, this);
@@ -439,6 +479,7 @@ protected:
     FWD_OSCVECTOR3(color,Simulation::ST_VISUAL);
     FWD_OSCVECTOR3(force,Simulation::ST_PHYSICS);
     FWD_OSCVECTOR3(size,Simulation::ST_PHYSICS);
+    FWD_OSCSCALAR(collision_radius,Simulation::ST_HAPTICS);
     FWD_OSCSCALAR(mass,Simulation::ST_PHYSICS);
     FWD_OSCSCALAR(density,Simulation::ST_PHYSICS);
     FWD_OSCSCALAR(friction_dynamic,Simulation::ST_HAPTICS);
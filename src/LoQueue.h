@@ -16,7 +16,7 @@
 #ifndef _LOQUEUE_H_
 #define _LOQUEUE_H_
 
-#include <cassert>
+#include <vector>
 
 #include "CircBuffer.h"
 #include "lo/lo.h"
@@ -27,45 +27,75 @@ class LoQueue
 public:
     LoQueue(int size) : m_fifo(size), m_readsize(0) {};
 
-    /*! Write a lo_message to the FIFO queue. */
+    /*! Write a lo_message to the FIFO queue.  Returns false if
+     * there is not enough room. */
     bool write_lo_message(const char *path, lo_message m)
     {
-        unsigned char msgbuf[1024];
-        size_t msgbufsize = 1024-sizeof(size_t);
+        // Messages may be of any size, such as a create_many batch,
+        // so they are serialised in a buffer that only grows.
+        size_t msgbufsize = lo_message_length(m, path);
+        if (msgbufsize == 0)
+            return false;
+        if (m_writebuf.size() < msgbufsize+sizeof(size_t))
+            m_writebuf.resize(msgbufsize+sizeof(size_t));
 
+        unsigned char *msgbuf = &m_writebuf[0];
         lo_message_serialise(m, path, msgbuf+sizeof(size_t), &msgbufsize);
-        if (msgbufsize <= 0)
-            return false;
+        *((size_t*)msgbuf) = msgbufsize;
 
+        return m_fifo.writeBuffer(msgbuf, msgbufsize+sizeof(size_t));
+    }
+
+    /*! True if a message of this serialised size could ever be
+     * queued. */
+    bool fits(size_t msgbufsize)
+        { return msgbufsize+sizeof(size_t) <= m_fifo.getSize(); }
+
+    /*! Write a message already serialised after the first
+     * sizeof(size_t) bytes of msgbuf, which are filled in here. */
+    bool write_serialised(unsigned char *msgbuf, size_t msgbufsize)
+    {
         *((size_t*)msgbuf) = msgbufsize;
 
-        return m_fifo.writeBuffer((unsigned char*)msgbuf,
-                                  msgbufsize+sizeof(size_t));
+        return m_fifo.writeBuffer(msgbuf, msgbufsize+sizeof(size_t));
     }
 
     /*! Check for messages in raw queue memory and dispatch them if
      * any are found. */
     bool read_and_dispatch(lo_server s)
+    {
+        size_t size;
+        unsigned char *buffer = read(size);
+        if (!buffer)
+            return false;
+
+        lo_server_dispatch_data(s, buffer, size);
+        return true;
+    }
+
+    /*! Read the next serialised message, which starts with its OSC
+     * path, without dispatching it.  Returns a buffer holding it
+     * until the next read, or NULL if there is no complete message. */
+    unsigned char *read(size_t &size)
     {
         if (m_readsize == 0) {
             if (!m_fifo.readBuffer((unsigned char*)&m_readsize,
                                    sizeof(size_t)))
-                return false;
+                return NULL;
         }
 
-        assert(m_readsize < 1024);
-
         if (m_readsize > 0) {
-            unsigned char buffer[1024];
-            if (!m_fifo.readBuffer(buffer, m_readsize))
-                return false;
+            if (m_readbuf.size() < m_readsize)
+                m_readbuf.resize(m_readsize);
+            if (!m_fifo.readBuffer(&m_readbuf[0], m_readsize))
+                return NULL;
 
-            lo_server_dispatch_data(s, buffer, m_readsize);
+            size = m_readsize;
             m_readsize = 0;
-            return true;
+            return &m_readbuf[0];
         }
 
-        return false;
+        return NULL;
     }
 
     size_t size() { return m_fifo.getSize(); }
@@ -73,6 +103,10 @@ public:
 protected:
     CircBufferNoLock m_fifo;
     size_t m_readsize;
+
+    // Serialisation buffers of the writing and reading threads
+    std::vector<unsigned char> m_writebuf;
+    std::vector<unsigned char> m_readbuf;
 };
 
 #endif // _LOQUEUE_H_
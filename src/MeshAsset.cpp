@@ -0,0 +1,184 @@
+// -*- mode:c++; indent-tabs-mode:nil; c-basic-offset:4; -*-
+//======================================================================================
+/*
+    This file is part of DIMPLE, the Dynamic Interactive Musically PhysicaL Environment,
+
+    This code is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License("GPL") version 2
+    as published by the Free Software Foundation.  See the file LICENSE
+    for more information.
+
+    sinclair@music.mcgill.ca
+    http://www.music.mcgill.ca/~sinclair/content/dimple
+*/
+//======================================================================================
+
+#include "MeshAsset.h"
+#include "MeshCache.h"
+#include "MeshSimplifier.h"
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Sub-meshes with fewer triangles are always drawn in full.
+#define MESH_LOD_MIN_TRIANGLES 512
+
+// Number of simplified levels, each with half the triangles of the
+// one before.
+#define MESH_LOD_LEVELS 3
+
+std::map<std::string, std::weak_ptr<MeshAsset> > MeshAsset::s_assets;
+std::mutex MeshAsset::s_mutex;
+
+MeshAsset::MeshAsset()
+    : m_pPrototype(NULL), m_bMaterials(false)
+{
+}
+
+MeshAsset::~MeshAsset()
+{
+    if (m_pPrototype)
+        delete m_pPrototype;
+}
+
+std::shared_ptr<MeshAsset> MeshAsset::acquire(const char *filename,
+                                              double radius,
+                                              bool materials)
+{
+    // Identify the file by name, size and modification time, so that
+    // an edited file is loaded again.
+    struct stat st;
+    if (stat(filename, &st) != 0)
+        return std::shared_ptr<MeshAsset>();
+
+    char id[64];
+    sprintf(id, "|%lld|%lld", (long long)st.st_size, (long long)st.st_mtime);
+    std::string key(std::string(filename) + id);
+
+    {
+        std::lock_guard<std::mutex> lock(s_mutex);
+        std::shared_ptr<MeshAsset> asset = s_assets[key].lock();
+        if (asset && (asset->m_bMaterials || !materials))
+            return asset;
+    }
+
+    // Load outside the lock so that a simulation loading a large file
+    // does not block another one instantiating a different mesh.  If
+    // two simulations race to load the same file, the first one to
+    // finish is kept.
+    std::shared_ptr<MeshAsset> asset(new MeshAsset());
+    if (!asset->load(filename, radius, materials))
+        return std::shared_ptr<MeshAsset>();
+
+    std::lock_guard<std::mutex> lock(s_mutex);
+    std::shared_ptr<MeshAsset> existing = s_assets[key].lock();
+    if (existing && (existing->m_bMaterials || !asset->m_bMaterials))
+        return existing;
+
+    // Forget entries for assets that have since been released.
+    std::map<std::string, std::weak_ptr<MeshAsset> >::iterator it;
+    for (it = s_assets.begin(); it != s_assets.end(); ) {
+        if (it->second.expired() && it->first != key)
+            s_assets.erase(it++);
+        else
+            it++;
+    }
+
+    s_assets[key] = asset;
+    return asset;
+}
+
+bool MeshAsset::load(const char *filename, double radius, bool materials)
+{
+    m_pPrototype = new cMultiMesh();
+
+    if (!materials && MeshCache::load(m_pPrototype, filename, radius, m_size))
+        return true;
+
+    if (!m_pPrototype->loadFromFile(filename))
+        return false;
+
+    m_bMaterials = true;
+
+    // center the mesh
+    m_pPrototype->computeBoundaryBox();
+    cVector3d vmin = m_pPrototype->getBoundaryMin();
+    cVector3d vmax = m_pPrototype->getBoundaryMax();
+    m_pPrototype->translate((vmax-vmin*3)/2);
+
+    // size it to 0.1 without changing proportions
+    float size = (vmax-vmin).length();
+    m_size.set(0.1/size, 0.1/size, 0.1/size);
+
+    m_pPrototype->computeBoundaryBox(true);
+    cVector3d scale(m_pPrototype->getBoundaryMax()
+                    - m_pPrototype->getBoundaryMin());
+    m_pPrototype->scaleXYZ(m_size.x() / scale.x(),
+                           m_size.y() / scale.y(),
+                           m_size.z() / scale.z());
+
+    /* setup collision detector */
+    if (!MeshCache::loadCollision(m_pPrototype, filename, radius)) {
+        cCollisionAABBCached::create(m_pPrototype, radius);
+        MeshCache::store(m_pPrototype, filename, radius, m_size);
+    }
+
+    buildLevels();
+
+    return true;
+}
+
+void MeshAsset::buildLevels()
+{
+    m_levels.resize(m_pPrototype->getNumMeshes());
+    for (int i = 0; i < m_pPrototype->getNumMeshes(); i++)
+    {
+        cMesh *mesh = m_pPrototype->getMesh(i);
+        unsigned int count = mesh->m_triangles->getNumElements();
+        if (count < MESH_LOD_MIN_TRIANGLES)
+            continue;
+
+        for (int l = 0; l < MESH_LOD_LEVELS; l++) {
+            count /= 2;
+            m_levels[i].push_back(std::vector<unsigned int>());
+            if (!MeshSimplifier::simplify(mesh, count, m_levels[i].back()))
+                break;
+        }
+    }
+}
+
+cMultiMesh *MeshAsset::instantiate(double radius) const
+{
+    // Own materials so that colour and friction are per-instance, but
+    // share textures and mesh data with the prototype.
+    cMultiMesh *mesh = m_pPrototype->copy(true, false, false, false);
+
+    // Each instance owns a copy of the prototype's trees, adapted to
+    // its radius.
+    for (int i = 0; i < mesh->getNumMeshes(); i++)
+        cCollisionAABBCached::copy(
+            m_pPrototype->getMesh(i)->getCollisionDetector(),
+            mesh->getMesh(i), radius);
+
+    return mesh;
+}
+
+void MeshAsset::detach(cMesh *mesh, double radius)
+{
+    cVertexArrayPtr vertices = mesh->m_vertices->copy();
+    cTriangleArrayPtr triangles = cTriangleArray::create(vertices);
+    for (unsigned int i = 0; i < mesh->m_triangles->getNumElements(); i++)
+        triangles->newTriangle(mesh->m_triangles->getVertexIndex0(i),
+                               mesh->m_triangles->getVertexIndex1(i),
+                               mesh->m_triangles->getVertexIndex2(i));
+
+    // The collision tree is copied over the new triangles, which
+    // have the same indices as the shared ones.
+    cCollisionDetector *tree = mesh->getCollisionDetector();
+    mesh->setCollisionDetector(NULL);
+    mesh->m_vertices = vertices;
+    mesh->m_triangles = triangles;
+    cCollisionAABBCached::copy(tree, mesh, radius);
+    delete tree;
+}
@@ -0,0 +1,99 @@
+// -*- mode:c++; indent-tabs-mode:nil; c-basic-offset:4; -*-
+//======================================================================================
+/*
+    This file is part of DIMPLE, the Dynamic Interactive Musically PhysicaL Environment,
+
+    This code is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License("GPL") version 2
+    as published by the Free Software Foundation.  See the file LICENSE
+    for more information.
+
+    sinclair@music.mcgill.ca
+    http://www.music.mcgill.ca/~sinclair/content/dimple
+*/
+//======================================================================================
+
+#ifndef _MESH_ASSET_H_
+#define _MESH_ASSET_H_
+
+#include "config.h"
+
+#ifdef HAVE_MINGW_STD_THREADS
+#include <mingw.mutex.h>
+#else
+#include <mutex>
+#endif
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <world/CMultiMesh.h>
+
+using namespace chai3d;
+
+//! A MeshAsset is the normalised, immutable geometry of one mesh
+//! file, loaded once per process and shared between every instance
+//! of that mesh in every simulation.  Instances share the vertex and
+//! triangle arrays of the asset and only own their transform,
+//! materials and collision tree.  Assets are reference-counted and
+//! released when the last instance holding them is destroyed.
+class MeshAsset
+{
+  public:
+    ~MeshAsset();
+
+    //! Return the shared asset for a file, loading it if it is not
+    //! already in memory.  If materials is false the asset may be
+    //! taken from the on-disk MeshCache, which does not keep the
+    //! file's materials and textures.  Returns an empty pointer if
+    //! the file cannot be loaded.
+    static std::shared_ptr<MeshAsset> acquire(const char *filename,
+                                              double radius,
+                                              bool materials);
+
+    //! Create a new cMultiMesh sharing this asset's geometry, with a
+    //! copy of the asset's collision trees adapted to the given
+    //! radius.
+    cMultiMesh *instantiate(double radius) const;
+
+    //! Give a sub-mesh of an instance its own copy of the vertex and
+    //! triangle data, so that it can be modified, and a collision
+    //! tree over them for the given radius.
+    static void detach(cMesh *mesh, double radius);
+
+    const cVector3d& size() const { return m_size; }
+    bool has_materials() const { return m_bMaterials; }
+
+    //! Number of simplified levels of detail of a sub-mesh, not
+    //! counting the full-resolution one.  Levels are only built for
+    //! assets loaded with materials, i.e. for the visual simulation.
+    int numLevels(int mesh) const
+        { return mesh < (int)m_levels.size() ? m_levels[mesh].size() : 0; }
+
+    //! Triangles of a simplified level of a sub-mesh as vertex index
+    //! triples, level 1 being the most detailed.
+    const std::vector<unsigned int>& level(int mesh, int level) const
+        { return m_levels[mesh][level-1]; }
+
+  protected:
+    MeshAsset();
+
+    bool load(const char *filename, double radius, bool materials);
+
+    //! Build the simplified levels of detail of each sub-mesh.
+    void buildLevels();
+
+    cMultiMesh *m_pPrototype;  //! never rendered, only copied
+    cVector3d m_size;          //! normalised size
+    bool m_bMaterials;         //! true if parsed from the file itself
+
+    //! Simplified triangle lists, [sub-mesh][level-1]
+    std::vector<std::vector<std::vector<unsigned int> > > m_levels;
+
+    static std::map<std::string, std::weak_ptr<MeshAsset> > s_assets;
+    static std::mutex s_mutex;
+};
+
+#endif // _MESH_ASSET_H_
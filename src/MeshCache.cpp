@@ -0,0 +1,438 @@
+// -*- mode:c++; indent-tabs-mode:nil; c-basic-offset:4; -*-
+//======================================================================================
+/*
+    This file is part of DIMPLE, the Dynamic Interactive Musically PhysicaL Environment,
+
+    This code is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License("GPL") version 2
+    as published by the Free Software Foundation.  See the file LICENSE
+    for more information.
+
+    sinclair@music.mcgill.ca
+    http://www.music.mcgill.ca/~sinclair/content/dimple
+*/
+//======================================================================================
+
+#include "config.h"
+#include "dimple.h"
+#include "MeshCache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef WIN32
+#include <windows.h>
+#include <direct.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+/* On-disk layout of a cache entry.  All sections are 8-byte aligned
+ * so that the arrays can be read in place from the mapped file.
+ *
+ *   MeshCacheHeader
+ *   num_meshes x {
+ *     MeshCacheMesh
+ *     num_vertices x 9 doubles (position, normal, texture coordinate)
+ *     num_triangles x 3 uint32_t vertex indices, padded to 8 bytes
+ *     num_nodes x cCollisionAABBNode
+ *   }
+ */
+
+#define MESH_CACHE_MAGIC   "DIMPLEMC"
+#define MESH_CACHE_VERSION 1
+
+struct MeshCacheHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t node_size;   // sizeof(cCollisionAABBNode) when written
+    uint64_t key;
+    double   radius;
+    double   size[3];     // normalised size of the mesh
+    uint32_t num_meshes;
+    uint32_t reserved;
+};
+
+struct MeshCacheMesh
+{
+    uint32_t num_vertices;
+    uint32_t num_triangles;
+    uint32_t num_nodes;
+    int32_t  root;
+};
+
+static size_t align8(size_t n) { return (n + 7) & ~(size_t)7; }
+
+/****** cCollisionAABBCached ******/
+
+void cCollisionAABBCached::create(cMultiMesh *mesh, double radius)
+{
+    for (int i = 0; i < mesh->getNumMeshes(); i++)
+    {
+        cMesh *sub = mesh->getMesh(i);
+        sub->deleteCollisionDetector(false);
+
+        cCollisionAABBCached *c = new cCollisionAABBCached();
+        c->build(sub->m_triangles, radius);
+        sub->setCollisionDetector(c);
+    }
+}
+
+void cCollisionAABBCached::copy(cCollisionDetector *from, cMesh *to,
+                                double radius)
+{
+    cCollisionAABBCached *c = dynamic_cast<cCollisionAABBCached*>(from);
+
+    cCollisionAABBCached *tree = new cCollisionAABBCached();
+    if (c && !c->m_nodes.empty()) {
+        tree->restore(to->m_triangles, &c->m_nodes[0], c->m_nodes.size(),
+                      c->m_rootIndex, c->m_fRadius);
+        if (radius != c->m_fRadius)
+            tree->rescale(cVector3d(1, 1, 1), radius);
+    }
+    else
+        tree->build(to->m_triangles, radius);
+
+    to->deleteCollisionDetector(false);
+    to->setCollisionDetector(tree);
+}
+
+void cCollisionAABBCached::build(cGenericArrayPtr elements, double radius)
+{
+    initialize(elements, radius);
+    m_fRadius = radius;
+}
+
+void cCollisionAABBCached::restore(cGenericArrayPtr elements,
+                                   const cCollisionAABBNode *nodes,
+                                   int count, int root, double radius)
+{
+    m_elements = elements;
+    m_numElements = elements->getNumElements();
+    m_nodes.assign(nodes, nodes + count);
+    m_rootIndex = root;
+    m_fRadius = radius;
+}
+
+void cCollisionAABBCached::rescale(const cVector3d &scale, double radius)
+{
+    // Each box is the bounds of its elements grown by the radius.
+    cVector3d r0(m_fRadius, m_fRadius, m_fRadius);
+    cVector3d r1(radius, radius, radius);
+
+    std::vector<cCollisionAABBNode>::iterator it;
+    for (it = m_nodes.begin(); it != m_nodes.end(); it++)
+    {
+        cVector3d vmin(it->m_bbox.getMin() + r0);
+        cVector3d vmax(it->m_bbox.getMax() - r0);
+        vmin.mulElement(scale);
+        vmax.mulElement(scale);
+        it->m_bbox.setValue(vmin - r1, vmax + r1);
+    }
+
+    m_fRadius = radius;
+}
+
+/****** MeshCache ******/
+
+static std::string cache_dir;
+static std::once_flag cache_dir_once;
+
+// Find the cache directory and create it.  The command line has been
+// parsed by the time any mesh is loaded.
+static void find_directory()
+{
+    std::string &dir = cache_dir;
+
+    if (mesh_cache_dir)
+        dir = mesh_cache_dir;
+    else {
+        const char *base;
+#ifdef WIN32
+        if ((base = getenv("LOCALAPPDATA")))
+            dir = std::string(base) + "\\dimple";
+#else
+        if ((base = getenv("XDG_CACHE_HOME")) && base[0])
+            dir = std::string(base) + "/dimple";
+        else if ((base = getenv("HOME")))
+            dir = std::string(base) + "/.cache/dimple";
+#endif
+    }
+
+    if (dir == "none")
+        dir.clear();
+
+    // Create the directory and any missing parents.
+    for (size_t i = 1; i <= dir.size(); i++) {
+        if (i < dir.size() && dir[i] != '/' && dir[i] != '\\')
+            continue;
+        std::string sub(dir, 0, i);
+#ifdef WIN32
+        _mkdir(sub.c_str());
+#else
+        mkdir(sub.c_str(), 0755);
+#endif
+    }
+}
+
+const std::string& MeshCache::directory()
+{
+    // Meshes are loaded by several simulation threads at once.
+    std::call_once(cache_dir_once, find_directory);
+    return cache_dir;
+}
+
+bool MeshCache::key(const char *filename, double radius, uint64_t &key)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+        return false;
+
+    // 64-bit FNV-1a over the file contents, followed by the
+    // parameters that affect the built tree.
+    uint64_t h = 14695981039346656037ULL;
+    unsigned char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        for (size_t i = 0; i < n; i++)
+            h = (h ^ buf[i]) * 1099511628211ULL;
+    fclose(f);
+
+    const unsigned char *p = (const unsigned char*)&radius;
+    for (size_t i = 0; i < sizeof(radius); i++)
+        h = (h ^ p[i]) * 1099511628211ULL;
+
+    key = h;
+    return true;
+}
+
+std::string MeshCache::entry_path(uint64_t key)
+{
+    char name[32];
+    sprintf(name, "/%016llx.aabb", (unsigned long long)key);
+    return directory() + name;
+}
+
+bool MeshCache::load(cMultiMesh *mesh, const char *filename,
+                     double radius, cVector3d &size)
+{
+    return restore(mesh, filename, radius, &size);
+}
+
+bool MeshCache::loadCollision(cMultiMesh *mesh, const char *filename,
+                              double radius)
+{
+    return restore(mesh, filename, radius, NULL);
+}
+
+bool MeshCache::restore(cMultiMesh *mesh, const char *filename,
+                        double radius, cVector3d *size)
+{
+    uint64_t k;
+    if (directory().empty() || !key(filename, radius, k))
+        return false;
+
+    std::string path(entry_path(k));
+
+    // Map the entry read-only.
+    const char *data = NULL;
+    size_t length = 0;
+#ifdef WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                              NULL, OPEN_EXISTING, 0, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    length = GetFileSize(file, NULL);
+    HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping)
+        data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        length = st.st_size;
+        data = (const char*)mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == (const char*)MAP_FAILED)
+            data = NULL;
+    }
+    close(fd);
+#endif
+
+    bool ok = false;
+    const MeshCacheHeader *hdr = (const MeshCacheHeader*)data;
+    if (data && length >= sizeof(MeshCacheHeader)
+        && memcmp(hdr->magic, MESH_CACHE_MAGIC, 8) == 0
+        && hdr->version == MESH_CACHE_VERSION
+        && hdr->node_size == sizeof(cCollisionAABBNode)
+        && hdr->key == k && hdr->radius == radius
+        && (size || (int)hdr->num_meshes == mesh->getNumMeshes()))
+    {
+        size_t pos = sizeof(MeshCacheHeader);
+        ok = true;
+        for (unsigned int m = 0; ok && m < hdr->num_meshes; m++)
+        {
+            if (pos + sizeof(MeshCacheMesh) > length) {
+                ok = false;
+                break;
+            }
+            const MeshCacheMesh *e = (const MeshCacheMesh*)(data + pos);
+            pos += sizeof(MeshCacheMesh);
+
+            size_t vsize = e->num_vertices * 9 * sizeof(double);
+            size_t tsize = align8(e->num_triangles * 3 * sizeof(uint32_t));
+            size_t nsize = e->num_nodes * sizeof(cCollisionAABBNode);
+            if (pos + vsize + tsize + nsize > length) {
+                ok = false;
+                break;
+            }
+
+            const double *v = (const double*)(data + pos);
+            const uint32_t *t = (const uint32_t*)(data + pos + vsize);
+            const cCollisionAABBNode *n =
+                (const cCollisionAABBNode*)(data + pos + vsize + tsize);
+            pos += vsize + tsize + nsize;
+
+            cMesh *sub;
+            if (size) {
+                sub = mesh->newMesh();
+                for (unsigned int i = 0; i < e->num_vertices; i++, v += 9)
+                    sub->newVertex(cVector3d(v[0], v[1], v[2]),
+                                   cVector3d(v[3], v[4], v[5]),
+                                   cVector3d(v[6], v[7], v[8]));
+                for (unsigned int i = 0; i < e->num_triangles; i++, t += 3)
+                    sub->newTriangle(t[0], t[1], t[2]);
+            }
+            else {
+                sub = mesh->getMesh(m);
+                if (sub->getNumVertices() != e->num_vertices
+                    || sub->getNumTriangles() != e->num_triangles) {
+                    ok = false;
+                    break;
+                }
+            }
+
+            sub->deleteCollisionDetector(false);
+            if (e->num_nodes > 0) {
+                cCollisionAABBCached *c = new cCollisionAABBCached();
+                c->restore(sub->m_triangles, n, e->num_nodes, e->root,
+                           hdr->radius);
+                sub->setCollisionDetector(c);
+            }
+        }
+
+        if (ok && size)
+            size->set(hdr->size[0], hdr->size[1], hdr->size[2]);
+    }
+
+    if (!ok && size)
+        mesh->deleteAllMeshes();
+
+#ifdef WIN32
+    if (data)
+        UnmapViewOfFile(data);
+    if (mapping)
+        CloseHandle(mapping);
+    CloseHandle(file);
+#else
+    if (data)
+        munmap((void*)data, length);
+#endif
+
+    return ok;
+}
+
+bool MeshCache::store(cMultiMesh *mesh, const char *filename,
+                      double radius, const cVector3d &size)
+{
+    uint64_t k;
+    if (directory().empty() || !key(filename, radius, k))
+        return false;
+
+    // Write to a unique temporary name and rename it into place, so
+    // that concurrent writers and readers never see a partial entry.
+    static std::atomic<int> counter(0);
+    std::string path(entry_path(k));
+    char suffix[64];
+    sprintf(suffix, ".%d.%d.tmp", (int)getpid(), counter++);
+    std::string tmppath(path + suffix);
+
+    FILE *f = fopen(tmppath.c_str(), "wb");
+    if (!f)
+        return false;
+
+    MeshCacheHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, MESH_CACHE_MAGIC, 8);
+    hdr.version = MESH_CACHE_VERSION;
+    hdr.node_size = sizeof(cCollisionAABBNode);
+    hdr.key = k;
+    hdr.radius = radius;
+    hdr.size[0] = size.x();
+    hdr.size[1] = size.y();
+    hdr.size[2] = size.z();
+    hdr.num_meshes = mesh->getNumMeshes();
+
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+
+    static const char zeros[8] = {0};
+    for (unsigned int m = 0; ok && m < hdr.num_meshes; m++)
+    {
+        cMesh *sub = mesh->getMesh(m);
+        cCollisionAABBCached *c =
+            dynamic_cast<cCollisionAABBCached*>(sub->getCollisionDetector());
+
+        MeshCacheMesh e;
+        e.num_vertices = sub->getNumVertices();
+        e.num_triangles = sub->getNumTriangles();
+        e.num_nodes = c ? c->nodes().size() : 0;
+        e.root = c ? c->root() : -1;
+        ok = fwrite(&e, sizeof(e), 1, f) == 1;
+
+        for (unsigned int i = 0; ok && i < e.num_vertices; i++) {
+            cVector3d p(sub->m_vertices->getLocalPos(i));
+            cVector3d n(sub->m_vertices->getNormal(i));
+            cVector3d t(sub->m_vertices->getTexCoord(i));
+            double v[9] = { p.x(), p.y(), p.z(),
+                            n.x(), n.y(), n.z(),
+                            t.x(), t.y(), t.z() };
+            ok = fwrite(v, sizeof(v), 1, f) == 1;
+        }
+
+        for (unsigned int i = 0; ok && i < e.num_triangles; i++) {
+            uint32_t t[3] = { sub->m_triangles->getVertexIndex0(i),
+                              sub->m_triangles->getVertexIndex1(i),
+                              sub->m_triangles->getVertexIndex2(i) };
+            ok = fwrite(t, sizeof(t), 1, f) == 1;
+        }
+        size_t tsize = e.num_triangles * 3 * sizeof(uint32_t);
+        if (ok && align8(tsize) > tsize)
+            ok = fwrite(zeros, align8(tsize) - tsize, 1, f) == 1;
+
+        if (ok && e.num_nodes > 0)
+            ok = fwrite(&c->nodes()[0],
+                        sizeof(cCollisionAABBNode), e.num_nodes, f)
+                == e.num_nodes;
+    }
+
+    if (fclose(f) != 0)
+        ok = false;
+
+    if (ok && rename(tmppath.c_str(), path.c_str()) != 0)
+        ok = false;
+
+    if (!ok)
+        remove(tmppath.c_str());
+
+    return ok;
+}
@@ -0,0 +1,104 @@
+// -*- mode:c++; indent-tabs-mode:nil; c-basic-offset:4; -*-
+//======================================================================================
+/*
+    This file is part of DIMPLE, the Dynamic Interactive Musically PhysicaL Environment,
+
+    This code is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License("GPL") version 2
+    as published by the Free Software Foundation.  See the file LICENSE
+    for more information.
+
+    sinclair@music.mcgill.ca
+    http://www.music.mcgill.ca/~sinclair/content/dimple
+*/
+//======================================================================================
+
+#ifndef _MESH_CACHE_H_
+#define _MESH_CACHE_H_
+
+#include <stdint.h>
+#include <string>
+
+#include <world/CMultiMesh.h>
+#include <collisions/CCollisionAABB.h>
+
+using namespace chai3d;
+
+//! The MeshCache class keeps a persistent on-disk copy of the
+//! normalised geometry and AABB collision tree of each mesh loaded by
+//! DIMPLE, so that re-loading the same file does not need to parse it
+//! and rebuild the tree.  Entries are keyed by a hash of the file
+//! contents and the collision radius, and are memory-mapped on load.
+class MeshCache
+{
+  public:
+    //! Fill an empty mesh with the cached geometry and collision
+    //! trees for the given file and radius.  The normalised size
+    //! stored with the entry is returned in size.  Returns false if
+    //! there is no valid entry.
+    static bool load(cMultiMesh *mesh, const char *filename,
+                     double radius, cVector3d &size);
+
+    //! Install cached collision trees into a mesh that was already
+    //! loaded and normalised from the given file.  Returns false if
+    //! there is no valid entry or the geometry does not match it.
+    static bool loadCollision(cMultiMesh *mesh, const char *filename,
+                              double radius);
+
+    //! Write the geometry and collision trees of a freshly loaded and
+    //! normalised mesh to the cache.
+    static bool store(cMultiMesh *mesh, const char *filename,
+                      double radius, const cVector3d &size);
+
+    //! Return the cache directory, or an empty string if the cache is
+    //! disabled.
+    static const std::string& directory();
+
+  protected:
+    static bool key(const char *filename, double radius, uint64_t &key);
+    static std::string entry_path(uint64_t key);
+    static bool restore(cMultiMesh *mesh, const char *filename,
+                        double radius, cVector3d *size);
+};
+
+//! A cCollisionAABB whose tree can be exported to and imported from
+//! a flat array of nodes, used by MeshCache.  Meshes get their trees
+//! from create() rather than createAABBCollisionDetector(), so that
+//! the trees can be cached.
+class cCollisionAABBCached : public cCollisionAABB
+{
+  public:
+    cCollisionAABBCached() : m_fRadius(0) {}
+
+    //! Build a tree for each sub-mesh of a mesh, replacing any
+    //! existing collision detectors.
+    static void create(cMultiMesh *mesh, double radius);
+
+    //! Give a mesh a copy of a tree over its own triangles, which
+    //! must be the same ones, adapted to a radius.  A tree is built
+    //! if the given one is not a cCollisionAABBCached.
+    static void copy(cCollisionDetector *from, cMesh *to, double radius);
+
+    //! Build a tree for the given elements.
+    void build(cGenericArrayPtr elements, double radius);
+
+    //! Install a tree previously built for the given elements.
+    void restore(cGenericArrayPtr elements, const cCollisionAABBNode *nodes,
+                 int count, int root, double radius);
+
+    //! Adapt the tree to its elements being scaled about the origin
+    //! by a positive factor per axis, and to a new radius, without
+    //! rebuilding it.  The boxes stay exact, since scaling each axis
+    //! preserves which element bounds each box.
+    void rescale(const cVector3d &scale, double radius);
+
+    //! Access the tree.
+    const std::vector<cCollisionAABBNode>& nodes() const { return m_nodes; }
+    int root() const { return m_rootIndex; }
+    double radius() const { return m_fRadius; }
+
+  protected:
+    double m_fRadius;        //! radius the boxes were built for
+};
+
+#endif // _MESH_CACHE_H_
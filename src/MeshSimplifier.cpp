@@ -0,0 +1,264 @@
+// -*- mode:c++; indent-tabs-mode:nil; c-basic-offset:4; -*-
+//======================================================================================
+/*
+    This file is part of DIMPLE, the Dynamic Interactive Musically PhysicaL Environment,
+
+    This code is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License("GPL") version 2
+    as published by the Free Software Foundation.  See the file LICENSE
+    for more information.
+
+    sinclair@music.mcgill.ca
+    http://www.music.mcgill.ca/~sinclair/content/dimple
+*/
+//======================================================================================
+
+#include "MeshSimplifier.h"
+
+#include <string.h>
+#include <map>
+#include <queue>
+#include <functional>
+
+// Smallest cosine allowed between a triangle's normal before and
+// after a collapse; prevents collapses that fold the surface over.
+#define SIMPLIFY_MIN_NORMAL_COS 0.2
+
+namespace {
+
+//! Symmetric 4x4 error quadric of a set of planes.
+struct Quadric
+{
+    double q[10];
+
+    Quadric() { memset(q, 0, sizeof(q)); }
+
+    void addPlane(const cVector3d &n, double d, double weight)
+    {
+        double a = n.x(), b = n.y(), c = n.z();
+        q[0] += weight*a*a; q[1] += weight*a*b; q[2] += weight*a*c;
+        q[3] += weight*a*d; q[4] += weight*b*b; q[5] += weight*b*c;
+        q[6] += weight*b*d; q[7] += weight*c*c; q[8] += weight*c*d;
+        q[9] += weight*d*d;
+    }
+
+    void add(const Quadric &o)
+    {
+        for (int i = 0; i < 10; i++)
+            q[i] += o.q[i];
+    }
+
+    double error(const cVector3d &v) const
+    {
+        double x = v.x(), y = v.y(), z = v.z();
+        return q[0]*x*x + 2*q[1]*x*y + 2*q[2]*x*z + 2*q[3]*x
+             + q[4]*y*y + 2*q[5]*y*z + 2*q[6]*y
+             + q[7]*z*z + 2*q[8]*z
+             + q[9];
+    }
+};
+
+//! A candidate collapse of vertex "from" into vertex "to".  The
+//! versions detect entries made stale by later collapses.
+struct Collapse
+{
+    double cost;
+    unsigned int from, to;
+    unsigned int vfrom, vto;
+
+    bool operator>(const Collapse &o) const { return cost > o.cost; }
+};
+
+typedef std::pair<double, std::pair<double, double> > PositionKey;
+
+}
+
+bool MeshSimplifier::simplify(cMesh *mesh, unsigned int target,
+                              std::vector<unsigned int> &triangles)
+{
+    unsigned int nv = mesh->m_vertices->getNumElements();
+    unsigned int nt = mesh->m_triangles->getNumElements();
+
+    // Weld vertices at the same position onto the first of them.
+    // The welded vertices are only used to find the topology and
+    // errors; each triangle corner also keeps a vertex of its own
+    // (corner), so that the output keeps the texture coordinates
+    // and normals of seams and hard edges.
+    std::vector<cVector3d> pos(nv);
+    std::vector<unsigned int> rep(nv);
+    std::map<PositionKey, unsigned int> welded;
+    for (unsigned int i = 0; i < nv; i++) {
+        pos[i] = mesh->m_vertices->getLocalPos(i);
+        PositionKey key(pos[i].x(), std::make_pair(pos[i].y(), pos[i].z()));
+        rep[i] = welded.insert(std::make_pair(key, i)).first->second;
+    }
+
+    std::vector<unsigned int> tris(nt*3), corner(nt*3);
+    std::vector<bool> live(nt, true);
+    unsigned int nlive = nt;
+    for (unsigned int t = 0; t < nt; t++) {
+        corner[t*3+0] = mesh->m_triangles->getVertexIndex0(t);
+        corner[t*3+1] = mesh->m_triangles->getVertexIndex1(t);
+        corner[t*3+2] = mesh->m_triangles->getVertexIndex2(t);
+        for (int k = 0; k < 3; k++)
+            tris[t*3+k] = rep[corner[t*3+k]];
+        if (tris[t*3+0] == tris[t*3+1] || tris[t*3+1] == tris[t*3+2]
+            || tris[t*3+2] == tris[t*3+0])
+        {
+            live[t] = false;
+            nlive--;
+        }
+    }
+
+    // Area-weighted plane quadrics and vertex-triangle adjacency
+    std::vector<Quadric> quadrics(nv);
+    std::vector<std::vector<unsigned int> > adj(nv);
+    for (unsigned int t = 0; t < nt; t++) {
+        if (!live[t])
+            continue;
+        unsigned int *v = &tris[t*3];
+        cVector3d n = cCross(pos[v[1]] - pos[v[0]], pos[v[2]] - pos[v[0]]);
+        double len = n.length();
+        if (len > 0) {
+            n /= len;
+            Quadric plane;
+            plane.addPlane(n, -n.dot(pos[v[0]]), len / 2);
+            for (int k = 0; k < 3; k++)
+                quadrics[v[k]].add(plane);
+        }
+        for (int k = 0; k < 3; k++)
+            adj[v[k]].push_back(t);
+    }
+
+    std::vector<unsigned int> version(nv, 0);
+    std::vector<bool> removed(nv, false);
+    std::priority_queue<Collapse, std::vector<Collapse>,
+                        std::greater<Collapse> > heap;
+
+    // Queue the cheaper direction of collapsing the edge (a,b).
+    auto push = [&](unsigned int a, unsigned int b) {
+        Quadric q(quadrics[a]);
+        q.add(quadrics[b]);
+        double ca = q.error(pos[a]), cb = q.error(pos[b]);
+        Collapse c;
+        if (ca < cb) { c.cost = ca; c.from = b; c.to = a; }
+        else         { c.cost = cb; c.from = a; c.to = b; }
+        c.vfrom = version[c.from];
+        c.vto = version[c.to];
+        heap.push(c);
+    };
+
+    for (unsigned int t = 0; t < nt; t++) {
+        if (!live[t])
+            continue;
+        for (int k = 0; k < 3; k++) {
+            unsigned int a = tris[t*3+k], b = tris[t*3+(k+1)%3];
+            if (a < b)
+                push(a, b);
+        }
+    }
+
+    while (nlive > target && !heap.empty())
+    {
+        Collapse c = heap.top();
+        heap.pop();
+
+        if (removed[c.from] || removed[c.to]
+            || version[c.from] != c.vfrom || version[c.to] != c.vto)
+            continue;
+
+        // Must still be an edge, and must not flip any triangle that
+        // only moves.
+        bool edge = false, ok = true;
+        std::vector<unsigned int>::iterator it;
+        for (it = adj[c.from].begin(); ok && it != adj[c.from].end(); it++)
+        {
+            if (!live[*it])
+                continue;
+            unsigned int *v = &tris[*it*3];
+            if (v[0] == c.to || v[1] == c.to || v[2] == c.to) {
+                edge = true;
+                continue;
+            }
+
+            cVector3d p[3], q[3];
+            for (int k = 0; k < 3; k++) {
+                p[k] = pos[v[k]];
+                q[k] = (v[k] == c.from) ? pos[c.to] : p[k];
+            }
+            cVector3d n0 = cCross(p[1] - p[0], p[2] - p[0]);
+            cVector3d n1 = cCross(q[1] - q[0], q[2] - q[0]);
+            double l0 = n0.length(), l1 = n1.length();
+            if (l1 == 0 || (l0 > 0 && n0.dot(n1) < SIMPLIFY_MIN_NORMAL_COS*l0*l1))
+                ok = false;
+        }
+        if (!edge || !ok)
+            continue;
+
+        // Corners that move take the vertex of the remaining end of
+        // the edge in a triangle on the same side of any seam, found
+        // from the triangles on the edge.
+        std::map<unsigned int, unsigned int> moved;
+        for (it = adj[c.from].begin(); it != adj[c.from].end(); it++)
+        {
+            if (!live[*it])
+                continue;
+            unsigned int *v = &tris[*it*3], *o = &corner[*it*3];
+            int kf = -1, kt = -1;
+            for (int k = 0; k < 3; k++) {
+                if (v[k] == c.from) kf = k;
+                if (v[k] == c.to) kt = k;
+            }
+            if (kf >= 0 && kt >= 0)
+                moved.insert(std::make_pair(o[kf], o[kt]));
+        }
+
+        // Collapse: triangles on the edge disappear, the others
+        // move to the remaining vertex.
+        for (it = adj[c.from].begin(); it != adj[c.from].end(); it++)
+        {
+            if (!live[*it])
+                continue;
+            unsigned int *v = &tris[*it*3], *o = &corner[*it*3];
+            if (v[0] == c.to || v[1] == c.to || v[2] == c.to) {
+                live[*it] = false;
+                nlive--;
+                continue;
+            }
+            for (int k = 0; k < 3; k++)
+                if (v[k] == c.from) {
+                    std::map<unsigned int, unsigned int>::iterator m =
+                        moved.find(o[k]);
+                    o[k] = (m != moved.end()) ? m->second : c.to;
+                    v[k] = c.to;
+                }
+            adj[c.to].push_back(*it);
+        }
+        adj[c.from].clear();
+        removed[c.from] = true;
+        quadrics[c.to].add(quadrics[c.from]);
+        version[c.to]++;
+
+        // Forget dead triangles and re-queue the remaining vertex's
+        // edges with its new quadric.
+        std::vector<unsigned int> &a = adj[c.to];
+        unsigned int n = 0;
+        for (unsigned int i = 0; i < a.size(); i++)
+            if (live[a[i]])
+                a[n++] = a[i];
+        a.resize(n);
+
+        for (unsigned int i = 0; i < a.size(); i++)
+            for (int k = 0; k < 3; k++)
+                if (tris[a[i]*3+k] != c.to)
+                    push(c.to, tris[a[i]*3+k]);
+    }
+
+    triangles.clear();
+    triangles.reserve(nlive*3);
+    for (unsigned int t = 0; t < nt; t++)
+        if (live[t])
+            triangles.insert(triangles.end(), &corner[t*3], &corner[t*3+3]);
+
+    return nlive <= target;
+}
@@ -0,0 +1,46 @@
+// -*- mode:c++; indent-tabs-mode:nil; c-basic-offset:4; -*-
+//======================================================================================
+/*
+    This file is part of DIMPLE, the Dynamic Interactive Musically PhysicaL Environment,
+
+    This code is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License("GPL") version 2
+    as published by the Free Software Foundation.  See the file LICENSE
+    for more information.
+
+    sinclair@music.mcgill.ca
+    http://www.music.mcgill.ca/~sinclair/content/dimple
+*/
+//======================================================================================
+
+#ifndef _MESH_SIMPLIFIER_H_
+#define _MESH_SIMPLIFIER_H_
+
+#include <vector>
+
+#include <world/CMesh.h>
+
+using namespace chai3d;
+
+//! The MeshSimplifier class reduces the number of triangles of a
+//! mesh by collapsing edges in order of their quadric error (Garland
+//! and Heckbert).  Each edge is collapsed into one of its existing
+//! endpoints, so a simplified mesh is only a new list of triangles
+//! over the vertices of the original one and can share its vertex
+//! array.
+class MeshSimplifier
+{
+  public:
+    //! Compute a list of triangles, as three vertex indices each,
+    //! approximating the mesh with at most the given number of
+    //! triangles.  Vertices at the same position are treated as one
+    //! so that seams do not open, but triangles keep their own
+    //! vertices where they can, so that texture seams and hard edges
+    //! keep their attributes.  Returns false if the mesh could not be
+    //! simplified that far, in which case triangles holds the closest
+    //! it got.
+    static bool simplify(cMesh *mesh, unsigned int target,
+                         std::vector<unsigned int> &triangles);
+};
+
+#endif // _MESH_SIMPLIFIER_H_
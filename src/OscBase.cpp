@@ -15,6 +15,7 @@
 //======================================================================================
 
 #include <lo/lo.h>
+#include <string.h>
 
 #include "OscBase.h"
 #include "dimple.h"
@@ -29,41 +30,59 @@ OscBase::OscBase(const char *name, OscBase *parent, lo_server server)
 #endif
     if (!m_server)
         throw "Object created without valid lo_server.";
+
+    m_pMethodTable = parent ? parent->m_pMethodTable : new OscMethodTable();
 }
 
 //! Add a handler for some OSC method
 void OscBase::addHandler(const char *methodname, const char* type, lo_method_handler h)
 {
-    // build OSC method name
-    std::string n("/" + m_name);
-    OscBase *p = m_parent;
-    while (p && p->name().length()>0) {
-        n = "/" + p->name() + n;
-        p = p->m_parent;
-    }
+    // build OSC method name from the cached path
+    std::string n(path());
     if (methodname && strlen(methodname)>0)
         n = n + "/" + methodname;
 
-    // add it to liblo server and store it
-    if (strstr(n.c_str(), "spring")!=0) printf("adding: %s, %s\n", n.c_str(), type);
-    if (lo_server_add_method(m_server, n.c_str(), type, h, this))
-    {
-        method_t m;
-        m.name = n;
-        m.type = type;
-        m_methods.push_back(m);
-    }
+    // add it to the method table and store it
+    m_pMethodTable->add(n, type, h, this);
+
+    method_t m;
+    m.name = n;
+    m.type = type;
+    m_methods.push_back(m);
 }
 
 OscBase::~OscBase()
 {
-    // remove all stored OSC methods from the liblo server
+    removeHandlers();
+
+    if (!m_parent)
+        delete m_pMethodTable;
+}
+
+//! Remove all stored OSC methods from the method table
+void OscBase::removeHandlers()
+{
     while (m_methods.size()>0) {
         method_t m = m_methods.back();
         m_methods.pop_back();
-        if (m_server)
-            lo_server_del_method(m_server, m.name.c_str(), m.type.c_str());
+        m_pMethodTable->remove(m.name, m.type.c_str(), this);
+    }
+}
+
+void OscBase::retire()
+{
+    removeHandlers();
+
+    std::vector<OscValue*>::iterator it;
+    for (it = m_values.begin(); it != m_values.end(); it++) {
+        simulation()->valuetimer().removeValue(*it);
+        simulation()->valuetimer().unwatchValue(*it);
+        (*it)->retire();
     }
+
+    std::vector<OscBase*>::iterator c;
+    for (c = m_children.begin(); c != m_children.end(); c++)
+        (*c)->retire();
 }
 
 Simulation *OscBase::simulation()
@@ -79,5 +98,123 @@ Simulation *OscBase::simulation()
     return NULL;
 }
 
+OscValue *OscBase::findValue(const char *name)
+{
+    std::vector<OscValue*>::iterator it;
+    for (it = m_values.begin(); it != m_values.end(); it++)
+        if ((*it)->name() == name)
+            return *it;
+    return NULL;
+}
+
+// ----------------------------------------------------------------------------------
+
+// Most arguments a message may have for its types to be coerced
+#define METHOD_MAX_COERCED_ARGS 32
+
+void OscMethodTable::add(const std::string &path, const char *type,
+                         lo_method_handler h, OscBase *owner)
+{
+    method_t m;
+    m.type = type;
+    m.handler = h;
+    m.owner = owner;
+    m_table[path].push_back(m);
+}
+
+void OscMethodTable::remove(const std::string &path, const char *type,
+                            OscBase *owner)
+{
+    table_t::iterator it = m_table.find(path);
+    if (it == m_table.end())
+        return;
+
+    std::vector<method_t> &methods = it->second;
+    std::vector<method_t>::iterator m;
+    for (m = methods.begin(); m != methods.end(); m++) {
+        if (m->owner == owner && m->type == type) {
+            methods.erase(m);
+            break;
+        }
+    }
+
+    if (methods.empty())
+        m_table.erase(it);
+}
+
+int OscMethodTable::handler(const char *path, const char *types, lo_arg **argv,
+                            int argc, void *data, void *user_data)
+{
+    OscMethodTable *me = static_cast<OscMethodTable*>(user_data);
+
+    if (!strpbrk(path, " #*,?[]{}"))
+        return me->dispatch(path, types, argv, argc, data);
+
+    // A pattern is sent to every method it matches, as liblo does.
+    // The matches are found first since handlers may add or remove
+    // methods.
+    std::vector<std::string> matches;
+    table_t::iterator it;
+    for (it = me->m_table.begin(); it != me->m_table.end(); it++)
+        if (lo_pattern_match(it->first.c_str(), path))
+            matches.push_back(it->first);
+
+    int ret = 1;
+    std::vector<std::string>::iterator m;
+    for (m = matches.begin(); m != matches.end(); m++)
+        if (me->dispatch(*m, types, argv, argc, data) == 0)
+            ret = 0;
+    return ret;
+}
+
+int OscMethodTable::dispatch(const std::string &path, const char *types,
+                             lo_arg **argv, int argc, void *data)
+{
+    lo_arg coerced[METHOD_MAX_COERCED_ARGS];
+    lo_arg *cargv[METHOD_MAX_COERCED_ARGS];
+
+    // Looked up again after each call, since a handler that does not
+    // take the message may still have changed the table.
+    for (size_t i = 0; ; i++)
+    {
+        table_t::iterator it = m_table.find(path);
+        if (it == m_table.end() || i >= it->second.size())
+            return 1;
+
+        method_t m = it->second[i];
+        const char *spec = m.type.c_str();
+        lo_arg **args = argv;
+
+        if (strcmp(types, spec) != 0)
+        {
+            if ((int)m.type.size() != argc || argc > METHOD_MAX_COERCED_ARGS)
+                continue;
+
+            // Numbers are converted and strings and symbols are
+            // interchangeable, as with liblo's coercion.
+            bool ok = true;
+            for (int j = 0; ok && j < argc; j++) {
+                lo_type from = (lo_type)types[j], to = (lo_type)spec[j];
+                cargv[j] = argv[j];
+                if (from == to)
+                    continue;
+                if (lo_is_string_type(from) && lo_is_string_type(to))
+                    continue;
+                ok = lo_is_numerical_type(from) && lo_is_numerical_type(to);
+                if (ok) {
+                    cargv[j] = &coerced[j];
+                    lo_coerce(to, &coerced[j], from, argv[j]);
+                }
+            }
+            if (!ok)
+                continue;
+            args = cargv;
+        }
+
+        if (m.handler(path.c_str(), spec, args, argc, data, m.owner) == 0)
+            return 0;
+    }
+}
+
 // ----------------------------------------------------------------------------------
 
@@ -21,8 +21,42 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 
 class Simulation;
+class OscValue;
+class OscBase;
+
+//! The OscMethodTable holds the OSC methods of every object in a
+//! simulation.  Rather than one liblo method each, a single generic
+//! liblo method looks up the message's path in the table, so that
+//! creating an object does not grow liblo's list of methods.
+class OscMethodTable
+{
+public:
+    void add(const std::string &path, const char *type,
+             lo_method_handler h, OscBase *owner);
+    void remove(const std::string &path, const char *type, OscBase *owner);
+
+    //! Generic liblo method, with the table as user data.
+    static int handler(const char *path, const char *types, lo_arg **argv,
+                       int argc, void *data, void *user_data);
+
+protected:
+    struct method_t {
+        std::string type;
+        lo_method_handler handler;
+        OscBase *owner;
+    };
+    typedef std::unordered_map<std::string, std::vector<method_t> > table_t;
+    table_t m_table;
+
+    //! Call the methods of one path whose types match or can be
+    //! coerced, as liblo would, until one returns 0.
+    int dispatch(const std::string &path, const char *types, lo_arg **argv,
+                 int argc, void *data);
+};
 
 //! The OscBase class handles basic OSC functions for dealing with LibLo.
 //! It keeps a record of the object's name and classname which becomes
@@ -43,6 +77,9 @@ public:
 
     Simulation *simulation();
 
+    //! Find one of this object's values by name, or NULL.
+    OscValue *findValue(const char *name);
+
 #ifdef DEBUG
     void traceOn() { m_bTrace = true; }
     void traceOff() { m_bTrace = false; }
@@ -60,12 +97,19 @@ public:
     //! specialization classes to access this method.
     virtual void addHandler(const char *methodname, const char* type, lo_method_handler h);
 
+    //! Remove the OSC methods of this object and its children, and
+    //! stop sending its values, so that it may be deleted later.
+    void retire();
+
 protected:
     std::string m_name;
     std::string m_path; // generated on demand, but we cache it here
     OscBase *m_parent;
     lo_server m_server;
 
+    //! Method table of the simulation, owned by the root object.
+    OscMethodTable *m_pMethodTable;
+
     /*! True if this object should output trace messages when compiled
      *  for debug. */
 #ifdef DEBUG
@@ -77,6 +121,15 @@ protected:
         std::string type;
     };
     std::vector <method_t> m_methods;
+    void removeHandlers();
+
+    //! Values belonging to this object, added by their constructors.
+    std::vector <OscValue*> m_values;
+    friend class OscValue;
+
+    //! Other children with methods, such as a constraint's response.
+    std::vector <OscBase*> m_children;
+    friend class OscResponse;
 
     //! The current lo_message, only valid for handlers.
     lo_message m_msg;
@@ -17,6 +17,7 @@
 #include "ValueTimer.h"
 #include "Simulation.h"
 #include <assert.h>
+#include <algorithm>
 
 // ----------------------------------------------------------------------------------
 
@@ -40,6 +41,8 @@ OscObject::OscObject(cGenericObject* p, const char *name, OscBase *parent)
       m_stiffness("stiffness", this)
 {
     m_pSpecial = NULL;
+    m_nHandle = -1;
+    m_bHandleSent = false;
 
     // Create handlers for OSC messages
     addHandler("destroy"    , ""   , OscObject::destroy_handler);
@@ -103,21 +106,11 @@ OscObject::OscObject(cGenericObject* p, const char *name, OscBase *parent)
 //! OscObject destructor.  Destoys any associated constraints.
 OscObject::~OscObject()
 {
-    constraint_list_iterator it = m_constraintList.begin();
-    while (it!=m_constraintList.end()) {
-        /* Remove the constraint from the other object's constraint
-           list before deleting. */
-        OscConstraint *o = *it;
-        if (o->object2()) {
-            if (this==o->object1())
-                o->object2()->m_constraintList.remove(o);
-            else if (this==o->object2())
-                o->object1()->m_constraintList.remove(o);
-        }
-
-        (**it).on_destroy();
-        it++;
-    }
+    /* Destroyed constraints remove themselves from both objects'
+       constraint lists.  Usually they are already destroyed, since
+       objects are deleted after being retired by the simulation. */
+    while (!m_constraintList.empty())
+        m_constraintList.front()->on_destroy();
 
     if (m_pSpecial) delete m_pSpecial;
 
@@ -125,6 +118,14 @@ OscObject::~OscObject()
                       simulation()->type_str(), c_name()));
 }
 
+void OscObject::send_handle(bool always)
+{
+    if (m_bHandleSent && !always)
+        return;
+    m_bHandleSent = true;
+    lo_send(address_send, (path()+"/handle").c_str(), "i", m_nHandle);
+}
+
 //! Inform object that it is in collision with another object.
 //! \return True if this is a new collision
 bool OscObject::collidedWith(OscObject *o, int count)
@@ -148,9 +149,8 @@ void OscObject::on_destroy()
 {
     simulation()->delete_object(*this);
 
-    /* The object's memory is freed in the above delete_object call.
-     * Should it be done here instead? Or perhaps moved to a deleted
-     * objects pool for later garbage collection. */
+    /* The object is only detached from the simulation here; its
+     * memory is freed later, between steps. */
 
     return;
 }
@@ -172,9 +172,12 @@ OscSphere::OscSphere(cGenericObject* p, const char *name, OscBase* parent)
 OscMesh::OscMesh(cGenericObject *p, const char *name,
                  const char *filename, OscBase *parent)
     : OscObject(p, name, parent),
-      m_size("size", this)
+      m_size("size", this),
+      m_collision_radius("collision/radius", this)
 {
     m_size.setSetCallback(set_size, this);
+    m_collision_radius.setSetCallback(set_collision_radius, this);
+    m_collision_radius.setValue(0.01, false);
 }
 
 OscCamera::OscCamera(const char *name, OscBase *parent)
@@ -199,6 +202,15 @@ OscResponse::OscResponse(const char* name, OscBase *parent)
     m_offset.setSetCallback(set_offset, this);
 
     addHandler("spring", "ff", OscResponse::spring_handler);
+
+    parent->m_children.push_back(this);
+}
+
+OscResponse::~OscResponse()
+{
+    std::vector<OscBase*> &children = m_parent->m_children;
+    children.erase(std::remove(children.begin(), children.end(), this),
+                   children.end());
 }
 
 double OscResponse::response(double position, double velocity)
@@ -228,17 +240,18 @@ OscConstraint::OscConstraint(const char *name, OscBase *parent,
     addHandler("destroy", "", OscConstraint::destroy_handler);
 }
 
-//! Destroy the constraint
-void OscConstraint::on_destroy()
+OscConstraint::~OscConstraint()
 {
     if (m_pSpecial)
         delete m_pSpecial;
+}
 
+//! Destroy the constraint
+void OscConstraint::on_destroy()
+{
     simulation()->delete_constraint(*this);
 
-    /* The constraint's memory is freed in the above delete_object
-     * call.  Should it be done here instead? Or perhaps moved to a
-     * deleted objects pool for later garbage collection. */
+    /* As for objects, the constraint's memory is freed later. */
 
     return;
 }
@@ -27,7 +27,14 @@
 //! This class is used to override behaviour of OscObject's values
 //! that can be generalized across different types of objets.  We
 //! "assign a specialization" instead of using multiple inheritance.
-class OscObjectSpecial {public:virtual ~OscObjectSpecial(){}};
+class OscObjectSpecial {
+  public:
+    virtual ~OscObjectSpecial(){}
+
+    //! Take the object out of the simulated world when it is
+    //! destroyed, ahead of its deletion.
+    virtual void detach() {}
+};
 
 //! The OscObject class keeps track of an object in the world. The object
 //! is some cGenericObject and some cODEPrimitve -- in other words, an
@@ -71,7 +78,20 @@ class OscObject : public OscBase
 
     OscObjectSpecial *special() { return m_pSpecial; }
 
+    //! Number identifying this object in messages about many
+    //! objects, or -1 for special objects.
+    int handle() { return m_nHandle; }
+
+    //! Tell the user this object's handle, unless it was already
+    //! told and always is false.
+    void send_handle(bool always=false);
+
   protected:
+    //! Assigned by the simulation when the object is added.
+    int m_nHandle;
+    bool m_bHandleSent;
+    friend class Simulation;
+
     /* This is used for any specialized behaviours defined for
      * OscValue members. See OscObjectSpecial for more information. */
     OscObjectSpecial *m_pSpecial;
@@ -103,6 +123,9 @@ class OscPrism : public OscObject
   public:
 	OscPrism(cGenericObject* p, const char *name, OscBase *parent=NULL);
 
+    void setSize(double x, double y, double z, bool effect=true)
+        { m_size.setValue(x, y, z, effect); }
+
   protected:
     OSCVECTOR3(OscPrism, size) {};
 };
@@ -113,6 +136,8 @@ class OscSphere : public OscObject
 	OscSphere(cGenericObject* p, const char *name, OscBase *parent=NULL);
 
     const OscScalar& getRadius();
+    void setRadius(double radius, bool effect=true)
+        { m_radius.setValue(radius, effect); }
 
   protected:
     OSCSCALAR(OscSphere, radius) {};
@@ -129,6 +154,7 @@ class OscMesh : public OscObject
 
   protected:
     OSCVECTOR3(OscMesh, size) {};
+    OSCSCALAR(OscMesh, collision_radius) {};
 
     static int size_handler(const char *path, const char *types, lo_arg **argv,
 							int argc, void *data, void *user_data);
@@ -157,6 +183,7 @@ class OscResponse : public OscBase
 {
 public:
     OscResponse(const char* name, OscBase *parent);
+    virtual ~OscResponse();
 
     double response(double position, double velocity);
 
@@ -171,7 +198,14 @@ public:
 //! This class is used to override behaviour of OscConstraint's values
 //! that can be generalized across different types of objets.  We
 //! "assign a specialization" instead of using multiple inheritance.
-class OscConstraintSpecial {public:virtual ~OscConstraintSpecial(){}};
+class OscConstraintSpecial {
+  public:
+    virtual ~OscConstraintSpecial(){}
+
+    //! Stop the constraint from acting when it is destroyed, ahead
+    //! of its deletion.
+    virtual void detach() {}
+};
 
 //! The OscConstraint class keeps track of ODE constraints between two
 //! objects in the world, or between one object and some point in the
@@ -180,7 +214,7 @@ class OscConstraint : public OscBase
 {
 public:
     OscConstraint(const char *name, OscBase *parent, OscObject *object1, OscObject *object2);
-    virtual ~OscConstraint() {};
+    virtual ~OscConstraint();
 
     OscObject *object1() { return m_object1; }
     OscObject *object2() { return m_object2; }
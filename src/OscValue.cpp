@@ -17,34 +17,113 @@
 #include "OscValue.h"
 #include "ValueTimer.h"
 #include "Simulation.h"
+#include "OscObject.h"
 #include <lo/lo.h>
+#include <algorithm>
+#include <string.h>
 
-OscValue::OscValue(const char *name, OscBase *parent)
+OscValue::OscValue(const char *name, OscBase *parent, bool handlers)
     : OscBase(name, parent)
 {
     m_set_callback = NULL;
     m_set_callback_data = NULL;
     m_get_callback = NULL;
     m_get_callback_data = NULL;
+    m_request_path = NULL;
+    m_request = NULL;
+    m_nTimerNode = -1;
+    m_pWatch = NULL;
+    m_nHeaderArgs = -1;
+
+    if (!handlers)
+        return;
+
+    parent->m_values.push_back(this);
 
     addHandler("get",           "i"  , OscValue::get_handler);
     addHandler("get",           ""   , OscValue::get_handler);
+    addHandler("watch",         "fi" , OscValue::watch_handler);
+    addHandler("watch",         "f"  , OscValue::watch_handler);
+    addHandler("unwatch",       ""   , OscValue::unwatch_handler);
 }
 
 OscValue::~OscValue()
 {
     simulation()->valuetimer().removeValue(this);
+    simulation()->valuetimer().unwatchValue(this);
+
+    std::vector<OscValue*> &values = m_parent->m_values;
+    values.erase(std::remove(values.begin(), values.end(), this),
+                 values.end());
+}
+
+void OscValue::send()
+{
+    lo_message msg = message();
+    lo_send_message(address_send, c_path(), msg);
+    lo_message_free(msg);
+}
+
+void OscValue::watch_changed()
+{
+    simulation()->valuetimer().changed(this);
+}
+
+bool OscValue::forward_request(const char *path, void *data, int interval)
+{
+    if (!m_get_callback)
+        return false;
+
+    m_request_path = path;
+    m_request = (lo_message)data;
+    m_get_callback(m_get_callback_data, *this, interval);
+    m_request_path = NULL;
+    m_request = NULL;
+    return true;
+}
+
+size_t OscValue::serialise(unsigned char *buf, size_t size,
+                           const float *args, int n)
+{
+    if (m_nHeaderArgs != n)
+    {
+        // OSC strings are null-terminated and padded to 4 bytes.
+        std::string types(",");
+        types.append(n, 'f');
+        m_header.assign(c_path(), c_path() + path().size() + 1);
+        m_header.resize((m_header.size() + 3) & ~3, 0);
+        m_header.insert(m_header.end(), types.c_str(),
+                        types.c_str() + types.size() + 1);
+        m_header.resize((m_header.size() + 3) & ~3, 0);
+        m_nHeaderArgs = n;
+    }
+
+    size_t total = m_header.size() + n * 4;
+    if (total > size)
+        return 0;
+
+    memcpy(buf, &m_header[0], m_header.size());
+    unsigned char *p = buf + m_header.size();
+    for (int i = 0; i < n; i++) {
+        lo_pcast32 c;
+        c.f = args[i];
+        c.nl = lo_htoo32(c.nl);
+        memcpy(p + i * 4, &c, 4);
+    }
+    return total;
 }
 
 int OscValue::get_handler(const char *path, const char *types, lo_arg **argv,
                           int argc, void *data, void *user_data)
 {
     OscValue *me = (OscValue*)user_data;
-    
-    if (me->m_get_callback) {
-        me->m_get_callback(me->m_get_callback_data, *me, (argc==1)?argv[0]->i:-1);
+
+    // Requests for many objects at once are handled by the simulation.
+    if (me->simulation()->pattern_request(data))
+        return 0;
+
+    if (me->forward_request(path, data, (argc==1)?argv[0]->i:-1))
         return 0;
-    }
 
     if (argc==0) {
         me->send();
@@ -60,6 +139,31 @@ int OscValue::get_handler(const char *path, const char *types, lo_arg **argv,
     return 0;
 }
 
+int OscValue::watch_handler(const char *path, const char *types, lo_arg **argv,
+                            int argc, void *data, void *user_data)
+{
+    OscValue *me = (OscValue*)user_data;
+
+    if (me->forward_request(path, data, -1))
+        return 0;
+
+    me->simulation()->valuetimer().watchValue(me, argv[0]->f,
+                                              (argc==2)?argv[1]->i:0);
+    return 0;
+}
+
+int OscValue::unwatch_handler(const char *path, const char *types, lo_arg **argv,
+                              int argc, void *data, void *user_data)
+{
+    OscValue *me = (OscValue*)user_data;
+
+    if (me->forward_request(path, data, -1))
+        return 0;
+
+    me->simulation()->valuetimer().unwatchValue(me);
+    return 0;
+}
+
 // ----------------------------------------------------------------------------------
 
 OscScalar::OscScalar(const char *name, OscBase *owner)
@@ -72,13 +176,16 @@ OscScalar::OscScalar(const char *name, OscBase *owner)
 void OscScalar::setValue(double value, bool effect)
 {
 	 m_value = value;
+     changed();
      if (m_set_callback && effect)
          m_set_callback(m_set_callback_data, *this);
 }
 
-void OscScalar::send()
+lo_message OscScalar::message()
 {
-    lo_send(address_send, c_path(), "f", m_value);
+    lo_message msg = lo_message_new();
+    lo_message_add(msg, "f", m_value);
+    return msg;
 }
 
 int OscScalar::_handler(const char *path, const char *types, lo_arg **argv,
@@ -88,6 +195,7 @@ int OscScalar::_handler(const char *path, const char *types, lo_arg **argv,
 
 	 if (argc == 1)
 		  me->m_value = argv[0]->f;
+     me->changed();
 
      if (me->m_set_callback)
          me->m_set_callback(me->m_set_callback_data, *me);
@@ -106,13 +214,16 @@ OscBoolean::OscBoolean(const char *name, OscBase *owner)
 void OscBoolean::setValue(bool value, bool effect)
 {
 	 m_value = value;
+     changed();
      if (m_set_callback && effect)
          m_set_callback(m_set_callback_data, *this);
 }
 
-void OscBoolean::send()
+lo_message OscBoolean::message()
 {
-    lo_send(address_send, c_path(), "i", (int)m_value);
+    lo_message msg = lo_message_new();
+    lo_message_add(msg, "i", (int)m_value);
+    return msg;
 }
 
 int OscBoolean::_handler(const char *path, const char *types, lo_arg **argv,
@@ -122,6 +233,7 @@ int OscBoolean::_handler(const char *path, const char *types, lo_arg **argv,
 
 	 if (argc == 1)
 		  me->m_value = argv[0]->i!=0;
+     me->changed();
 
      if (me->m_set_callback)
          me->m_set_callback(me->m_set_callback_data, *me);
@@ -147,13 +259,16 @@ void OscVector3::setValue(double _x, double _y, double _z, bool effect)
 {
     cVector3d::set(_x, _y, _z);
     m_magnitude.setValue(sqrt(_x*_x + _y*_y + _z*_z), false);
+    changed();
     if (m_set_callback && effect)
         m_set_callback(m_set_callback_data, *this);
 }
 
-void OscVector3::send()
+lo_message OscVector3::message()
 {
-    lo_send(address_send, c_path(), "fff", x(), y(), z());
+    lo_message msg = lo_message_new();
+    lo_message_add(msg, "fff", x(), y(), z());
+    return msg;
 }
 
 void OscVector3::set_magnitude_callback(OscVector3 *me, OscScalar& s)
@@ -165,6 +280,7 @@ void OscVector3::set_magnitude_callback(OscVector3 *me, OscScalar& s)
         ratio = s.m_value / me->length();
     
     *me *= ratio;
+    me->changed();
 
     if (me->m_set_callback)
         me->m_set_callback(me->m_set_callback_data, *me);
@@ -198,17 +314,19 @@ void OscMatrix3::setd(double m00, double m01, double m02,
                       double m20, double m21, double m22, bool effect)
 {
     cMatrix3d::set(m00, m01, m02, m10, m11, m12, m20, m21, m22);
+    changed();
     if (m_set_callback && effect)
         m_set_callback(m_set_callback_data, *this);
 }
 
-void OscMatrix3::send()
+lo_message OscMatrix3::message()
 {
-    lo_send(address_send, c_path(), "fffffffff",
-            (*this)(0,0), (*this)(0,1), (*this)(0,2),
-            (*this)(1,0), (*this)(1,1), (*this)(1,2),
-            (*this)(2,0), (*this)(2,1), (*this)(2,2)
-        );
+    lo_message msg = lo_message_new();
+    lo_message_add(msg, "fffffffff",
+                   (*this)(0,0), (*this)(0,1), (*this)(0,2),
+                   (*this)(1,0), (*this)(1,1), (*this)(1,2),
+                   (*this)(2,0), (*this)(2,1), (*this)(2,2));
+    return msg;
 }
 
 int OscMatrix3::_handler(const char *path, const char *types, lo_arg **argv,
@@ -236,14 +354,17 @@ OscString::OscString(const char *name, OscBase *owner)
 //    addHandler("get",           ""   , OscString::get_handler);
 }
 
-void OscString::send()
+lo_message OscString::message()
 {
-    lo_send(address_send, c_path(), "s", c_str());
+    lo_message msg = lo_message_new();
+    lo_message_add(msg, "s", c_str());
+    return msg;
 }
 
 void OscString::setValue(const std::string& s, bool effect)
 {
     assign(s);
+    changed();
     if (m_set_callback && effect)
         m_set_callback(m_set_callback_data, *this);
 }
@@ -251,6 +372,7 @@ void OscString::setValue(const std::string& s, bool effect)
 void OscString::setValue(const char* s, bool effect)
 {
     assign(s);
+    changed();
     if (m_set_callback && effect)
         m_set_callback(m_set_callback_data, *this);
 }
@@ -263,6 +385,7 @@ int OscString::_handler(const char *path, const char *types, lo_arg **argv,
 	 if (argc == 1) {
          me->assign(&argv[0]->s);
 	 }
+     me->changed();
      
      if (me->m_set_callback)
          me->m_set_callback(me->m_set_callback_data, *me);
@@ -270,3 +393,77 @@ int OscString::_handler(const char *path, const char *types, lo_arg **argv,
 	 return 0;
 }
 
+
+// ----------------------------------------------------------------------------------
+
+//! OscValueGroup is sent to "/world/all/<field>".
+OscValueGroup::OscValueGroup(const char *pattern, const char *field,
+                             OscBase *owner)
+    : OscValue(("all/" + std::string(field)).c_str(), owner, false),
+      m_pattern(pattern), m_field(field)
+{
+}
+
+void OscValueGroup::add(OscObject *obj)
+{
+    if (obj->handle() < 0 || !lo_pattern_match(obj->c_name(), m_pattern.c_str()))
+        return;
+
+    OscValue *value = obj->findValue(m_field.c_str());
+    if (!value)
+        return;
+
+    m_objects.push_back(obj);
+    m_members.push_back(value);
+
+    obj->send_handle();
+}
+
+void OscValueGroup::remove(OscObject *obj)
+{
+    for (unsigned int i=0; i < m_objects.size(); i++) {
+        if (m_objects[i] == obj) {
+            m_objects.erase(m_objects.begin()+i);
+            m_members.erase(m_members.begin()+i);
+            return;
+        }
+    }
+}
+
+void OscValueGroup::remove(const std::unordered_set<OscObject*> &objs)
+{
+    unsigned int n = 0;
+    for (unsigned int i=0; i < m_objects.size(); i++) {
+        if (objs.count(m_objects[i]))
+            continue;
+        m_objects[n] = m_objects[i];
+        m_members[n] = m_members[i];
+        n++;
+    }
+    m_objects.resize(n);
+    m_members.resize(n);
+}
+
+lo_message OscValueGroup::message()
+{
+    std::vector<uint32_t> records;
+    records.reserve(m_members.size() * (OSCVALUE_MAX_COMPONENTS+1));
+
+    double v[OSCVALUE_MAX_COMPONENTS];
+    for (unsigned int i=0; i < m_members.size(); i++) {
+        int n = m_members[i]->components(v);
+        records.push_back(lo_htoo32((uint32_t)m_objects[i]->handle()));
+        for (int j=0; j < n; j++) {
+            union { float f; uint32_t i; } c;
+            c.f = (float)v[j];
+            records.push_back(lo_htoo32(c.i));
+        }
+    }
+
+    lo_message msg = lo_message_new();
+    lo_blob blob = lo_blob_new(records.size() * sizeof(uint32_t),
+                               records.empty() ? NULL : &records[0]);
+    lo_message_add(msg, "sb", m_pattern.c_str(), blob);
+    lo_blob_free(blob);
+    return msg;
+}
@@ -19,6 +19,7 @@
 #include "OscBase.h"
 #include <math/CVector3d.h>
 #include <math/CMatrix3d.h>
+#include <stdint.h>
 
 using namespace chai3d;
 
@@ -88,29 +89,92 @@ using namespace chai3d;
 
 /* === End of macro definitions. */
 
+// Most numeric components of any value, for a 3x3 matrix
+#define OSCVALUE_MAX_COMPONENTS 9
+
+//! State of a /watch subscription to an OscValue.
+struct ValueWatch
+{
+    double threshold;
+    int interval_ms;
+    double last[OSCVALUE_MAX_COMPONENTS];  //! components when last sent
+    uint64_t sent_ms;                      //! ValueTimer time when last sent
+    bool bQueued;        //! will be sent at the end of this step
+    bool bPending;       //! changed too soon after the last send
+};
+
 //! The OscValue class is the base class for all OSC-accessible values,
 //! including vectors and scalars.
 class OscValue : public OscBase
 {
   public:
-    OscValue(const char *name, OscBase *owner);
+    //! Values created without handlers cannot be addressed by OSC
+    //! and are not found by their owner's findValue().
+    OscValue(const char *name, OscBase *owner, bool handlers=true);
     virtual ~OscValue();
-    virtual void send() = 0; //! Send the value to user receiver.
+    virtual void send(); //! Send the value to user receiver.
+
+    //! Create a message carrying the value.
+    virtual lo_message message() = 0;
+
+    //! Copy the value's numeric components into v and return how
+    //! many there are, or 0 if it is not numeric.
+    virtual int components(double *v) { return 0; }
 
     typedef void SetCallback(void*, OscValue&);
     void setSetCallback(SetCallback*c, void*d)
       { m_set_callback = c; m_set_callback_data = d; }
+
+    //! The get callback handles /get and /watch requests instead of
+    //! the value, for example to forward them.  The interval is -1
+    //! for /watch requests and /get without an interval.
     typedef void GetCallback(void*, OscValue&, int interval);
     void setGetCallback(GetCallback*c, void*d)
       { m_get_callback = c; m_get_callback_data = d; }
 
+    //! The path and message of the request passed to the get callback.
+    const char *request_path() { return m_request_path; }
+    lo_message request() { return m_request; }
+
+    //! Pass a request on to the get callback, returning false if
+    //! there is none.
+    bool forward_request(const char *path, void *data, int interval);
+
+    //! Serialise an OSC message to this value's path carrying n
+    //! floats into buf, returning its size, or 0 if it does not fit.
+    //! The padded address and type tag are built on first use.
+    size_t serialise(unsigned char *buf, size_t size,
+                     const float *args, int n);
+
   protected:
     SetCallback *m_set_callback;
     void *m_set_callback_data;
     GetCallback *m_get_callback;
     void *m_get_callback_data;
+    const char *m_request_path;
+    lo_message m_request;
+
+    //! Node of this value in the ValueTimer, or -1
+    int m_nTimerNode;
+
+    //! Serialised address and type tag, for m_nHeaderArgs floats
+    std::vector<unsigned char> m_header;
+    int m_nHeaderArgs;
+
+    //! Subscription to changes of this value, or NULL
+    ValueWatch *m_pWatch;
+    friend class ValueTimer;
+
+    //! Check the watch subscription after the value has changed.
+    void changed() { if (m_pWatch) watch_changed(); }
+    void watch_changed();
+
     static int get_handler(const char *path, const char *types, lo_arg **argv,
                            int argc, void *data, void *user_data);
+    static int watch_handler(const char *path, const char *types, lo_arg **argv,
+                             int argc, void *data, void *user_data);
+    static int unwatch_handler(const char *path, const char *types, lo_arg **argv,
+                               int argc, void *data, void *user_data);
 };
 
 //! The OscScalar class is used to maintain information about scalar values
@@ -123,7 +187,8 @@ class OscScalar : public OscValue
     //! Set the value with or without affecting the simulation.
 	void setValue(double value, bool effect=true);
 
-    void send();
+    lo_message message();
+    int components(double *v) { v[0] = m_value; return 1; }
 
     double m_value;
 
@@ -149,7 +214,8 @@ class OscBoolean : public OscValue
     //! Set the value with or without affecting the simulation.
 	void setValue(bool value, bool effect=true);
 
-    void send();
+    lo_message message();
+    int components(double *v) { v[0] = m_value; return 1; }
 
     bool m_value;
 
@@ -179,7 +245,9 @@ class OscVector3 : public OscValue, public cVector3d
     void setValue(const cVector3d& vec, bool effect=true)
         { setValue(vec.x(), vec.y(), vec.z(), effect); }
 
-    void send();
+    lo_message message();
+    int components(double *v)
+        { v[0] = x(); v[1] = y(); v[2] = z(); return 3; }
 
 	OscScalar m_magnitude;
 
@@ -207,7 +275,10 @@ class OscMatrix3 : public OscValue, public cMatrix3d
     void setd(double m00, double m01, double m02,
               double m10, double m11, double m12,
               double m20, double m21, double m22, bool effect=true);
-    void send();
+    lo_message message();
+    int components(double *v) {
+        for (int i=0; i<9; i++) v[i] = (*this)(i/3, i%3);
+        return 9; }
 
     typedef void SetCallback(void*, OscMatrix3&);
     void setSetCallback(SetCallback *c, void *d)
@@ -225,7 +296,7 @@ class OscString : public OscValue, public std::string
 {
   public:
     OscString(const char *name, OscBase *owner);
-    void send();
+    lo_message message();
 
     //! Set the string with or without affecting the simulation.
     void setValue(const std::string& s, bool effect=true);
@@ -245,4 +316,38 @@ class OscString : public OscValue, public std::string
                         int argc, void *data, void *user_data);
 };
 
+class OscObject;
+
+//! The OscValueGroup class sends one field of every object whose name
+//! matches an OSC pattern, for /world/<pattern>/<field>/get requests.
+//! Each message holds the pattern and a blob of records, one per
+//! object, giving its handle followed by the field's components as
+//! big-endian 32-bit integer and floats.
+class OscValueGroup : public OscValue
+{
+  public:
+    OscValueGroup(const char *pattern, const char *field, OscBase *owner);
+
+    const std::string& pattern() { return m_pattern; }
+    const std::string& field() { return m_field; }
+
+    //! Add an object if its name matches the pattern and it has the
+    //! field, and tell the user its handle.
+    void add(OscObject *obj);
+
+    //! Remove an object if it is in the group.
+    void remove(OscObject *obj);
+
+    //! Remove all objects of a set in a single pass.
+    void remove(const std::unordered_set<OscObject*> &objs);
+
+    lo_message message();
+
+  protected:
+    std::string m_pattern;
+    std::string m_field;
+    std::vector<OscObject*> m_objects;
+    std::vector<OscValue*> m_members;  //! the field of each object
+};
+
 #endif // _OSC_VALUE_H_
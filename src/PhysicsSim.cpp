@@ -3,6 +3,10 @@
 #include "dimple.h"
 #include "PhysicsSim.h"
 #include <cassert>
+#include <algorithm>
+
+// Most bodies kept for reuse for each class of geom
+#define ODE_POOL_MAX 1024
 
 bool PhysicsPrismFactory::create(const char *name, float x, float y, float z)
 {
@@ -151,7 +155,8 @@ bool PhysicsUniversalFactory::create(const char *name, OscObject *object1,
 const int PhysicsSim::MAX_CONTACTS = 30;
 
 PhysicsSim::PhysicsSim(const char *port)
-    : Simulation(port, ST_PHYSICS)
+    : Simulation(port, ST_PHYSICS),
+      m_stream(type_str())
 {
     m_pPrismFactory = new PhysicsPrismFactory(this);
     m_pSphereFactory = new PhysicsSphereFactory(this);
@@ -168,6 +173,8 @@ PhysicsSim::PhysicsSim(const char *port)
 
     m_fTimestep = physics_timestep_ms/1000.0;
     m_counter = 0;
+    m_nVisualSteps = std::max(1, (visual_timestep_ms + physics_timestep_ms/2)
+                                 / physics_timestep_ms);
     printf("ODE timestep: %f\n", m_fTimestep);
 }
 
@@ -220,7 +227,17 @@ void PhysicsSim::step()
 	dWorldQuickStep (m_odeWorld, m_fTimestep);
 	dJointGroupEmpty (m_odeContactGroup);
 
+    /* The visual simulation only shows the latest pose of each
+     * object per frame, so it is sent poses at its own rate, each
+     * batch stamped with the simulation time so that it can
+     * interpolate between them. */
+    bool visual = (m_counter % m_nVisualSteps) == 0;
+    if (visual)
+        sendtotype(Simulation::ST_VISUAL, false, "/world/time", "d",
+                   (double)m_counter * m_fTimestep);
+
     /* Update positions of each object in the other simulations */
+    m_streamed.clear();
     std::map<std::string,OscObject*>::iterator it;
     for (it=world_objects.begin(); it!=world_objects.end(); it++)
     {
@@ -228,14 +245,16 @@ void PhysicsSim::step()
 
         if (o) {
             o->update();
+            if (m_stream.active() && it->second->handle() >= 0)
+                m_streamed.push_back(o);
             cVector3d pos(o->getPosition());
             cMatrix3d rot(o->getRotation());
-            send(true, (it->second->path()+"/position").c_str(), "fff",
-                 pos.x(),pos.y(),pos.z());
-            send(true, (it->second->path()+"/rotation").c_str(), "fffffffff",
-                 rot(0,0), rot(0,1), rot(0,2),
-                 rot(1,0), rot(1,1), rot(1,2),
-                 rot(2,0), rot(2,1), rot(2,2));
+            float p[3] = { (float)pos.x(), (float)pos.y(), (float)pos.z() };
+            float r[9] = { (float)rot(0,0), (float)rot(0,1), (float)rot(0,2),
+                           (float)rot(1,0), (float)rot(1,1), (float)rot(1,2),
+                           (float)rot(2,0), (float)rot(2,1), (float)rot(2,2) };
+            send(it->second->m_position, p, 3, visual);
+            send(it->second->m_rotation, r, 9, visual);
         }
     }
 
@@ -246,9 +265,65 @@ void PhysicsSim::step()
         cit->second->simulationCallback();
     }
 
+    if (m_stream.active())
+        stream_state();
+
     m_counter++;
 }
 
+void PhysicsSim::stream_state()
+{
+    StateFrameHeader *h = m_stream.frame(m_streamed.size(), m_counter,
+                                         (double)m_counter * m_fTimestep);
+    char *frame = (char*)h;
+    int32_t *handles = (int32_t*)(frame + h->handles);
+    float *pos = (float*)(frame + h->positions);
+    float *rot = (float*)(frame + h->rotations);
+    float *vel = (float*)(frame + h->velocities);
+    uint8_t *contacts = (uint8_t*)(frame + h->contacts);
+
+    for (unsigned int i=0; i < m_streamed.size(); i++)
+    {
+        ODEObject *o = m_streamed[i];
+        const dReal *p = dBodyGetPosition(o->body());
+        const dReal *q = dBodyGetQuaternion(o->body());
+        const dReal *v = dBodyGetLinearVel(o->body());
+
+        handles[i] = o->object()->handle();
+        for (int j=0; j < 3; j++) {
+            pos[i*3+j] = (float)p[j];
+            vel[i*3+j] = (float)v[j];
+        }
+        for (int j=0; j < 4; j++)
+            rot[i*4+j] = (float)q[j];
+        contacts[i] = o->inContact(m_counter) ? 1 : 0;
+    }
+
+    m_stream.push();
+}
+
+bool PhysicsSim::add_object(OscObject& obj)
+{
+    if (!Simulation::add_object(obj))
+        return false;
+
+    if (m_stream.active() && obj.handle() >= 0)
+        obj.send_handle();
+    return true;
+}
+
+void PhysicsSim::on_stream_start(const char *target)
+{
+    if (!m_stream.start(target))
+        return;
+
+    // Tell the user which object each handle in the stream is.
+    object_iterator it;
+    for (it=world_objects.begin(); it!=world_objects.end(); it++)
+        if (it->second->handle() >= 0)
+            it->second->send_handle(true);
+}
+
 void PhysicsSim::ode_nearCallback (void *data, dGeomID o1, dGeomID o2)
 {
     PhysicsSim *me = static_cast<PhysicsSim*>(data);
@@ -274,6 +349,10 @@ void PhysicsSim::ode_nearCallback (void *data, dGeomID o1, dGeomID o2)
 	{
         OscObject *p1 = static_cast<OscObject*>(dGeomGetData(o1));
         OscObject *p2 = static_cast<OscObject*>(dGeomGetData(o2));
+        if (p1 && p1->special())
+            static_cast<ODEObject*>(p1->special())->contact(me->m_counter);
+        if (p2 && p2->special())
+            static_cast<ODEObject*>(p2->special())->contact(me->m_counter);
         if (p1 && p2) {
             bool co1 = p1->collidedWith(p2, me->m_counter);
             bool co2 = p2->collidedWith(p1, me->m_counter);
@@ -301,14 +380,82 @@ void PhysicsSim::set_grabbed(OscObject *pGrabbed)
 
 /****** ODEObject ******/
 
-ODEObject::ODEObject(OscObject *obj, dGeomID odeGeom, dWorldID odeWorld, dSpaceID odeSpace)
+ODEPool::~ODEPool()
+{
+    std::map<int, std::vector<entry_t> >::iterator it;
+    for (it = m_free.begin(); it != m_free.end(); it++) {
+        std::vector<entry_t>::iterator e;
+        for (e = it->second.begin(); e != it->second.end(); e++) {
+            dBodyDestroy(e->body);
+            dGeomDestroy(e->geom);
+        }
+    }
+}
+
+bool ODEPool::take(dSpaceID space, int geomClass, dBodyID &body,
+                   dGeomID &geom)
+{
+    std::vector<entry_t> &free = m_free[geomClass];
+    if (free.empty())
+        return false;
+
+    body = free.back().body;
+    geom = free.back().geom;
+    free.pop_back();
+
+    dQuaternion q = {1, 0, 0, 0};
+    dBodySetPosition(body, 0, 0, 0);
+    dBodySetQuaternion(body, q);
+    dBodySetLinearVel(body, 0, 0, 0);
+    dBodySetAngularVel(body, 0, 0, 0);
+    dBodySetForce(body, 0, 0, 0);
+    dBodySetTorque(body, 0, 0, 0);
+    dBodyEnable(body);
+    dGeomEnable(geom);
+    dSpaceAdd(space, geom);
+    return true;
+}
+
+void ODEPool::give(dBodyID body, dGeomID geom)
+{
+    std::vector<entry_t> &free = m_free[dGeomGetClass(geom)];
+    if (free.size() >= ODE_POOL_MAX) {
+        dBodyDestroy(body);
+        dGeomDestroy(geom);
+        return;
+    }
+
+    // Joints are left attached to nothing, as when a body is
+    // destroyed.
+    while (dBodyGetNumJoints(body) > 0)
+        dJointAttach(dBodyGetJoint(body, 0), 0, 0);
+
+    // Pooled geoms are taken out of the space, since a simple space
+    // still visits disabled geoms when colliding every pair.
+    dBodyDisable(body);
+    dGeomDisable(geom);
+    dGeomSetData(geom, NULL);
+    if (dGeomGetSpace(geom))
+        dSpaceRemove(dGeomGetSpace(geom), geom);
+
+    entry_t e;
+    e.body = body;
+    e.geom = geom;
+    free.push_back(e);
+}
+
+ODEObject::ODEObject(OscObject *obj, dGeomID odeGeom, dWorldID odeWorld, dSpaceID odeSpace,
+                     dBodyID odeBody, ODEPool *pool)
     : m_odeWorld(odeWorld), m_odeSpace(odeSpace)
 {
     m_object = obj;
+    m_pPool = pool;
+    m_nContactStep = -1;
 
     m_odeGeom = odeGeom;
-    m_odeBody = NULL;
-    m_odeBody = dBodyCreate(m_odeWorld);
+    m_odeBody = odeBody;
+    if (!m_odeBody)
+        m_odeBody = dBodyCreate(m_odeWorld);
 
     assert(m_odeGeom!=NULL);
 
@@ -337,10 +484,28 @@ ODEObject::ODEObject(OscObject *obj, dGeomID odeGeom, dWorldID odeWorld, dSpaceI
 
 ODEObject::~ODEObject()
 {
+    if (m_pPool && m_odeBody && m_odeGeom) {
+        m_pPool->give(m_odeBody, m_odeGeom);
+        return;
+    }
+
     if (m_odeBody)  dBodyDestroy(m_odeBody);
     if (m_odeGeom)  dGeomDestroy(m_odeGeom);
 }
 
+void ODEObject::detach()
+{
+    // Joints are detached as well, or a joint to an enabled body
+    // would enable this one again.
+    if (m_odeBody) {
+        while (dBodyGetNumJoints(m_odeBody) > 0)
+            dJointAttach(dBodyGetJoint(m_odeBody, 0), 0, 0);
+        dBodyDisable(m_odeBody);
+    }
+    if (m_odeGeom)
+        dGeomDisable(m_odeGeom);
+}
+
 void ODEObject::update()
 {
     OscObject *o = object();
@@ -455,14 +620,27 @@ ODEConstraint::~ODEConstraint()
         dJointDestroy(m_odeJoint);
 }
 
+void ODEConstraint::detach()
+{
+    if (m_odeJoint)
+        dJointAttach(m_odeJoint, 0, 0);
+}
+
 /****** OscSphereODE ******/
 
 OscSphereODE::OscSphereODE(dWorldID odeWorld, dSpaceID odeSpace, const char *name, OscBase *parent)
     : OscSphere(NULL, name, parent)
 {
-    dGeomID odeGeom = dCreateSphere(odeSpace, m_radius.m_value);
-
-    m_pSpecial = new ODEObject(this, odeGeom, odeWorld, odeSpace);
+    ODEPool &pool = static_cast<PhysicsSim*>(simulation())->pool();
+    dBodyID odeBody = NULL;
+    dGeomID odeGeom;
+    if (pool.take(odeSpace, dSphereClass, odeBody, odeGeom))
+        dGeomSphereSetRadius(odeGeom, m_radius.m_value);
+    else
+        odeGeom = dCreateSphere(odeSpace, m_radius.m_value);
+
+    m_pSpecial = new ODEObject(this, odeGeom, odeWorld, odeSpace,
+                               odeBody, &pool);
     m_density.setValue(m_density.m_value);
 }
 
@@ -506,9 +684,16 @@ void OscSphereODE::on_density()
 OscPrismODE::OscPrismODE(dWorldID odeWorld, dSpaceID odeSpace, const char *name, OscBase *parent)
     : OscPrism(NULL, name, parent)
 {
-    dGeomID odeGeom = dCreateBox(odeSpace, m_size.x(), m_size.y(), m_size.z());
-
-    m_pSpecial = new ODEObject(this, odeGeom, odeWorld, odeSpace);
+    ODEPool &pool = static_cast<PhysicsSim*>(simulation())->pool();
+    dBodyID odeBody = NULL;
+    dGeomID odeGeom;
+    if (pool.take(odeSpace, dBoxClass, odeBody, odeGeom))
+        dGeomBoxSetLengths(odeGeom, m_size.x(), m_size.y(), m_size.z());
+    else
+        odeGeom = dCreateBox(odeSpace, m_size.x(), m_size.y(), m_size.z());
+
+    m_pSpecial = new ODEObject(this, odeGeom, odeWorld, odeSpace,
+                               odeBody, &pool);
     m_density.setValue(m_density.m_value);
 }
 
@@ -5,10 +5,38 @@
 
 #include "Simulation.h"
 #include "OscObject.h"
+#include "StateStream.h"
 #include <ode/ode.h>
+#include <map>
 
 class ODEObject;
 
+//! Bodies and geoms of destroyed objects, kept disabled and out of
+//! the collision space for reuse by new objects with the same class
+//! of geom, so that objects created and destroyed continually do not
+//! rebuild them each time.
+class ODEPool
+{
+  public:
+    virtual ~ODEPool();
+
+    //! Take a body and geom of the given geom class, enabled, at
+    //! rest at the origin and added to space, or return false if
+    //! there are none.
+    bool take(dSpaceID space, int geomClass, dBodyID &body, dGeomID &geom);
+
+    //! Disable a body and its geom, remove the geom from its space,
+    //! and keep them for reuse.
+    void give(dBodyID body, dGeomID geom);
+
+  protected:
+    struct entry_t {
+        dBodyID body;
+        dGeomID geom;
+    };
+    std::map<int, std::vector<entry_t> > m_free;
+};
+
 class PhysicsSim : public Simulation
 {
   public:
@@ -28,6 +56,14 @@ class PhysicsSim : public Simulation
     //! Set the grabbed object or ungrab by setting to NULL.
     virtual void set_grabbed(OscObject *pGrabbed);
 
+    virtual bool add_object(OscObject& obj);
+
+    virtual void on_stream_start(const char *target);
+    virtual void on_stream_stop()
+      { m_stream.stop(); }
+
+    ODEPool& pool() { return m_pool; }
+
   protected:
     dWorldID m_odeWorld;
     dSpaceID m_odeSpace;
@@ -38,6 +74,15 @@ class PhysicsSim : public Simulation
 
     bool m_bGetCollide;
     int m_counter;
+    int m_nVisualSteps;          //! steps per pose update of the visuals
+
+    StateStream m_stream;        //! frames sent by /world/stream
+    std::vector<ODEObject*> m_streamed;  //! objects in this step's frame
+
+    ODEPool m_pool;              //! bodies of destroyed objects
+
+    //! Write the state of all objects to the stream.
+    void stream_state();
 
     virtual void initialize();
     virtual void step();
@@ -178,9 +223,15 @@ protected:
 class ODEObject : public OscObjectSpecial
 {
 public:
-    ODEObject(OscObject *obj, dGeomID odeGeom, dWorldID odeWorld, dSpaceID odeSpace);
+    //! A body is created unless one is given.  Given a pool, the
+    //! body and geom are returned to it instead of being destroyed.
+    ODEObject(OscObject *obj, dGeomID odeGeom, dWorldID odeWorld, dSpaceID odeSpace,
+              dBodyID odeBody=NULL, ODEPool *pool=NULL);
     virtual ~ODEObject();
 
+    //! Take the body and geom out of the simulation when destroyed.
+    virtual void detach();
+
     cVector3d getPosition() {
       const dReal *p = dBodyGetPosition(m_odeBody);
       return cVector3d(p[0], p[1], p[2]);
@@ -196,6 +247,12 @@ public:
 
     //! Update ODE dynamics information for this object.
     void update();
+
+    //! Note that the object touched something during a step.
+    void contact(int step) { m_nContactStep = step; }
+
+    //! True if the object touched something during a step.
+    bool inContact(int step) { return m_nContactStep == step; }
     
     //! Remove the association between the body and geom.
     void disconnectBody()
@@ -221,6 +278,9 @@ protected:
     dSpaceID m_odeSpace;
 
     OscObject *m_object;
+    ODEPool *m_pPool;
+
+    int m_nContactStep;
 
     static void on_set_force(void* me, OscVector3 &f);
     static void on_set_position(void* me, OscVector3 &p);
@@ -242,6 +302,9 @@ public:
                   OscObject *object1, OscObject *object2);
     virtual ~ODEConstraint();
 
+    //! Attach the joint to nothing when destroyed.
+    virtual void detach();
+
     dJointID joint() { return m_odeJoint; }
     OscConstraint *constraint() { return m_constraint; }
     dBodyID body1() { return m_odeBody1; }
@@ -2,6 +2,7 @@
 
 #include <chrono>
 #include <cerrno>
+#include <algorithm>
 
 #include <lo/lo.h>
 
@@ -10,6 +11,10 @@
 #include "Simulation.h"
 #include "OscObject.h"
 
+// Longest time in milliseconds that the interface waits for room in
+// a full simulation queue before dropping a message.
+#define QUEUE_WAIT_MS 1000
+
 ShapeFactory::ShapeFactory(char *name, Simulation *parent)
     : OscBase(name, parent)
 {
@@ -19,11 +24,38 @@ ShapeFactory::~ShapeFactory()
 {
 }
 
+// Convert a blob of big-endian 32-bit values to host order, returning
+// the number of records of n values it holds, or -1 if it does not
+// hold whole records.
+static int blob_records(Simulation *sim, const char *path, lo_blob b,
+                        int n, std::vector<lo_pcast32> &records)
+{
+    uint32_t size = lo_blob_datasize(b);
+    if (size % (n*4) != 0) {
+        printf("[%s] %s expects records of %d values.\n",
+               sim->type_str(), path, n);
+        return -1;
+    }
+
+    const unsigned char *data = (const unsigned char*)lo_blob_dataptr(b);
+    records.resize(size/4);
+    for (uint32_t i=0; i < size/4; i++) {
+        memcpy(&records[i].nl, data + i*4, 4);
+        records[i].nl = lo_otoh32(records[i].nl);
+    }
+    return size / (n*4);
+}
+
 PrismFactory::PrismFactory(Simulation *parent)
     : ShapeFactory("prism", parent)
 {
     // Name, Width, Height, Depth
     addHandler("create", "sfff", create_handler);
+
+    // Name prefix, records of x, y, z, width, height, depth, and
+    // optionally the index of the first record
+    addHandler("create_many", "sb", create_many_handler);
+    addHandler("create_many", "sbi", create_many_handler);
 }
 
 PrismFactory::~PrismFactory()
@@ -56,11 +88,59 @@ int PrismFactory::create_handler(const char *path, const char *types, lo_arg **a
     return 0;
 }
 
+int PrismFactory::create_many_handler(const char *path, const char *types,
+                                      lo_arg **argv, int argc, void *data,
+                                      void *user_data)
+{
+    PrismFactory *me = static_cast<PrismFactory*>(user_data);
+
+    std::vector<lo_pcast32> records;
+    int count = blob_records(me->simulation(), path, (lo_blob)argv[1],
+                             6, records);
+    int first = (argc > 2) ? argv[2]->i : 0;
+    if (count > 0)
+        me->create_many(&argv[0]->s, &records[0], count, first,
+                        (lo_blob)argv[1]);
+
+    return 0;
+}
+
+void PrismFactory::create_many(const char *prefix, const lo_pcast32 *records,
+                               int count, int first, lo_blob blob)
+{
+    char name[256];
+    for (int i=0; i<count; i++)
+    {
+        const lo_pcast32 *r = records + i*6;
+        snprintf(name, sizeof(name), "%s%d", prefix, first+i);
+
+        if (simulation()->find_object(name)) {
+            printf("[%s] Already an object named %s\n",
+                   simulation()->type_str(), name);
+            continue;
+        }
+
+        if (!create(name, r[0].f, r[1].f, r[2].f)) {
+            printf("[%s] Error creating prism '%s'.\n",
+                   simulation()->type_str(), name);
+            continue;
+        }
+
+        OscPrism *prism = static_cast<OscPrism*>(simulation()->find_object(name));
+        prism->setSize(r[3].f, r[4].f, r[5].f);
+    }
+}
+
 SphereFactory::SphereFactory(Simulation *parent)
     : ShapeFactory("sphere", parent)
 {
     // Name, Radius
     addHandler("create", "sfff", create_handler);
+
+    // Name prefix, records of x, y, z, radius, and optionally the
+    // index of the first record
+    addHandler("create_many", "sb", create_many_handler);
+    addHandler("create_many", "sbi", create_many_handler);
 }
 
 SphereFactory::~SphereFactory()
@@ -93,6 +173,49 @@ int SphereFactory::create_handler(const char *path, const char *types, lo_arg **
     return 0;
 }
 
+int SphereFactory::create_many_handler(const char *path, const char *types,
+                                       lo_arg **argv, int argc, void *data,
+                                       void *user_data)
+{
+    SphereFactory *me = static_cast<SphereFactory*>(user_data);
+
+    std::vector<lo_pcast32> records;
+    int count = blob_records(me->simulation(), path, (lo_blob)argv[1],
+                             4, records);
+    int first = (argc > 2) ? argv[2]->i : 0;
+    if (count > 0)
+        me->create_many(&argv[0]->s, &records[0], count, first,
+                        (lo_blob)argv[1]);
+
+    return 0;
+}
+
+void SphereFactory::create_many(const char *prefix, const lo_pcast32 *records,
+                                int count, int first, lo_blob blob)
+{
+    char name[256];
+    for (int i=0; i<count; i++)
+    {
+        const lo_pcast32 *r = records + i*4;
+        snprintf(name, sizeof(name), "%s%d", prefix, first+i);
+
+        if (simulation()->find_object(name)) {
+            printf("[%s] Already an object named %s\n",
+                   simulation()->type_str(), name);
+            continue;
+        }
+
+        if (!create(name, r[0].f, r[1].f, r[2].f)) {
+            printf("[%s] Error creating sphere '%s'.\n",
+                   simulation()->type_str(), name);
+            continue;
+        }
+
+        OscSphere *sphere = static_cast<OscSphere*>(simulation()->find_object(name));
+        sphere->setRadius(r[3].f);
+    }
+}
+
 MeshFactory::MeshFactory(Simulation *parent)
     : ShapeFactory("mesh", parent)
 {
@@ -337,6 +460,11 @@ BallJointFactory::BallJointFactory(Simulation *parent)
 {
     // Name, object1, object2, x, y, z
     addHandler("create", "sssfff", create_handler);
+
+    // Name prefix, object prefix, records of object1, object2, x, y,
+    // z, and optionally the index of the first record
+    addHandler("create_many", "ssb", create_many_handler);
+    addHandler("create_many", "ssbi", create_many_handler);
 }
 
 BallJointFactory::~BallJointFactory()
@@ -385,6 +513,78 @@ int BallJointFactory::create_handler(const char *path, const char *types, lo_arg
     return 0;
 }
 
+int BallJointFactory::create_many_handler(const char *path, const char *types,
+                                          lo_arg **argv, int argc, void *data,
+                                          void *user_data)
+{
+    BallJointFactory *me = static_cast<BallJointFactory*>(user_data);
+
+    std::vector<lo_pcast32> records;
+    int count = blob_records(me->simulation(), path, (lo_blob)argv[2],
+                             5, records);
+    int first = (argc > 3) ? argv[3]->i : 0;
+    if (count > 0)
+        me->create_many(&argv[0]->s, &argv[1]->s, &records[0], count,
+                        first, (lo_blob)argv[2]);
+
+    return 0;
+}
+
+void BallJointFactory::create_many(const char *prefix, const char *objects,
+                                   const lo_pcast32 *records, int count,
+                                   int first, lo_blob blob)
+{
+    char name[256];
+    for (int i=0; i<count; i++)
+    {
+        const lo_pcast32 *r = records + i*5;
+        snprintf(name, sizeof(name), "%s%d", prefix, first+i);
+
+        OscObject *object1, *object2;
+        if (!find_objects(name, objects, r[0].i, r[1].i, object1, object2))
+            continue;
+
+        if (!create(name, object1, object2, r[2].f, r[3].f, r[4].f))
+            printf("[%s] Error creating ball constraint '%s'.\n",
+                   simulation()->type_str(), name);
+    }
+}
+
+bool BallJointFactory::find_objects(const char *name, const char *objects,
+                                    int index1, int index2,
+                                    OscObject *&object1, OscObject *&object2)
+{
+    char objname[256];
+    object1 = object2 = 0;
+
+    if (index1 >= 0) {
+        snprintf(objname, sizeof(objname), "%s%d", objects, index1);
+        object1 = simulation()->find_object(objname);
+    }
+    if (index2 >= 0) {
+        snprintf(objname, sizeof(objname), "%s%d", objects, index2);
+        object2 = simulation()->find_object(objname);
+    }
+
+    // Swap objects if one is world
+    if (object2 && !object1) {
+        object1 = object2;
+        object2 = 0;
+    }
+
+    // At least one object must exist
+    if (!object1) {
+        printf("[%s] Error creating ball constraint '%s', "
+               "objects %s%d and %s%d not found.\n",
+               simulation()->type_str(), name,
+               objects, index1, objects, index2);
+        return false;
+    }
+
+    // The objects cannot be the same.
+    return object1 != object2;
+}
+
 SlideFactory::SlideFactory(Simulation *parent)
     : ShapeFactory("slide", parent)
 {
@@ -568,26 +768,56 @@ SimulationReceiver::SimulationReceiver(const char *url, int type)
     }
 
     m_bUseQueue = false;
+    m_bWait = false;
 }
 
-SimulationReceiver::SimulationReceiver(Simulation &sim)
+SimulationReceiver::SimulationReceiver(Simulation &sim, bool wait)
     : m_addr(sim.addr()), m_fTimestep(sim.timestep()),
       m_type(sim.type()), m_queue(msg_queue_size)
 {
     m_bUseQueue = true;
+    m_bWait = wait;
     sim.add_queue(&m_queue);
 }
 
 void SimulationReceiver::send_lo_message(const char *path, lo_message msg)
 {
 #ifdef USE_QUEUES
-    if (m_bUseQueue)
-        m_queue.write_lo_message(path, msg);
+    if (m_bUseQueue) {
+        if (m_queue.write_lo_message(path, msg))
+            return;
+
+        // The interface is not real-time, so it waits for the
+        // receiver to make room rather than losing the message.
+        int waited = 0;
+        if (m_bWait && m_queue.fits(lo_message_length(msg, path))) {
+            while (waited < QUEUE_WAIT_MS
+                   && !m_queue.write_lo_message(path, msg))
+            {
+                Sleep(1);
+                waited++;
+            }
+            if (waited < QUEUE_WAIT_MS)
+                return;
+        }
+        printf("Queue full, dropped message %s\n", path);
+    }
     else
 #endif
         lo_send_message(addr(), path, msg);
 }
 
+bool SimulationReceiver::send_serialised(unsigned char *msgbuf, size_t size)
+{
+#ifdef USE_QUEUES
+    if (m_bUseQueue) {
+        m_queue.write_serialised(msgbuf, size);
+        return true;
+    }
+#endif
+    return false;
+}
+
 /****** Simulation *******/
 
 Simulation::Simulation(const char *port, int type)
@@ -601,6 +831,14 @@ Simulation::Simulation(const char *port, int type)
       m_workspace_size("workspace/size", this),
       m_workspace_center("workspace/center", this)
 {
+    // Must come before the method table.
+    lo_server_add_method(m_server, NULL, NULL, Simulation::pattern_handler, this);
+    lo_server_add_method(m_server, NULL, NULL, OscMethodTable::handler,
+                         m_pMethodTable);
+    m_patternRequest = NULL;
+    m_nNextHandle = 0;
+    m_fReclaimCost = 0;
+
     m_addr = lo_address_new("localhost", port);
     m_type = type;
 
@@ -631,6 +869,11 @@ Simulation::~Simulation()
 {
     stop();
 
+    std::vector<OscValueGroup*>::iterator it;
+    for (it = m_valueGroups.begin(); it != m_valueGroups.end(); it++)
+        delete *it;
+    m_valueGroups.clear();
+
     if (m_server) {
         lo_server_free(m_server);
         m_server = 0;
@@ -657,7 +900,7 @@ void Simulation::add_receiver(Simulation *sim, const char *spec,
 {
     SimulationReceiver *r = NULL;
     if (sim)
-        r = new SimulationReceiver(*sim);
+        r = new SimulationReceiver(*sim, m_type == ST_INTERFACE);
     else if (spec[0] != '\0') {
         // Check that we don't already have it in the list
         std::vector<SimulationReceiver*>::iterator it;
@@ -773,8 +1016,18 @@ void Simulation::initialize()
     addHandler("workspace/learn", "", Simulation::workspace_learn_handler);
     addHandler("workspace/freeze", "", Simulation::workspace_freeze_handler);
     addHandler("workspace/standard", "", Simulation::workspace_standard_handler);
+    addHandler("capture/start", "s", Simulation::capture_start_handler);
+    addHandler("capture/stop", "", Simulation::capture_stop_handler);
+    addHandler("stream/start", "s", Simulation::stream_start_handler);
+    addHandler("stream/stop", "", Simulation::stream_stop_handler);
 }
 
+// Part of each timestep that may be spent deleting retired objects
+#define RECLAIM_FRACTION 0.25
+
+// Per-step decay of the estimated cost of deleting one object
+#define RECLAIM_COST_DECAY 0.9
+
 void* Simulation::run(void* param)
 {
     Simulation* me = static_cast<Simulation*>(param);
@@ -822,6 +1075,7 @@ void* Simulation::run(void* param)
         me->m_clock.stop();
         me->step();
         me->m_valueTimer.onTimer(step_ms);
+        me->reclaim(me->m_fTimestep * RECLAIM_FRACTION);
     }
 
     printf("[%s] Simulation done.\n", me->type_str());
@@ -834,6 +1088,15 @@ bool Simulation::add_object(OscObject& obj)
 {
     world_objects[obj.name()] = &obj;
 
+    // Special objects are not counted, so that handles agree between
+    // simulations.
+    if (obj.name() != "cursor" && obj.name() != "device")
+        obj.m_nHandle = m_nNextHandle++;
+
+    std::vector<OscValueGroup*>::iterator it;
+    for (it = m_valueGroups.begin(); it != m_valueGroups.end(); it++)
+        (*it)->add(&obj);
+
     printf("[%s] Added object %s\n", type_str(), obj.c_name());
     return true;
 }
@@ -845,8 +1108,12 @@ bool Simulation::delete_object(OscObject& obj)
     if (m_pGrabbedObject == &obj)
         set_grabbed(NULL);
 
+    std::vector<OscValueGroup*>::iterator it;
+    for (it = m_valueGroups.begin(); it != m_valueGroups.end(); it++)
+        (*it)->remove(&obj);
+
     world_objects.erase(obj.name());
-    delete &obj;
+    retire(obj);
 
     return true;
 }
@@ -872,11 +1139,36 @@ bool Simulation::delete_constraint(OscConstraint& obj)
     printf("[%s] Removing constraint %s\n", type_str(), obj.c_name());
 
     world_constraints.erase(obj.name());
-    delete &obj;
+    retire(obj);
 
     return true;
 }
 
+void Simulation::retire(OscObject& obj)
+{
+    // Constraints are destroyed with their objects.
+    while (!obj.m_constraintList.empty())
+        obj.m_constraintList.front()->on_destroy();
+
+    if (obj.special())
+        obj.special()->detach();
+    obj.retire();
+    m_retiredObjects.push_back(&obj);
+}
+
+void Simulation::retire(OscConstraint& obj)
+{
+    if (obj.object1())
+        obj.object1()->m_constraintList.remove(&obj);
+    if (obj.object2())
+        obj.object2()->m_constraintList.remove(&obj);
+
+    if (obj.special())
+        obj.special()->detach();
+    obj.retire();
+    m_retiredConstraints.push_back(&obj);
+}
+
 // from liblo internals:
 // eventually this will be a public function in liblo,
 // but for now we'll reproduce it here.
@@ -1002,6 +1294,39 @@ void Simulation::send(bool throttle, const char *path, const char *types, ...)
     lo_message_free(msg);
 }
 
+void Simulation::send(OscValue &value, const float *args, int n,
+                      bool visual)
+{
+    unsigned char msgbuf[1024];
+    size_t size = value.serialise(msgbuf+sizeof(size_t),
+                                  sizeof(msgbuf)-sizeof(size_t), args, n);
+
+    // Only built for receivers outside this process.
+    lo_message msg = NULL;
+
+    std::vector<SimulationReceiver*>::iterator it;
+    for (it=m_receiverList.begin();
+         it!=m_receiverList.end();
+         it++)
+    {
+        if (!visual && (*it)->type() == ST_VISUAL)
+            continue;
+
+        if (size > 0 && (*it)->send_serialised(msgbuf, size))
+            continue;
+
+        if (!msg) {
+            msg = lo_message_new();
+            for (int i=0; i<n; i++)
+                lo_message_add_float(msg, args[i]);
+        }
+        (*it)->send_lo_message(value.c_path(), msg);
+    }
+
+    if (msg)
+        lo_message_free(msg);
+}
+
 void Simulation::sendtotype(int type, bool throttle, const char *path, const char *types, ...)
 {
     va_list ap;
@@ -1027,6 +1352,18 @@ void Simulation::sendtotype(int type, bool throttle, const char *path, const cha
     lo_message_free(msg);
 }
 
+void Simulation::forward(int type, OscValue &value)
+{
+    std::vector<SimulationReceiver*>::iterator it;
+    for (it=m_receiverList.begin();
+         it!=m_receiverList.end();
+         it++)
+    {
+        if ((*it)->type() & type)
+            (*it)->send_lo_message(value.request_path(), value.request());
+    }
+}
+
 const char* Simulation::type_str()
 {
     return type_str(m_type);
@@ -1061,21 +1398,170 @@ Simulation::SimulationType Simulation::str_type(const char *type)
     return ST_UNKNOWN;
 }
 
+//! True for objects that are kept when the world is cleared, and for
+//! the world itself as the second object of a constraint.
+static bool kept_on_clear(OscObject *obj)
+{
+    return !obj || obj->name() == "cursor" || obj->name() == "device";
+}
+
 void Simulation::on_clear()
 {
     on_drop();
 
-    object_iterator it = world_objects.begin();
-    while (it != world_objects.end())
+    // Constraints between kept objects are kept too.
+    std::vector<OscConstraint*> constraints;
+    constraint_iterator cit;
+    for (cit = world_constraints.begin(); cit != world_constraints.end(); cit++)
+        if (!kept_on_clear(cit->second->object1())
+            || !kept_on_clear(cit->second->object2()))
+            constraints.push_back(cit->second);
+
+    std::vector<OscObject*> objects;
+    std::unordered_set<OscObject*> cleared;
+    object_iterator it;
+    for (it = world_objects.begin(); it != world_objects.end(); it++)
+        if (!kept_on_clear(it->second)) {
+            objects.push_back(it->second);
+            cleared.insert(it->second);
+        }
+
+    // The maps and groups are emptied in one pass, rather than one
+    // object at a time as in delete_object().
+    std::vector<OscValueGroup*>::iterator git;
+    for (git = m_valueGroups.begin(); git != m_valueGroups.end(); git++)
+        (*git)->remove(cleared);
+
+    std::vector<OscConstraint*>::iterator c;
+    for (c = constraints.begin(); c != constraints.end(); c++) {
+        world_constraints.erase((*c)->name());
+        retire(**c);
+    }
+
+    std::vector<OscObject*>::iterator o;
+    for (o = objects.begin(); o != objects.end(); o++) {
+        world_objects.erase((*o)->name());
+        retire(**o);
+    }
+
+    printf("[%s] Cleared %d objects and %d constraints.\n", type_str(),
+           (int)objects.size(), (int)constraints.size());
+}
+
+void Simulation::reclaim(double seconds)
+{
+    cPrecisionClock clock;
+    clock.start();
+
+    // A deletion is only started if one as slow as the slowest recent
+    // one would still end within the budget, otherwise it waits for a
+    // later step.  The estimate decays while nothing fits, so that one
+    // unusually slow deletion does not hold back the others for good.
+    bool deleted = false, waiting = false;
+    while (!m_retiredConstraints.empty() || !m_retiredObjects.empty())
     {
-        if (it->second->name() == "cursor"
-            || it->second->name() == "device")
-            it++;
+        double start = clock.getCurrentTimeSeconds();
+        if (start + m_fReclaimCost > seconds) {
+            waiting = true;
+            break;
+        }
+
+        // Constraints go first, since they refer to their objects.
+        if (!m_retiredConstraints.empty()) {
+            delete m_retiredConstraints.back();
+            m_retiredConstraints.pop_back();
+        }
         else {
-            it->second->on_destroy();
-            it = world_objects.begin();
+            delete m_retiredObjects.back();
+            m_retiredObjects.pop_back();
+        }
+        deleted = true;
+
+        double cost = clock.getCurrentTimeSeconds() - start;
+        m_fReclaimCost = std::max(cost, m_fReclaimCost * RECLAIM_COST_DECAY);
+    }
+
+    if (waiting && !deleted)
+        m_fReclaimCost *= RECLAIM_COST_DECAY;
+}
+
+int Simulation::pattern_handler(const char *path, const char *types,
+                                lo_arg **argv, int argc, void *data,
+                                void *user_data)
+{
+    Simulation *me = static_cast<Simulation*>(user_data);
+    me->m_patternRequest = NULL;
+
+    // Look for /world/<pattern>/<field>/get, where only the object
+    // name is a pattern, with an optional interval.
+    const std::string &world = me->path();
+    if (strncmp(path, world.c_str(), world.size())!=0
+        || path[world.size()] != '/')
+        return 1;
+
+    const char *name = path + world.size() + 1;
+    const char *field = strchr(name, '/');
+    const char *wild = strpbrk(name, "*?[{");
+    if (!field || !wild || wild > field || strpbrk(field, "*?[{"))
+        return 1;
+
+    field++;
+    size_t len = strlen(field);
+    if (len <= 4 || strcmp(field + len - 4, "/get")!=0)
+        return 1;
+
+    int interval = -1;
+    if (argc == 1 && types[0] == 'i')
+        interval = argv[0]->i;
+    else if (argc == 1 && types[0] == 'f')
+        interval = (int)argv[0]->f;
+    else if (argc != 0)
+        return 1;
+
+    me->m_patternRequest = data;
+    me->on_get_pattern(path, std::string(name, field - name - 1).c_str(),
+                       std::string(field, len - 4).c_str(), interval);
+    return 0;
+}
+
+void Simulation::on_get_pattern(const char *path, const char *pattern,
+                                const char *field, int interval)
+{
+    OscValueGroup *group = NULL;
+    std::vector<OscValueGroup*>::iterator it;
+    for (it = m_valueGroups.begin(); it != m_valueGroups.end(); it++) {
+        if ((*it)->pattern() == pattern && (*it)->field() == field) {
+            group = *it;
+            break;
+        }
+    }
+
+    if (interval == 0) {
+        if (group) {
+            m_valueGroups.erase(it);
+            delete group;
         }
+        return;
     }
+
+    if (!group) {
+        group = new OscValueGroup(pattern, field, this);
+        object_iterator o;
+        for (o = world_objects.begin(); o != world_objects.end(); o++)
+            group->add(o->second);
+
+        if (interval < 0) {
+            group->send();
+            delete group;
+            return;
+        }
+        m_valueGroups.push_back(group);
+    }
+
+    if (interval < 0)
+        group->send();
+    else
+        m_valueTimer.addValue(group, interval);
 }
 
 void Simulation::on_add_receiver(const char *type)
@@ -41,7 +41,9 @@ class SimulationReceiver
 {
 public:
     SimulationReceiver(const char *url, int type);
-    SimulationReceiver(Simulation &sim);
+    //! If wait is true, messages wait for room in a full queue
+    //! instead of being dropped.
+    SimulationReceiver(Simulation &sim, bool wait=false);
 
     lo_address addr() { return m_addr; }
     float timestep() { return m_fTimestep; }
@@ -51,11 +53,16 @@ public:
 
     void send_lo_message(const char *path, lo_message msg);
 
+    //! Send a message serialised as for LoQueue::write_serialised(),
+    //! returning false if this receiver needs an lo_message instead.
+    bool send_serialised(unsigned char *msgbuf, size_t size);
+
 protected:
     lo_address m_addr;
     float m_fTimestep;
     int m_type;
     bool m_bUseQueue;
+    bool m_bWait;
 };
 
 //! A Simulation is an OSC-controlled simulation thread which contains
@@ -88,7 +95,7 @@ class Simulation : public OscBase
     const char* type_str(int type);
     SimulationType str_type(const char *type);
 
-    bool add_object(OscObject& obj);
+    virtual bool add_object(OscObject& obj);
     bool delete_object(OscObject& obj);
     OscObject* find_object(const char* name);
 
@@ -120,12 +127,27 @@ class Simulation : public OscBase
     //! Send a message to all simulations in the list.
     void send(bool throttle, const char *path, const char *types, ...);
 
+    //! Send n floats to a value's path in the other simulations,
+    //! without allocating for receivers reached through a queue.
+    //! The visual simulation is skipped unless visual is true.
+    void send(OscValue &value, const float *args, int n,
+              bool visual=true);
+
     //! Send a message to all simulations of one or more specific types.
     void sendtotype(int type, bool throttle, const char *path, const char *types, ...);
 
+    //! Pass the request being handled by a value on to all
+    //! simulations of one or more specific types.
+    void forward(int type, OscValue &value);
+
     const lo_address addr() { return m_addr; }
     ValueTimer& valuetimer() { return m_valueTimer; }
 
+    //! True if a message is a /get request for a pattern of objects,
+    //! which values should ignore when it reaches them.
+    bool pattern_request(void *msg)
+      { return msg && msg == m_patternRequest; }
+
     OSCSCALAR(Simulation, collide) {};
     OSCVECTOR3(Simulation, gravity) {};
     OSCMETHOD0(Simulation, clear);
@@ -144,6 +166,15 @@ class Simulation : public OscBase
     OSCMETHOD0(Simulation, workspace_freeze) {};
     OSCMETHOD0(Simulation, workspace_standard) {};
 
+    //! Record rendered frames to a file, pattern or command (visual only).
+    OSCMETHOD1S(Simulation, capture_start) {};
+    OSCMETHOD0(Simulation, capture_stop) {};
+
+    //! Write the state of all objects at every step to a file, pipe
+    //! or command (physics only).
+    OSCMETHOD1S(Simulation, stream_start) {};
+    OSCMETHOD0(Simulation, stream_stop) {};
+
     void run_unthreaded()
       { run(this); }
 
@@ -208,6 +239,41 @@ class Simulation : public OscBase
     //! Object to track values that need to be sent at regular intervals.
     ValueTimer m_valueTimer;
 
+    //! Values sent for /get requests on a pattern of objects.
+    std::vector<OscValueGroup*> m_valueGroups;
+
+    //! The message being dispatched if it is such a request.
+    void *m_patternRequest;
+
+    //! Handle for the next object added.
+    int m_nNextHandle;
+
+    //! Objects and constraints destroyed or cleared, waiting to be
+    //! deleted a few at a time after later steps.
+    std::vector<OscObject*> m_retiredObjects;
+    std::vector<OscConstraint*> m_retiredConstraints;
+
+    //! Detach an object or constraint from the simulation and queue
+    //! it for deletion.
+    void retire(OscObject& obj);
+    void retire(OscConstraint& obj);
+
+    //! Delete retired objects for up to the given time (thread context).
+    virtual void reclaim(double seconds);
+
+    //! Estimated time to delete one retired object.
+    double m_fReclaimCost;
+
+    //! Catch /world/<pattern>/<field>/get before the values whose
+    //! paths match, so that it is answered once for all objects.
+    static int pattern_handler(const char *path, const char *types, lo_arg **argv,
+                               int argc, void *data, void *user_data);
+
+    //! Start, stop or answer once a /get request for a field of all
+    //! objects matching a pattern, like OscValue::get_handler.
+    virtual void on_get_pattern(const char *path, const char *pattern,
+                                const char *field, int interval);
+
     //! Map for collecting sent messages, for the purpose of throttling.
     std::map<std::string, int> sent_messages;
     typedef std::map<std::string, int>::iterator sent_messages_iterator;
@@ -239,8 +305,18 @@ protected:
     static int create_handler(const char *path, const char *types, lo_arg **argv,
                               int argc, void *data, void *user_data);
 
+    static int create_many_handler(const char *path, const char *types,
+                                   lo_arg **argv, int argc, void *data,
+                                   void *user_data);
+
     // override these functions with a specific factory subclass
     virtual bool create(const char *name, float x, float y, float z) = 0;
+
+    //! Create count prisms named prefix followed by their index,
+    //! counting from first, from records of position and size, as
+    //! given in blob.
+    virtual void create_many(const char *prefix, const lo_pcast32 *records,
+                             int count, int first, lo_blob blob);
 };
 
 class SphereFactory : public ShapeFactory
@@ -254,8 +330,18 @@ protected:
     static int create_handler(const char *path, const char *types, lo_arg **argv,
                               int argc, void *data, void *user_data);
 
+    static int create_many_handler(const char *path, const char *types,
+                                   lo_arg **argv, int argc, void *data,
+                                   void *user_data);
+
     // override these functions with a specific factory subclass
     virtual bool create(const char *name, float x, float y, float z) = 0;
+
+    //! Create count spheres named prefix followed by their index,
+    //! counting from first, from records of position and radius, as
+    //! given in blob.
+    virtual void create_many(const char *prefix, const lo_pcast32 *records,
+                             int count, int first, lo_blob blob);
 };
 
 class MeshFactory : public ShapeFactory
@@ -349,9 +435,27 @@ protected:
     static int create_handler(const char *path, const char *types, lo_arg **argv,
                               int argc, void *data, void *user_data);
 
+    static int create_many_handler(const char *path, const char *types,
+                                   lo_arg **argv, int argc, void *data,
+                                   void *user_data);
+
     // override these functions with a specific factory subclass
     virtual bool create(const char *name, OscObject *object1, OscObject *object2,
                         double x, double y, double z) = 0;
+
+    //! Create count ball joints named prefix followed by their index,
+    //! counting from first, from records of two object indexes and an
+    //! anchor, as given in blob.  Objects are named objects followed
+    //! by their index, or are the world for an index of -1.
+    virtual void create_many(const char *prefix, const char *objects,
+                             const lo_pcast32 *records, int count,
+                             int first, lo_blob blob);
+
+    //! Find the objects of one record of create_many(), printing an
+    //! error and returning false if they cannot be joined.
+    bool find_objects(const char *name, const char *objects,
+                      int index1, int index2,
+                      OscObject *&object1, OscObject *&object2);
 };
 
 class SlideFactory : public ShapeFactory
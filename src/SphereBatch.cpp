@@ -0,0 +1,396 @@
+// -*- mode:c++; indent-tabs-mode:nil; c-basic-offset:4; -*-
+//======================================================================================
+/*
+    This file is part of DIMPLE, the Dynamic Interactive Musically PhysicaL Environment,
+
+    This code is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License("GPL") version 2
+    as published by the Free Software Foundation.  See the file LICENSE
+    for more information.
+
+    sinclair@music.mcgill.ca
+    http://www.music.mcgill.ca/~sinclair/content/dimple
+*/
+//======================================================================================
+
+#include "SphereBatch.h"
+
+#include <math.h>
+#include <stdio.h>
+
+// Same tessellation as cShapeSphere
+#define SPHERE_BATCH_SLICES 36
+#define SPHERE_BATCH_STACKS 36
+
+// Lights considered by the instancing shader
+#define SPHERE_BATCH_LIGHTS 8
+
+// Floats per instance: three rows of the transform, then the
+// diffuse colour, the ambient colour and radius, and the specular
+// colour and shininess.
+#define SPHERE_BATCH_STRIDE 24
+
+// Vertex shader for instanced spheres.  It scales and places the
+// unit sphere, and lights each vertex with the enabled lights as
+// fixed-function lighting would, since the per-sphere path uses it.
+static const char *sphere_vertex_shader =
+    "#version 120\n"
+    "attribute vec3 a_position;\n"
+    "attribute vec4 a_row0, a_row1, a_row2;\n"
+    "attribute vec4 a_diffuse, a_ambient, a_specular;\n"
+    "uniform int u_lights[8];\n"
+    "varying vec4 v_color;\n"
+    "void main()\n"
+    "{\n"
+    "    vec3 p = a_position * a_ambient.w;\n"
+    "    vec4 world = vec4(dot(a_row0.xyz, p) + a_row0.w,\n"
+    "                      dot(a_row1.xyz, p) + a_row1.w,\n"
+    "                      dot(a_row2.xyz, p) + a_row2.w, 1.0);\n"
+    "    vec3 n = vec3(dot(a_row0.xyz, a_position),\n"
+    "                  dot(a_row1.xyz, a_position),\n"
+    "                  dot(a_row2.xyz, a_position));\n"
+    "    vec4 eye = gl_ModelViewMatrix * world;\n"
+    "    vec3 N = normalize(gl_NormalMatrix * n);\n"
+    "    vec3 V = normalize(-eye.xyz);\n"
+    "    vec3 c = a_ambient.rgb * gl_LightModel.ambient.rgb;\n"
+    "    for (int i = 0; i < 8; i++) {\n"
+    "        if (u_lights[i] == 0)\n"
+    "            continue;\n"
+    "        vec4 lp = gl_LightSource[i].position;\n"
+    "        vec3 L = lp.xyz - eye.xyz * lp.w;\n"
+    "        float d = length(L);\n"
+    "        L /= d;\n"
+    "        float att = 1.0;\n"
+    "        if (lp.w != 0.0) {\n"
+    "            att = 1.0 / (gl_LightSource[i].constantAttenuation\n"
+    "                         + gl_LightSource[i].linearAttenuation * d\n"
+    "                         + gl_LightSource[i].quadraticAttenuation * d * d);\n"
+    "            if (gl_LightSource[i].spotCutoff <= 90.0) {\n"
+    "                float s = dot(-L, normalize(gl_LightSource[i].spotDirection));\n"
+    "                if (s < gl_LightSource[i].spotCosCutoff)\n"
+    "                    att = 0.0;\n"
+    "                else\n"
+    "                    att *= pow(s, gl_LightSource[i].spotExponent);\n"
+    "            }\n"
+    "        }\n"
+    "        float diffuse = max(dot(N, L), 0.0);\n"
+    "        vec3 lc = a_ambient.rgb * gl_LightSource[i].ambient.rgb\n"
+    "                + a_diffuse.rgb * gl_LightSource[i].diffuse.rgb * diffuse;\n"
+    "        if (diffuse > 0.0)\n"
+    "            lc += a_specular.rgb * gl_LightSource[i].specular.rgb\n"
+    "                * pow(max(dot(N, normalize(L + V)), 0.0), a_specular.w);\n"
+    "        c += lc * att;\n"
+    "    }\n"
+    "    v_color = vec4(c, a_diffuse.a);\n"
+    "    gl_Position = gl_ProjectionMatrix * eye;\n"
+    "}\n";
+
+static const char *sphere_fragment_shader =
+    "#version 120\n"
+    "varying vec4 v_color;\n"
+    "void main()\n"
+    "{\n"
+    "    gl_FragColor = v_color;\n"
+    "}\n";
+
+// Attribute locations of the instancing shader
+enum {
+    SPHERE_ATTR_POSITION = 0,
+    SPHERE_ATTR_ROW0,
+    SPHERE_ATTR_ROW1,
+    SPHERE_ATTR_ROW2,
+    SPHERE_ATTR_DIFFUSE,
+    SPHERE_ATTR_AMBIENT,
+    SPHERE_ATTR_SPECULAR,
+};
+
+cSphereBatch::cSphereBatch()
+    : m_vertexBuffer(0), m_indexBuffer(0), m_nIndices(0),
+      m_nInstancing(-1), m_program(0), m_instanceBuffer(0)
+{
+}
+
+cSphereBatch::~cSphereBatch()
+{
+    if (m_vertexBuffer)
+        glDeleteBuffers(1, &m_vertexBuffer);
+    if (m_indexBuffer)
+        glDeleteBuffers(1, &m_indexBuffer);
+#ifdef GLEW_VERSION
+    if (m_instanceBuffer)
+        glDeleteBuffers(1, &m_instanceBuffer);
+    if (m_program)
+        glDeleteProgram(m_program);
+#endif
+}
+
+void cSphereBatch::add(cShapeSphere *sphere)
+{
+    if (sphere->getParent())
+        sphere->getParent()->removeChild(sphere);
+    addChild(sphere);
+}
+
+bool cSphereBatch::batched(cGenericObject *obj)
+{
+    cShapeSphere *sphere = dynamic_cast<cShapeSphere*>(obj);
+    return sphere && !sphere->m_texture && sphere->getNumChildren() == 0;
+}
+
+void cSphereBatch::renderSceneGraph(cRenderOptions& a_options)
+{
+    // Hide the batched spheres from the scene graph traversal while
+    // the batch renders, render() draws them instead.
+    m_batch.clear();
+    m_others.clear();
+    for (unsigned int i = 0; i < m_children.size(); i++) {
+        if (batched(m_children[i]))
+            m_batch.push_back(static_cast<cShapeSphere*>(m_children[i]));
+        else
+            m_others.push_back(m_children[i]);
+    }
+
+    m_children.swap(m_others);
+    cGenericObject::renderSceneGraph(a_options);
+    m_children.swap(m_others);
+}
+
+void cSphereBatch::render(cRenderOptions& a_options)
+{
+#ifdef C_USE_OPENGL
+    if (m_batch.empty() || !SECTION_RENDER_PARTS_WITH_MATERIALS(a_options, false))
+        return;
+
+    if (!m_vertexBuffer)
+        createBuffers();
+    if (m_nInstancing < 0)
+        m_nInstancing = createInstancing() ? 1 : 0;
+
+    if (m_nInstancing)
+        renderInstanced(a_options);
+    else
+        renderEach(a_options);
+#endif
+}
+
+void cSphereBatch::renderInstanced(cRenderOptions& a_options)
+{
+#ifdef GLEW_VERSION
+    // One record per shown sphere, see SPHERE_BATCH_STRIDE
+    m_instances.clear();
+    std::vector<cShapeSphere*>::iterator it;
+    for (it = m_batch.begin(); it != m_batch.end(); it++)
+    {
+        cShapeSphere *sphere = *it;
+        if (!sphere->getShowEnabled())
+            continue;
+
+        const double *m = sphere->getLocalTransform().getData();
+        for (int row = 0; row < 3; row++)
+            for (int col = 0; col < 4; col++)
+                m_instances.push_back((GLfloat)m[col*4 + row]);
+
+        cMaterialPtr mat = sphere->m_material;
+        m_instances.push_back(mat->m_diffuse.getR());
+        m_instances.push_back(mat->m_diffuse.getG());
+        m_instances.push_back(mat->m_diffuse.getB());
+        m_instances.push_back(mat->m_diffuse.getA());
+        m_instances.push_back(mat->m_ambient.getR());
+        m_instances.push_back(mat->m_ambient.getG());
+        m_instances.push_back(mat->m_ambient.getB());
+        m_instances.push_back((GLfloat)sphere->getRadius());
+        m_instances.push_back(mat->m_specular.getR());
+        m_instances.push_back(mat->m_specular.getG());
+        m_instances.push_back(mat->m_specular.getB());
+        m_instances.push_back((GLfloat)mat->getShininess());
+    }
+
+    GLsizei count = m_instances.size() / SPHERE_BATCH_STRIDE;
+    if (count == 0)
+        return;
+
+    glBindBuffer(GL_ARRAY_BUFFER, m_instanceBuffer);
+    glBufferData(GL_ARRAY_BUFFER, m_instances.size() * sizeof(GLfloat),
+                 &m_instances[0], GL_STREAM_DRAW);
+
+    GLint previous = 0;
+    glGetIntegerv(GL_CURRENT_PROGRAM, &previous);
+    glUseProgram(m_program);
+
+    // The shader lights the spheres with the lights enabled now.
+    GLint lights[SPHERE_BATCH_LIGHTS];
+    for (int i = 0; i < SPHERE_BATCH_LIGHTS; i++)
+        lights[i] = glIsEnabled(GL_LIGHT0 + i) ? 1 : 0;
+    glUniform1iv(glGetUniformLocation(m_program, "u_lights"),
+                 SPHERE_BATCH_LIGHTS, lights);
+
+    GLsizei stride = SPHERE_BATCH_STRIDE * sizeof(GLfloat);
+    for (int a = SPHERE_ATTR_ROW0; a <= SPHERE_ATTR_SPECULAR; a++) {
+        glEnableVertexAttribArray(a);
+        glVertexAttribPointer(a, 4, GL_FLOAT, GL_FALSE, stride,
+                              (void*)((a - SPHERE_ATTR_ROW0) * 4
+                                      * sizeof(GLfloat)));
+        glVertexAttribDivisor(a, 1);
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+    glEnableVertexAttribArray(SPHERE_ATTR_POSITION);
+    glVertexAttribPointer(SPHERE_ATTR_POSITION, 3, GL_FLOAT, GL_FALSE,
+                          6*sizeof(GLfloat), (void*)0);
+
+    glDrawElementsInstanced(GL_TRIANGLES, m_nIndices, GL_UNSIGNED_INT,
+                            (void*)0, count);
+
+    for (int a = SPHERE_ATTR_POSITION; a <= SPHERE_ATTR_SPECULAR; a++) {
+        glVertexAttribDivisor(a, 0);
+        glDisableVertexAttribArray(a);
+    }
+    glUseProgram(previous);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+#endif
+}
+
+void cSphereBatch::renderEach(cRenderOptions& a_options)
+{
+#ifdef C_USE_OPENGL
+    // Interleaved positions and normals of the unit sphere
+    glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glVertexPointer(3, GL_FLOAT, 6*sizeof(GLfloat), (void*)0);
+    glNormalPointer(GL_FLOAT, 6*sizeof(GLfloat), (void*)(3*sizeof(GLfloat)));
+    glEnable(GL_RESCALE_NORMAL);
+
+    std::vector<cShapeSphere*>::iterator it;
+    for (it = m_batch.begin(); it != m_batch.end(); it++)
+    {
+        cShapeSphere *sphere = *it;
+        if (!sphere->getShowEnabled())
+            continue;
+
+        if (sphere->getUseMaterial())
+            sphere->m_material->render(a_options);
+
+        double r = sphere->getRadius();
+        glPushMatrix();
+        glMultMatrixd(sphere->getLocalTransform().getData());
+        glScaled(r, r, r);
+        glDrawElements(GL_TRIANGLES, m_nIndices, GL_UNSIGNED_INT, (void*)0);
+        glPopMatrix();
+    }
+
+    glDisable(GL_RESCALE_NORMAL);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+#endif
+}
+
+void cSphereBatch::createBuffers()
+{
+    std::vector<GLfloat> vertices;
+    std::vector<GLuint> indices;
+
+    for (int i = 0; i <= SPHERE_BATCH_STACKS; i++) {
+        double theta = M_PI * i / SPHERE_BATCH_STACKS;
+        for (int j = 0; j <= SPHERE_BATCH_SLICES; j++) {
+            double phi = 2 * M_PI * j / SPHERE_BATCH_SLICES;
+            GLfloat x = sin(theta) * cos(phi);
+            GLfloat y = sin(theta) * sin(phi);
+            GLfloat z = cos(theta);
+
+            // On a unit sphere the normal is the position.
+            vertices.push_back(x); vertices.push_back(y); vertices.push_back(z);
+            vertices.push_back(x); vertices.push_back(y); vertices.push_back(z);
+        }
+    }
+
+    int row = SPHERE_BATCH_SLICES + 1;
+    for (int i = 0; i < SPHERE_BATCH_STACKS; i++) {
+        for (int j = 0; j < SPHERE_BATCH_SLICES; j++) {
+            GLuint a = i * row + j, b = a + row;
+            indices.push_back(a); indices.push_back(b); indices.push_back(a + 1);
+            indices.push_back(a + 1); indices.push_back(b); indices.push_back(b + 1);
+        }
+    }
+    m_nIndices = indices.size();
+
+    glGenBuffers(1, &m_vertexBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GLfloat),
+                 &vertices[0], GL_STATIC_DRAW);
+
+    glGenBuffers(1, &m_indexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint),
+                 &indices[0], GL_STATIC_DRAW);
+}
+
+#ifdef GLEW_VERSION
+static GLuint compile_shader(GLenum type, const char *source)
+{
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+
+    GLint ok = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        printf("[visual] Sphere shader did not compile: %s\n", log);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+#endif
+
+bool cSphereBatch::createInstancing()
+{
+#ifdef GLEW_VERSION
+    if (!GLEW_VERSION_3_3)
+        return false;
+
+    GLuint vs = compile_shader(GL_VERTEX_SHADER, sphere_vertex_shader);
+    GLuint fs = compile_shader(GL_FRAGMENT_SHADER, sphere_fragment_shader);
+    if (!vs || !fs) {
+        if (vs) glDeleteShader(vs);
+        if (fs) glDeleteShader(fs);
+        return false;
+    }
+
+    m_program = glCreateProgram();
+    glAttachShader(m_program, vs);
+    glAttachShader(m_program, fs);
+    glBindAttribLocation(m_program, SPHERE_ATTR_POSITION, "a_position");
+    glBindAttribLocation(m_program, SPHERE_ATTR_ROW0, "a_row0");
+    glBindAttribLocation(m_program, SPHERE_ATTR_ROW1, "a_row1");
+    glBindAttribLocation(m_program, SPHERE_ATTR_ROW2, "a_row2");
+    glBindAttribLocation(m_program, SPHERE_ATTR_DIFFUSE, "a_diffuse");
+    glBindAttribLocation(m_program, SPHERE_ATTR_AMBIENT, "a_ambient");
+    glBindAttribLocation(m_program, SPHERE_ATTR_SPECULAR, "a_specular");
+    glLinkProgram(m_program);
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+
+    GLint ok = GL_FALSE;
+    glGetProgramiv(m_program, GL_LINK_STATUS, &ok);
+    if (!ok) {
+        printf("[visual] Sphere shader did not link, "
+               "drawing spheres one at a time.\n");
+        glDeleteProgram(m_program);
+        m_program = 0;
+        return false;
+    }
+
+    glGenBuffers(1, &m_instanceBuffer);
+    return true;
+#else
+    return false;
+#endif
+}
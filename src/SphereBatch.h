@@ -0,0 +1,79 @@
+// -*- mode:c++; indent-tabs-mode:nil; c-basic-offset:4; -*-
+//======================================================================================
+/*
+    This file is part of DIMPLE, the Dynamic Interactive Musically PhysicaL Environment,
+
+    This code is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License("GPL") version 2
+    as published by the Free Software Foundation.  See the file LICENSE
+    for more information.
+
+    sinclair@music.mcgill.ca
+    http://www.music.mcgill.ca/~sinclair/content/dimple
+*/
+//======================================================================================
+
+#ifndef _SPHERE_BATCH_H_
+#define _SPHERE_BATCH_H_
+
+#include <vector>
+
+#include <world/CGenericObject.h>
+#include <world/CShapeSphere.h>
+#include <graphics/COpenGLHeaders.h>
+
+using namespace chai3d;
+
+//! A cSphereBatch is the parent of the spheres in the visual
+//! simulation and draws all of them from a single shared vertex
+//! buffer, with one transform and material per instance, instead of
+//! letting each cShapeSphere tessellate itself.  Where OpenGL 3.3 is
+//! available the whole batch is a single instanced draw, lit by a
+//! shader that follows the fixed-function lighting; otherwise each
+//! sphere is drawn in turn.  Spheres that have children or a texture
+//! are still rendered by the scene graph.  Collision detection and
+//! picking see the spheres as ordinary children.
+class cSphereBatch : public cGenericObject
+{
+  public:
+    cSphereBatch();
+    virtual ~cSphereBatch();
+
+    //! Move a sphere from its current parent into the batch.
+    void add(cShapeSphere *sphere);
+
+    virtual void renderSceneGraph(cRenderOptions& a_options);
+
+  protected:
+    virtual void render(cRenderOptions& a_options);
+
+    //! True if a child can be drawn from the shared buffers.
+    static bool batched(cGenericObject *obj);
+
+    //! Tessellate the unit sphere into the shared buffers.
+    void createBuffers();
+
+    //! Compile the instancing shader, returning false if instanced
+    //! drawing is not available.
+    bool createInstancing();
+
+    //! Draw the batch with one instanced call.
+    void renderInstanced(cRenderOptions& a_options);
+
+    //! Draw the batch one sphere at a time.
+    void renderEach(cRenderOptions& a_options);
+
+    std::vector<cShapeSphere*> m_batch;      //! drawn by render()
+    std::vector<cGenericObject*> m_others;   //! traversed as usual
+
+    GLuint m_vertexBuffer;
+    GLuint m_indexBuffer;
+    int m_nIndices;
+
+    int m_nInstancing;                  //! 1 if available, 0 if not, -1 unknown
+    GLuint m_program;                   //! instancing shader
+    GLuint m_instanceBuffer;            //! per-sphere attributes
+    std::vector<GLfloat> m_instances;   //! filled on each frame
+};
+
+#endif // _SPHERE_BATCH_H_
@@ -0,0 +1,218 @@
+// -*- mode:c++; indent-tabs-mode:nil; c-basic-offset:4; -*-
+//======================================================================================
+/*
+    This file is part of DIMPLE, the Dynamic Interactive Musically PhysicaL Environment,
+
+    This code is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License("GPL") version 2
+    as published by the Free Software Foundation.  See the file LICENSE
+    for more information.
+
+    sinclair@music.mcgill.ca
+    http://www.music.mcgill.ca/~sinclair/content/dimple
+*/
+//======================================================================================
+
+#include "StateStream.h"
+
+#include <string.h>
+#include <chrono>
+
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Bytes of frames waiting for the writer; must be a power of two.
+#define STATE_STREAM_BUFFER (1 << 22)
+
+// How long the writer sleeps when there is nothing to write
+#define STATE_STREAM_POLL_MS 1
+
+// How long the writer sleeps while a named pipe has no reader
+#define STATE_STREAM_OPEN_POLL_MS 50
+
+StateStream::Writer::Writer(StateStream *owner_, const char *target_)
+    : owner(owner_), target(target_), ring(STATE_STREAM_BUFFER),
+      bFinish(false), pFile(NULL), bPipe(target_[0] == '|'), nWritten(0)
+{
+}
+
+StateStream::StateStream(const char *name)
+    : m_name(name), m_bActive(false), m_pWriter(NULL), m_nDropped(0),
+      m_nWriters(0)
+{
+}
+
+StateStream::~StateStream()
+{
+    stop();
+    join();
+}
+
+bool StateStream::start(const char *target)
+{
+    // The previous stream's writer finishes writing on its own.
+    stop();
+
+    // The target is opened by the writer, so that neither waiting
+    // for a reader nor starting a command holds up the physics step.
+    m_pWriter = new Writer(this, target);
+    m_nDropped = 0;
+    m_nWriters++;
+    std::thread(StateStream::write, m_pWriter).detach();
+    m_bActive = true;
+
+    printf("[%s] Streaming state to %s.\n", m_name.c_str(), target);
+    return true;
+}
+
+void StateStream::stop()
+{
+    if (!m_bActive)
+        return;
+
+    // The writer deletes itself once it has seen this.
+    m_bActive = false;
+    printf("[%s] Stopped streaming state to %s, %u frames dropped.\n",
+           m_name.c_str(), m_pWriter->target.c_str(), m_nDropped);
+    m_pWriter->bFinish = true;
+    m_pWriter = NULL;
+}
+
+void StateStream::join()
+{
+    while (m_nWriters > 0)
+        std::this_thread::sleep_for(
+            std::chrono::milliseconds(STATE_STREAM_POLL_MS));
+}
+
+StateFrameHeader *StateStream::frame(unsigned int count, unsigned int step,
+                                     double time)
+{
+    uint32_t size = sizeof(StateFrameHeader);
+    uint32_t handles = size;     size += count * sizeof(int32_t);
+    uint32_t positions = size;   size += count * 3 * sizeof(float);
+    uint32_t rotations = size;   size += count * 4 * sizeof(float);
+    uint32_t velocities = size;  size += count * 3 * sizeof(float);
+    uint32_t contacts = size;    size += count;
+    size = (size + 3) & ~3;
+
+    // Only grows, so that steps do not allocate once the scene is
+    // built.
+    if (m_frame.size() < size)
+        m_frame.resize(size);
+
+    StateFrameHeader *h = (StateFrameHeader*)&m_frame[0];
+    memcpy(h->magic, "DMPS", 4);
+    h->size = size;
+    h->count = count;
+    h->step = step;
+    h->time = time;
+    h->handles = handles;
+    h->positions = positions;
+    h->rotations = rotations;
+    h->velocities = velocities;
+    h->contacts = contacts;
+    h->reserved = 0;
+    return h;
+}
+
+void StateStream::push()
+{
+    StateFrameHeader *h = (StateFrameHeader*)&m_frame[0];
+    if (!m_pWriter->ring.writeBuffer((const unsigned char*)h, h->size))
+        m_nDropped++;
+}
+
+void* StateStream::write(void* param)
+{
+    Writer *me = static_cast<Writer*>(param);
+    const char *name = me->owner->m_name.c_str();
+    std::vector<unsigned char> buffer;
+
+    // If the target cannot be opened, frames are still emptied from
+    // the buffer until the stream is stopped.
+    me->pFile = openTarget(me);
+    bool ok = (me->pFile != NULL);
+    if (!ok && !me->bFinish)
+        printf("[%s] Unable to open %s for streaming state.\n",
+               name, me->target.c_str());
+
+    while (true)
+    {
+        // Frames are queued whole, so once the header can be read,
+        // so can the rest.  Finishing is checked before reading, so
+        // that no frame queued before stopping is missed.
+        bool finish = me->bFinish;
+        StateFrameHeader h;
+        if (!me->ring.readBuffer((unsigned char*)&h, sizeof(h))) {
+            if (finish)
+                break;
+            std::this_thread::sleep_for(
+                std::chrono::milliseconds(STATE_STREAM_POLL_MS));
+            continue;
+        }
+
+        buffer.resize(h.size);
+        memcpy(&buffer[0], &h, sizeof(h));
+        me->ring.readBuffer(&buffer[sizeof(h)], h.size - sizeof(h));
+
+        // After an error, keep emptying the buffer until stopped.
+        if (ok) {
+            ok = fwrite(&buffer[0], h.size, 1, me->pFile) == 1
+                && fflush(me->pFile) == 0;
+            if (ok)
+                me->nWritten++;
+            else
+                printf("[%s] Error writing state frame %u to %s.\n",
+                       name, me->nWritten, me->target.c_str());
+        }
+    }
+
+    if (me->pFile && me->bPipe)
+        pclose(me->pFile);
+    else if (me->pFile)
+        fclose(me->pFile);
+
+    printf("[%s] Wrote %u state frames to %s.\n", name,
+           me->nWritten, me->target.c_str());
+
+    // The owner waits for this in its destructor, so it is still
+    // there.
+    StateStream *owner = me->owner;
+    delete me;
+    owner->m_nWriters--;
+
+    return 0;
+}
+
+FILE *StateStream::openTarget(Writer *me)
+{
+    const char *target = me->target.c_str();
+    if (me->bPipe)
+        return popen(target + 1, "w");
+
+#ifdef WIN32
+    return fopen(target, "wb");
+#else
+    // Opening a named pipe without blocking fails until it has a
+    // reader, so keep trying until then or until stopped.
+    int fd;
+    while ((fd = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK,
+                      0666)) < 0
+           && errno == ENXIO && !me->bFinish)
+        std::this_thread::sleep_for(
+            std::chrono::milliseconds(STATE_STREAM_OPEN_POLL_MS));
+    if (fd < 0)
+        return NULL;
+
+    // Writes should block for the reader again.
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    FILE *f = fdopen(fd, "wb");
+    if (!f)
+        close(fd);
+    return f;
+#endif
+}
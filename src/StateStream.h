@@ -0,0 +1,126 @@
+// -*- mode:c++; indent-tabs-mode:nil; c-basic-offset:4; -*-
+//======================================================================================
+/*
+    This file is part of DIMPLE, the Dynamic Interactive Musically PhysicaL Environment,
+
+    This code is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License("GPL") version 2
+    as published by the Free Software Foundation.  See the file LICENSE
+    for more information.
+
+    sinclair@music.mcgill.ca
+    http://www.music.mcgill.ca/~sinclair/content/dimple
+*/
+//======================================================================================
+
+#ifndef _STATE_STREAM_H_
+#define _STATE_STREAM_H_
+
+#include "config.h"
+
+#ifdef HAVE_MINGW_STD_THREADS
+#include <mingw.thread.h>
+#else
+#include <thread>
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "CircBuffer.h"
+
+//! Header at the start of each frame of the state stream.  All
+//! values are in the byte order of the machine running DIMPLE.  The
+//! arrays follow the header, each giving one entry per object in the
+//! same order, at the given byte offsets from the start of the frame.
+struct StateFrameHeader
+{
+    char     magic[4];    //! "DMPS"
+    uint32_t size;        //! bytes in the frame, including this header
+    uint32_t count;       //! number of objects
+    uint32_t step;        //! physics step number
+    double   time;        //! simulation time in seconds
+    uint32_t handles;     //! int32, as in /world/<name>/handle
+    uint32_t positions;   //! float x, y, z
+    uint32_t rotations;   //! float quaternion w, x, y, z
+    uint32_t velocities;  //! float x, y, z
+    uint32_t contacts;    //! uint8, 1 if touching anything this step
+    uint32_t reserved;
+};
+
+//! A StateStream writes the state of every object in the physics
+//! simulation at every step as binary frames, for consumers that
+//! need more than OSC can carry.  Frames are copied into a ring
+//! buffer by the physics thread and written out by a writer thread,
+//! so a step never waits for the consumer; if it falls behind,
+//! frames are dropped.  A stopped stream's writer finishes on its
+//! own, so starting a new stream does not wait for it either.
+//!
+//! The target is a file or named pipe, or "|" followed by a command
+//! that is given the stream on its standard input.
+class StateStream
+{
+  public:
+    StateStream(const char *name);
+    virtual ~StateStream();
+
+    //! Begin streaming to a target, ending any previous stream.
+    bool start(const char *target);
+
+    //! Stop streaming; frames already queued are still written.
+    void stop();
+
+    //! True while frames are being streamed.
+    bool active() { return m_bActive; }
+
+    //! Return a frame with room for count objects, to be filled in
+    //! and then queued with push().  Only the physics thread may
+    //! call this.
+    StateFrameHeader *frame(unsigned int count, unsigned int step,
+                            double time);
+
+    //! Queue the frame returned by frame().
+    void push();
+
+  protected:
+    //! One stream, shared by the physics thread and its writer
+    //! thread until it is stopped, and then deleted by the writer
+    //! once its last frames are written.
+    struct Writer {
+        Writer(StateStream *owner, const char *target);
+
+        StateStream *owner;
+        std::string target;
+        CircBufferNoLock ring;
+        std::atomic<bool> bFinish;
+        FILE *pFile;
+        bool bPipe;
+        unsigned int nWritten;
+    };
+
+    //! Wait for the writer threads of all streams to exit.
+    void join();
+
+    //! Function for the writer thread.
+    static void* write(void* param);
+
+    //! Open a writer's target, on its own thread, since opening a
+    //! named pipe waits for a reader.  Returns NULL if it could not
+    //! be opened or the stream was stopped first.
+    static FILE *openTarget(Writer *me);
+
+    std::string m_name;          //! prefix for messages
+
+    // Physics thread
+    std::atomic<bool> m_bActive;
+    Writer *m_pWriter;           //! the current stream, if any
+    std::vector<char> m_frame;   //! frame being filled
+    unsigned int m_nDropped;
+
+    std::atomic<int> m_nWriters; //! writer threads still running
+};
+
+#endif // _STATE_STREAM_H_
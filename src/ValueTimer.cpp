@@ -16,44 +16,282 @@
 #include "ValueTimer.h"
 #include "OscObject.h"
 
-typedef std::map<OscValue*, struct ValueTimerPair*>::iterator value_iter;
-typedef std::pair<OscValue*, struct ValueTimerPair*> value_pair;
+#include <algorithm>
+
+// Each level of the wheel has 2^VALUETIMER_BITS slots, each as long
+// as a whole turn of the level below.  Three levels cover delays of
+// about four and a half hours; longer ones are held in the last slot
+// and placed again when it comes around.
+#define VALUETIMER_BITS 8
+#define VALUETIMER_LEVELS 3
+#define VALUETIMER_SLOTS (1 << VALUETIMER_BITS)
+#define VALUETIMER_MASK (VALUETIMER_SLOTS - 1)
+
+// Largest bundle to send, in bytes, to stay well within a UDP packet.
+#define VALUETIMER_MAX_BUNDLE 8192
+
+ValueTimer::ValueTimer()
+    : m_slots(VALUETIMER_LEVELS * VALUETIMER_SLOTS, -1),
+      m_nFree(-1), m_nValues(0), m_now_ms(0)
+{
+}
 
 void ValueTimer::addValue(OscValue* oscval, int interval_ms)
 {
-    value_iter it;
-    it = m_values.find(oscval);
-    if (it==m_values.end()) {
-        struct ValueTimerPair *v = new struct ValueTimerPair;
-        v->current_ms = v->interval_ms = interval_ms;
-        m_values.insert(value_pair(oscval, v));
-    }
+    int n = oscval->m_nTimerNode;
+    if (n >= 0)
+        unlink(n);
     else {
-        it->second->current_ms = it->second->interval_ms = interval_ms;
+        if (m_nFree >= 0) {
+            n = m_nFree;
+            m_nFree = m_nodes[n].next;
+        }
+        else {
+            n = m_nodes.size();
+            m_nodes.push_back(Node());
+        }
+        m_nodes[n].value = oscval;
+        oscval->m_nTimerNode = n;
+        m_nValues++;
     }
+
+    m_nodes[n].interval_ms = interval_ms;
+    m_nodes[n].due_ms = m_now_ms + interval_ms;
+    place(n);
 }
 
 void ValueTimer::removeValue(OscValue* oscval)
 {
-    value_iter it;
-    it = m_values.find(oscval);
-    if (it!=m_values.end()) {
-        delete it->second;
-        m_values.erase(it);
+    int n = oscval->m_nTimerNode;
+    if (n < 0)
+        return;
+
+    unlink(n);
+    m_nodes[n].value = NULL;
+    m_nodes[n].next = m_nFree;
+    m_nFree = n;
+    oscval->m_nTimerNode = -1;
+    m_nValues--;
+}
+
+void ValueTimer::watchValue(OscValue* oscval, double threshold, int interval_ms)
+{
+    ValueWatch *w = oscval->m_pWatch;
+    if (!w) {
+        w = oscval->m_pWatch = new ValueWatch();
+        w->bQueued = w->bPending = false;
+    }
+    w->threshold = threshold;
+    w->interval_ms = std::max(interval_ms, 0);
+
+    // Start by sending the current value.
+    queue(oscval);
+}
+
+void ValueTimer::unwatchValue(OscValue* oscval)
+{
+    if (!oscval->m_pWatch)
+        return;
+
+    if (oscval->m_pWatch->bQueued)
+        m_due.erase(std::remove(m_due.begin(), m_due.end(), oscval),
+                    m_due.end());
+    if (oscval->m_pWatch->bPending)
+        m_pending.erase(std::remove(m_pending.begin(), m_pending.end(), oscval),
+                        m_pending.end());
+
+    delete oscval->m_pWatch;
+    oscval->m_pWatch = NULL;
+}
+
+void ValueTimer::changed(OscValue* oscval)
+{
+    // A queued value goes out with whatever it is at the end of the
+    // step, and a pending one is looked at again when it may be sent.
+    ValueWatch *w = oscval->m_pWatch;
+    if (w->bQueued || w->bPending || !moved(oscval))
+        return;
+
+    if (m_now_ms >= w->sent_ms + w->interval_ms)
+        queue(oscval);
+    else {
+        w->bPending = true;
+        m_pending.push_back(oscval);
     }
 }
-    
+
+bool ValueTimer::moved(OscValue* oscval)
+{
+    ValueWatch *w = oscval->m_pWatch;
+    double v[OSCVALUE_MAX_COMPONENTS];
+    int n = oscval->components(v);
+
+    // Values that are not numbers are sent on every change.
+    if (n == 0)
+        return true;
+
+    double d = 0;
+    for (int i=0; i<n; i++)
+        d += (v[i] - w->last[i]) * (v[i] - w->last[i]);
+    return d > w->threshold * w->threshold;
+}
+
+void ValueTimer::queue(OscValue* oscval)
+{
+    // Watched values are only sent once per step.
+    ValueWatch *w = oscval->m_pWatch;
+    if (w) {
+        if (w->bQueued)
+            return;
+        w->bQueued = true;
+    }
+    m_due.push_back(oscval);
+}
+
+void ValueTimer::place(int n)
+{
+    Node &node = m_nodes[n];
+    uint64_t due = std::max(node.due_ms, m_now_ms);
+    uint64_t delta = due - m_now_ms;
+
+    // Find the finest level on which the due time is less than a
+    // turn away.
+    int level = 0;
+    while (level < VALUETIMER_LEVELS-1
+           && delta >= ((uint64_t)1 << (VALUETIMER_BITS * (level+1))))
+        level++;
+
+    uint64_t turn = (uint64_t)1 << (VALUETIMER_BITS * (level+1));
+    if (delta >= turn)
+        due = m_now_ms + turn - 1;
+
+    int slot = level * VALUETIMER_SLOTS
+        + (int)((due >> (VALUETIMER_BITS * level)) & VALUETIMER_MASK);
+
+    node.slot = slot;
+    node.prev = -1;
+    node.next = m_slots[slot];
+    if (node.next >= 0)
+        m_nodes[node.next].prev = n;
+    m_slots[slot] = n;
+}
+
+void ValueTimer::unlink(int n)
+{
+    Node &node = m_nodes[n];
+    if (node.prev >= 0)
+        m_nodes[node.prev].next = node.next;
+    else
+        m_slots[node.slot] = node.next;
+    if (node.next >= 0)
+        m_nodes[node.next].prev = node.prev;
+}
+
+void ValueTimer::cascade(int slot)
+{
+    int n = m_slots[slot];
+    m_slots[slot] = -1;
+    while (n >= 0) {
+        int next = m_nodes[n].next;
+        place(n);
+        n = next;
+    }
+}
+
+void ValueTimer::tick()
+{
+    // When a level turns over, bring the next slot of the level
+    // above down to the finer levels.
+    for (int level = 1; level < VALUETIMER_LEVELS; level++) {
+        if (m_now_ms & (((uint64_t)1 << (VALUETIMER_BITS * level)) - 1))
+            break;
+        cascade(level * VALUETIMER_SLOTS
+                + (int)((m_now_ms >> (VALUETIMER_BITS * level)) & VALUETIMER_MASK));
+    }
+
+    int slot = (int)(m_now_ms & VALUETIMER_MASK);
+    int n = m_slots[slot];
+    m_slots[slot] = -1;
+    while (n >= 0) {
+        Node &node = m_nodes[n];
+        int next = node.next;
+        if (node.due_ms <= m_now_ms) {
+            node.due_ms += node.interval_ms;
+            queue(node.value);
+        }
+        place(n);
+        n = next;
+    }
+
+    m_now_ms++;
+}
+
 void ValueTimer::onTimer(int interval_ms)
 {
-    value_iter it;
-    for (it=m_values.begin(); it!=m_values.end(); it++)
+    if (m_nValues == 0)
+        m_now_ms += interval_ms;
+    else {
+        for (int i=0; i < interval_ms; i++)
+            tick();
+    }
+
+    // Watched values that changed too soon after being sent
+    unsigned int n = 0;
+    for (unsigned int i=0; i < m_pending.size(); i++) {
+        OscValue *v = m_pending[i];
+        ValueWatch *w = v->m_pWatch;
+        if (m_now_ms < w->sent_ms + w->interval_ms)
+            m_pending[n++] = v;
+        else {
+            w->bPending = false;
+            if (moved(v))
+                queue(v);
+        }
+    }
+    m_pending.resize(n);
+
+    flush();
+}
+
+void ValueTimer::flush()
+{
+    if (m_due.empty())
+        return;
+
+    // Remember what watched values were last sent as.
+    std::vector<OscValue*>::iterator it;
+    for (it=m_due.begin(); it!=m_due.end(); it++)
     {
-        struct ValueTimerPair *v;
-        v = it->second;
-        v->current_ms -= interval_ms;
-        if (v->current_ms <= 0) {
-            v->current_ms = v->interval_ms;
-            it->first->send();
+        ValueWatch *w = (*it)->m_pWatch;
+        if (w) {
+            w->bQueued = false;
+            w->sent_ms = m_now_ms;
+            (*it)->components(w->last);
         }
     }
+
+    if (m_due.size() == 1) {
+        m_due[0]->send();
+        m_due.clear();
+        return;
+    }
+
+    // All values are sent to address_send, so one bundle holds
+    // everything due in this step, unless it grows too large.
+    lo_bundle bundle = lo_bundle_new(LO_TT_IMMEDIATE);
+    for (it=m_due.begin(); it!=m_due.end(); it++)
+    {
+        lo_bundle_add_message(bundle, (*it)->c_path(), (*it)->message());
+        if (lo_bundle_length(bundle) > VALUETIMER_MAX_BUNDLE) {
+            lo_send_bundle(address_send, bundle);
+            lo_bundle_free_recursive(bundle);
+            bundle = lo_bundle_new(LO_TT_IMMEDIATE);
+        }
+    }
+
+    if (lo_bundle_count(bundle) > 0)
+        lo_send_bundle(address_send, bundle);
+    lo_bundle_free_recursive(bundle);
+
+    m_due.clear();
 }
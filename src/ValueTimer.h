@@ -18,27 +18,78 @@
 
 #include "dimple.h"
 
-class OscValue;
+#include <stdint.h>
+#include <vector>
 
-struct ValueTimerPair
-{
-    int current_ms;
-    int interval_ms;
-};
+class OscValue;
 
+//! The ValueTimer sends values periodically for /get <interval>
+//! subscriptions.  Values are kept in a hierarchical timing wheel
+//! with one millisecond per slot on its first level, so that a step
+//! only visits the values that are due.  Longer delays wait on the
+//! coarser levels and move down as their time approaches.  The
+//! values due in one step are sent together as a bundle.
+//!
+//! Values can also be watched, in which case they are sent at the
+//! end of a step in which they have moved by more than a threshold,
+//! but no more often than a minimum interval.
 class ValueTimer
 {
   public: 
-    ValueTimer() {};
+    ValueTimer();
     virtual ~ValueTimer() {};
 
     void addValue(OscValue* oscval, int interval_ms);
     void removeValue(OscValue* oscval);
 
+    //! Send a value whenever it moves by more than threshold, at
+    //! most once every interval_ms.
+    void watchValue(OscValue* oscval, double threshold, int interval_ms);
+    void unwatchValue(OscValue* oscval);
+
+    //! Check a watched value after it has been set.
+    void changed(OscValue* oscval);
+
     void onTimer(int interval_ms);
 
   protected:
-    std::map<OscValue*, struct ValueTimerPair*> m_values;
+    struct Node {
+        OscValue *value;
+        int interval_ms;
+        uint64_t due_ms;
+        int prev, next;     //! in the slot, or next free node
+        int slot;
+    };
+
+    //! Link a node into the slot for its due time.
+    void place(int n);
+
+    //! Unlink a node from its slot.
+    void unlink(int n);
+
+    //! Move the nodes of a slot to the slots for their due times.
+    void cascade(int slot);
+
+    //! Collect the values due at m_now_ms and advance by a millisecond.
+    void tick();
+
+    //! True if a watched value has moved by more than its threshold
+    //! since it was last sent.
+    bool moved(OscValue* oscval);
+
+    //! Send a value at the end of this step.
+    void queue(OscValue* oscval);
+
+    //! Send the collected values.
+    void flush();
+
+    std::vector<Node> m_nodes;  //! pool, reused through m_nFree
+    std::vector<int> m_slots;   //! first node of each slot, or -1
+    std::vector<OscValue*> m_due;  //! values to send this step
+    std::vector<OscValue*> m_pending;  //! watched, waiting for interval
+    int m_nFree;
+    int m_nValues;
+    uint64_t m_now_ms;
 };
 
 #endif // _VALUETIMER_H_
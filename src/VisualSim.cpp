@@ -14,9 +14,31 @@
 #ifdef USE_FREEGLUT
 #include <GL/freeglut.h>
 #endif
+#ifdef HAVE_OSMESA
+#include <GL/osmesa.h>
+#endif
+
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
 
 using namespace chai3d;
 
+// Meshes smaller than this on screen, in pixels, are drawn with
+// fewer triangles.
+#define VISUAL_LOD_PIXELS 256
+
+// Leaf boxes of the PickTree are enlarged by this fraction of the
+// object's bounding radius.
+#define PICK_TREE_MARGIN 0.5
+
+// Farthest distance from the camera at which objects are picked.
+#define PICK_RAY_LENGTH 1000.0
+
+// Most time spent per frame deleting destroyed objects
+#define VISUAL_RECLAIM_MS 2
+
 bool VisualPrismFactory::create(const char *name, float x, float y, float z)
 {
     printf("VisualPrismFactory (%s) is creating a prism object called '%s'\n",
@@ -41,6 +63,8 @@ bool VisualSphereFactory::create(const char *name, float x, float y, float z)
     if (!(obj && simulation()->add_object(*obj)))
             return false;
 
+    simulation()->sphereBatch()->add(obj->object());
+
     obj->m_position.setValue(x, y, z);
 
     return true;
@@ -153,9 +177,244 @@ struct VisualSim::CameraProjection {
     bool mirrorHorizontal;
     bool mirrorVertical;
     void set(cCamera *cam, int width, int height);
+    bool windowRay(int x, int y, cVector3d &pos, cVector3d &dir);
     cVector3d projectOnWindowRay(const cVector3d& vec, int x, int y);
 };
 
+/****** PickTree ******/
+
+PickTree::PickTree()
+    : m_nRoot(-1)
+{
+}
+
+static inline double box_area(const double *lo, const double *hi)
+{
+    double x = hi[0]-lo[0], y = hi[1]-lo[1], z = hi[2]-lo[2];
+    return 2 * (x*y + y*z + z*x);
+}
+
+static inline void box_union(const double *lo1, const double *hi1,
+                             const double *lo2, const double *hi2,
+                             double *lo, double *hi)
+{
+    for (int i=0; i<3; i++) {
+        lo[i] = std::min(lo1[i], lo2[i]);
+        hi[i] = std::max(hi1[i], hi2[i]);
+    }
+}
+
+int PickTree::alloc()
+{
+    int n;
+    if (m_freeNodes.empty()) {
+        n = m_nodes.size();
+        m_nodes.push_back(Node());
+    }
+    else {
+        n = m_freeNodes.back();
+        m_freeNodes.pop_back();
+    }
+    m_nodes[n].parent = -1;
+    m_nodes[n].child[0] = m_nodes[n].child[1] = -1;
+    m_nodes[n].obj = NULL;
+    return n;
+}
+
+void PickTree::update(CHAIObject *obj)
+{
+    // The cursor and virtual device are always candidates.
+    if (!obj->m_bCull) {
+        if (std::find(m_always.begin(), m_always.end(), obj) == m_always.end())
+            m_always.push_back(obj);
+        return;
+    }
+
+    cVector3d pos(obj->chai_object()->getLocalPos());
+    double r = obj->m_fBoundingRadius;
+    double lo[3] = { pos.x()-r, pos.y()-r, pos.z()-r };
+    double hi[3] = { pos.x()+r, pos.y()+r, pos.z()+r };
+
+    int leaf = obj->m_nPickNode;
+    if (leaf >= 0) {
+        Node &n = m_nodes[leaf];
+        if (n.lo[0] <= lo[0] && n.lo[1] <= lo[1] && n.lo[2] <= lo[2]
+            && n.hi[0] >= hi[0] && n.hi[1] >= hi[1] && n.hi[2] >= hi[2])
+            return;
+        removeLeaf(leaf);
+    }
+    else {
+        leaf = alloc();
+        m_nodes[leaf].obj = obj;
+        obj->m_nPickNode = leaf;
+    }
+
+    double margin = r * PICK_TREE_MARGIN;
+    for (int i=0; i<3; i++) {
+        m_nodes[leaf].lo[i] = lo[i] - margin;
+        m_nodes[leaf].hi[i] = hi[i] + margin;
+    }
+    insertLeaf(leaf);
+}
+
+void PickTree::remove(CHAIObject *obj)
+{
+    m_always.erase(std::remove(m_always.begin(), m_always.end(), obj),
+                   m_always.end());
+
+    if (obj->m_nPickNode < 0)
+        return;
+
+    removeLeaf(obj->m_nPickNode);
+    m_freeNodes.push_back(obj->m_nPickNode);
+    obj->m_nPickNode = -1;
+}
+
+void PickTree::insertLeaf(int leaf)
+{
+    if (m_nRoot < 0) {
+        m_nRoot = leaf;
+        m_nodes[leaf].parent = -1;
+        return;
+    }
+
+    // Descend towards the sibling that least increases the surface
+    // area of the tree.
+    const double *llo = m_nodes[leaf].lo, *lhi = m_nodes[leaf].hi;
+    double lo[3], hi[3];
+    int n = m_nRoot;
+    while (m_nodes[n].child[0] >= 0)
+    {
+        box_union(m_nodes[n].lo, m_nodes[n].hi, llo, lhi, lo, hi);
+        double area = box_area(m_nodes[n].lo, m_nodes[n].hi);
+        double combined = box_area(lo, hi);
+
+        // cost of pairing the leaf with this node here, and of
+        // pushing it further down, which grows this node anyway
+        double cost = 2 * combined;
+        double inherited = 2 * (combined - area);
+
+        double childCost[2];
+        for (int i=0; i<2; i++) {
+            const Node &c = m_nodes[m_nodes[n].child[i]];
+            box_union(c.lo, c.hi, llo, lhi, lo, hi);
+            childCost[i] = box_area(lo, hi) + inherited;
+            if (c.child[0] >= 0)
+                childCost[i] -= box_area(c.lo, c.hi);
+        }
+
+        if (cost < childCost[0] && cost < childCost[1])
+            break;
+        n = m_nodes[n].child[childCost[0] < childCost[1] ? 0 : 1];
+    }
+
+    int parent = alloc();
+    int grand = m_nodes[n].parent;
+    m_nodes[parent].parent = grand;
+    m_nodes[parent].child[0] = n;
+    m_nodes[parent].child[1] = leaf;
+    m_nodes[n].parent = parent;
+    m_nodes[leaf].parent = parent;
+
+    if (grand < 0)
+        m_nRoot = parent;
+    else
+        m_nodes[grand].child[m_nodes[grand].child[0] == n ? 0 : 1] = parent;
+
+    refit(parent);
+}
+
+void PickTree::removeLeaf(int leaf)
+{
+    if (leaf == m_nRoot) {
+        m_nRoot = -1;
+        return;
+    }
+
+    // The sibling takes the place of the parent.
+    int parent = m_nodes[leaf].parent;
+    int grand = m_nodes[parent].parent;
+    int sibling = m_nodes[parent].child[m_nodes[parent].child[0] == leaf ? 1 : 0];
+
+    m_nodes[sibling].parent = grand;
+    if (grand < 0)
+        m_nRoot = sibling;
+    else {
+        m_nodes[grand].child[m_nodes[grand].child[0] == parent ? 0 : 1] = sibling;
+        refit(grand);
+    }
+    m_freeNodes.push_back(parent);
+}
+
+void PickTree::refit(int n)
+{
+    while (n >= 0) {
+        Node &node = m_nodes[n];
+        const Node &a = m_nodes[node.child[0]], &b = m_nodes[node.child[1]];
+        box_union(a.lo, a.hi, b.lo, b.hi, node.lo, node.hi);
+        n = node.parent;
+    }
+}
+
+bool PickTree::pick(const cVector3d &pos, const cVector3d &dir,
+                    cCollisionRecorder &recorder, cCollisionSettings &settings)
+{
+    double p[3] = { pos.x(), pos.y(), pos.z() };
+    double inv[3] = { 1.0/dir.x(), 1.0/dir.y(), 1.0/dir.z() };
+
+    // Gather the objects whose boxes the ray crosses, with the
+    // distance at which it enters each box.
+    m_candidates.clear();
+    for (unsigned int i=0; i < m_always.size(); i++)
+        m_candidates.push_back(std::make_pair(0.0, m_always[i]));
+
+    m_stack.clear();
+    if (m_nRoot >= 0)
+        m_stack.push_back(m_nRoot);
+    while (!m_stack.empty())
+    {
+        const Node &n = m_nodes[m_stack.back()];
+        m_stack.pop_back();
+
+        double tmin = 0, tmax = PICK_RAY_LENGTH;
+        for (int i=0; i<3 && tmin <= tmax; i++) {
+            double t1 = (n.lo[i] - p[i]) * inv[i];
+            double t2 = (n.hi[i] - p[i]) * inv[i];
+            tmin = std::max(tmin, std::min(t1, t2));
+            tmax = std::min(tmax, std::max(t1, t2));
+        }
+        if (tmin > tmax)
+            continue;
+
+        if (n.child[0] < 0)
+            m_candidates.push_back(std::make_pair(tmin, n.obj));
+        else {
+            m_stack.push_back(n.child[0]);
+            m_stack.push_back(n.child[1]);
+        }
+    }
+
+    // Test the objects in order of distance, until the nearest hit
+    // is closer than the next box.  All objects are children of the
+    // world at the origin, or of the sphere batch, which does not
+    // move.
+    std::sort(m_candidates.begin(), m_candidates.end());
+    cVector3d end(pos + dir * PICK_RAY_LENGTH);
+    for (unsigned int i=0; i < m_candidates.size(); i++)
+    {
+        double t = m_candidates[i].first;
+        if (recorder.m_nearestCollision.m_object
+            && t*t > recorder.m_nearestCollision.m_squareDistance)
+            break;
+
+        cGenericObject *o = m_candidates[i].second->chai_object();
+        o->computeGlobalPositions(false);
+        o->computeCollisionDetection(pos, end, recorder, settings);
+    }
+
+    return recorder.m_nearestCollision.m_object != NULL;
+}
+
 /****** VisualSim ******/
 
 VisualSim *VisualSim::m_pGlobalContext = 0;
@@ -163,9 +422,23 @@ VisualSim *VisualSim::m_pGlobalContext = 0;
 VisualSim::VisualSim(const char *port)
     : Simulation(port, ST_VISUAL),
       m_camera(NULL),
+      m_pSphereBatch(NULL),
       m_bFullScreen(false),
       m_selectedObject(NULL),
-      m_log("log", this)
+      m_log("log", this),
+      m_frame_time("frame_time", this),
+      m_render_delay("render/delay", this),
+      m_pFrameFile(NULL),
+      m_nFrames(0),
+      m_capture(type_str()),
+      m_bCaptureStart(false),
+      m_bShadowsDirty(true),
+      m_bRedraw(true),
+      m_fFrameTime(0),
+      m_bInterpolating(false),
+      m_fPoseTime(-1),
+      m_fTimeOffset(0),
+      m_bTimeOffset(false)
 {
     m_pPrismFactory = new VisualPrismFactory(this);
     m_pSphereFactory = new VisualSphereFactory(this);
@@ -177,6 +450,13 @@ VisualSim::VisualSim(const char *port)
 
     m_log.setSetCallback(set_log, this);
 
+    m_render_delay.setValue(0.05);
+    m_render_delay.setSetCallback(set_render_delay, this);
+
+    // Simulation time of the poses that follow, sent by the physics
+    addHandler("time", "d", time_handler);
+    m_timeClock.start();
+
     m_cameraProj = new CameraProjection();
 }
 
@@ -188,13 +468,16 @@ VisualSim::~VisualSim()
 
     delete m_cameraProj;
     delete m_logLabel;
+
+    if (m_pFrameFile && m_pFrameFile != stdout)
+        fclose(m_pFrameFile);
 }
 
 void VisualSim::initGlutWindow()
 {
     // Default size
-    m_nWidth = 512;
-    m_nHeight = 512;
+    m_nWidth = visual_width;
+    m_nHeight = visual_height;
 
     // initialize global context pointer for GLUT callbacks
     // which don't have a data argument
@@ -225,29 +508,318 @@ void VisualSim::initGlutWindow()
     glutTimerFunc(visual_timestep_ms, updateDisplay, 0);
 }
 
-void VisualSim::updateDisplay(int data)
+void* VisualSim::receive(void* param)
 {
-    VisualSim *me = VisualSim::m_pGlobalContext;
+    VisualSim* me = static_cast<VisualSim*>(param);
+
+    int step_ms = (int)(me->m_fTimestep*1000);
+    cPrecisionClock clock;
+    clock.start();
 
-    while (lo_server_recv_noblock(me->m_server, 0)) {}
+    while (!me->m_bDone)
+    {
+        // Block briefly on the socket when idle; queues are polled.
+        if (!me->processMessages())
+            lo_server_wait(me->m_server, 1);
+
+        // Outside the scene lock, see on_capture_start().
+        if (me->m_bCaptureStart) {
+            me->m_bCaptureStart = false;
+            me->m_capture.start(me->m_captureTarget.c_str());
+        }
+
+        if (clock.getCurrentTimeSeconds()*1000 >= step_ms) {
+            clock.reset();
+            clock.start();
+
+            std::lock_guard<std::mutex> lock(me->m_sceneMutex);
+            me->m_valueTimer.onTimer(step_ms);
+        }
+    }
+
+    return NULL;
+}
+
+bool VisualSim::processMessages()
+{
+    bool handled = false;
+
+    // A /world/time message stamps the poses following it from the
+    // same source, so remember the latest stamp of each source: one
+    // per queue, and the last for the socket.
+    m_streamTimes.resize(m_queueList.size() + 1, -1);
+
+    if (lo_server_wait(m_server, 0)) {
+        std::lock_guard<std::mutex> lock(m_sceneMutex);
+        m_fPoseTime = m_streamTimes.back();
+        while (lo_server_recv_noblock(m_server, 0))
+            handled = true;
+        m_streamTimes.back() = m_fPoseTime;
+        m_bShadowsDirty = true;
+        m_bRedraw = true;
+    }
 
 #ifdef USE_QUEUES
-    std::vector<LoQueue*>::iterator qit;
-    for (qit=me->m_queueList.begin();
-         qit!=me->m_queueList.end(); qit++) {
-        while ((*qit)->read_and_dispatch(me->m_server)) {}
+    unsigned char *buffer;
+    size_t size;
+    for (unsigned int q = 0; q < m_queueList.size(); q++) {
+        m_fPoseTime = m_streamTimes[q];
+        while ((buffer = m_queueList[q]->read(size)) != NULL) {
+            handled = true;
+            if (is_pose_message((const char*)buffer))
+                lo_server_dispatch_data(m_server, buffer, size);
+            else {
+                std::lock_guard<std::mutex> lock(m_sceneMutex);
+                lo_server_dispatch_data(m_server, buffer, size);
+                m_bShadowsDirty = true;
+                m_bRedraw = true;
+            }
+        }
+        m_streamTimes[q] = m_fPoseTime;
     }
 #endif
 
-    int step_ms = (int)(me->m_fTimestep*1000);
-    me->m_valueTimer.onTimer(step_ms);
+    return handled;
+}
+
+bool VisualSim::is_pose_message(const char *path)
+{
+    // Only "/world/<object>/position" and "/world/<object>/rotation"
+    // for objects whose pose setters go through set_pose(), and
+    // "/world/time".  Objects are only added and removed on this
+    // thread, so the lookup is safe without the scene lock.
+    if (strncmp(path, "/world/", 7) != 0)
+        return false;
+
+    if (strcmp(path, "/world/time") == 0)
+        return true;
+
+    const char *name = path + 7;
+    const char *slash = strchr(name, '/');
+    if (!slash || (strcmp(slash, "/position") != 0
+                   && strcmp(slash, "/rotation") != 0))
+        return false;
+
+    OscObject *obj = find_object(std::string(name, slash - name).c_str());
+    return obj && dynamic_cast<CHAIObject*>(obj->special());
+}
+
+void VisualSim::set_pose(CHAIObject *obj, const cVector3d *pos,
+                         const cMatrix3d *rot)
+{
+    // Poses are only stamped for interpolation if a render delay is
+    // set and their source sent its time.
+    double time = (m_render_delay.m_value > 0) ? m_fPoseTime : -1;
+
+    std::lock_guard<std::mutex> lock(m_poseMutex);
+    Pose &pose = m_poses[obj];
+    pose.time = time;
+    if (pos) {
+        pose.pos = *pos;
+        pose.bPos = true;
+    }
+    if (rot) {
+        pose.rot = *rot;
+        pose.bRot = true;
+    }
+}
+
+void VisualSim::clear_pose(CHAIObject *obj)
+{
+    // Objects are destroyed with the scene lock held, so the render
+    // thread is not using m_tracks.
+    m_tracks.erase(obj);
+
+    std::lock_guard<std::mutex> lock(m_poseMutex);
+    m_poses.erase(obj);
+}
+
+int VisualSim::time_handler(const char *path, const char *types, lo_arg **argv,
+                            int argc, void *data, void *user_data)
+{
+    VisualSim *me = static_cast<VisualSim*>(user_data);
+
+    // Map the sender's simulation time onto our clock.  The offset is
+    // smoothed so that it follows drift between the two clocks but
+    // not the jitter of message delivery, which the render delay
+    // absorbs.
+    double offset = argv[0]->d - me->m_timeClock.getCurrentTimeSeconds();
+    if (me->m_bTimeOffset)
+        me->m_fTimeOffset += (offset - me->m_fTimeOffset) * 0.05;
+    else {
+        me->m_fTimeOffset = offset;
+        me->m_bTimeOffset = true;
+    }
+
+    me->m_fPoseTime = argv[0]->d - me->m_fTimeOffset;
+    return 0;
+}
+
+void VisualSim::interpolate(const Track &track, double t, Pose &pose)
+{
+    if (t >= track.b.time) {
+        pose = track.b;
+        return;
+    }
+
+    double s = 0;
+    if (t > track.a.time)
+        s = (t - track.a.time) / (track.b.time - track.a.time);
+
+    cQuaternion qa, qb, q;
+    qa.fromRotMat(track.a.rot);
+    qb.fromRotMat(track.b.rot);
+    q.slerp(s, qa, qb);
+    q.toRotMat(pose.rot);
+
+    pose.pos = track.a.pos * (1 - s) + track.b.pos * s;
+    pose.time = t;
+}
+
+void VisualSim::beginFrame()
+{
+    m_bRedraw = false;
+
+    // The render loop never returns to Simulation::run(), so objects
+    // destroyed since the last frame are deleted here, asking for
+    // another frame if some are left.
+    reclaim(VISUAL_RECLAIM_MS / 1000.0);
+    if (!m_retiredObjects.empty() || !m_retiredConstraints.empty())
+        m_bRedraw = true;
+
+    // Only the latest pose of each object since the last frame is
+    // kept, so a burst of updates costs one transform per object.
+    {
+        std::lock_guard<std::mutex> lock(m_poseMutex);
+        m_poses.swap(m_framePoses);
+    }
+
+    // Objects are shown as they were render_delay seconds ago, so
+    // that there is usually a sample on each side of that time.
+    double t = m_timeClock.getCurrentTimeSeconds() - m_render_delay.m_value;
+
+    PoseMap::iterator it;
+    for (it = m_framePoses.begin(); it != m_framePoses.end(); it++) {
+        cGenericObject *o = it->first->chai_object();
+        Pose &pose = it->second;
+
+        if (pose.time < 0) {
+            // not stamped, show immediately
+            if (pose.bPos)
+                o->setLocalPos(pose.pos);
+            if (pose.bRot)
+                o->setLocalRot(pose.rot);
+            m_pickTree.update(it->first);
+            m_tracks.erase(it->first);
+            continue;
+        }
+
+        TrackMap::iterator tr = m_tracks.find(it->first);
+        if (tr == m_tracks.end()) {
+            Track &track = m_tracks[it->first];
+            track.b.pos = o->getLocalPos();
+            track.b.rot = o->getLocalRot();
+            track.b.time = -1;
+            tr = m_tracks.find(it->first);
+        }
+
+        // A newer sample starts a segment from where the object is
+        // shown at time t, so that it moves on without a jump and
+        // reaches the sample at the sample's time.
+        Track &track = tr->second;
+        if (pose.time > track.b.time) {
+            Pose shown;
+            interpolate(track, t, shown);
+            track.a = shown;
+            track.a.time = t;
+            track.b.time = pose.time;
+        }
+        if (pose.bPos)
+            track.b.pos = pose.pos;
+        if (pose.bRot)
+            track.b.rot = pose.rot;
+    }
+
+    if (!m_framePoses.empty() || !m_tracks.empty())
+        m_bShadowsDirty = true;
+    m_framePoses.clear();
+
+    TrackMap::iterator tr;
+    for (tr = m_tracks.begin(); tr != m_tracks.end(); )
+    {
+        cGenericObject *o = tr->first->chai_object();
+        Track &track = tr->second;
+
+        if (t >= track.b.time) {
+            // caught up with the latest sample
+            o->setLocalPos(track.b.pos);
+            o->setLocalRot(track.b.rot);
+            m_pickTree.update(tr->first);
+            m_tracks.erase(tr++);
+            continue;
+        }
+
+        Pose shown;
+        interpolate(track, t, shown);
+        o->setLocalPos(shown.pos);
+        o->setLocalRot(shown.rot);
+        m_pickTree.update(tr->first);
+        tr++;
+    }
+
+    m_bInterpolating = !m_tracks.empty();
+}
+
+void VisualSim::updateDisplay(int data)
+{
+    VisualSim *me = VisualSim::m_pGlobalContext;
 
     if (me->m_bDone) {}  // TODO
 
-    glutPostRedisplay();
+    // Only draw if something changed, and check again sooner while
+    // the scene is moving.
+    int next_ms = visual_timestep_ms;
+    if (me->needsFrame()) {
+        glutPostRedisplay();
+        next_ms = me->frameInterval();
+    }
 
-    // update again in a few ms
-    glutTimerFunc(visual_timestep_ms, updateDisplay, 0);
+    glutTimerFunc(next_ms, updateDisplay, 0);
+}
+
+bool VisualSim::needsFrame()
+{
+    if (m_bRedraw || m_bInterpolating || m_capture.active())
+        return true;
+
+    std::lock_guard<std::mutex> lock(m_poseMutex);
+    return !m_poses.empty();
+}
+
+int VisualSim::frameInterval()
+{
+    // Frames being recorded are drawn at the steady rate of --fps.
+    if (m_capture.active())
+        return visual_timestep_ms;
+
+    // As often as the recent frame time allows, up to visual_fps_max
+    int min_ms = std::min(1000 / visual_fps_max, visual_timestep_ms);
+    int ms = (int)ceil(m_fFrameTime * 1000);
+    return std::max(ms, min_ms);
+}
+
+void VisualSim::endFrame(double seconds)
+{
+    if (m_nFrames == 0)
+        m_fFrameTime = seconds;
+    else
+        m_fFrameTime = m_fFrameTime * 0.9 + seconds * 0.1;
+    m_nFrames++;
+
+    // Values are sent from the receive thread, which may be watching
+    // this one.
+    std::lock_guard<std::mutex> lock(m_sceneMutex);
+    m_frame_time.setValue(m_fFrameTime * 1000, false);
 }
 
 void VisualSim::initialize()
@@ -260,6 +832,10 @@ void VisualSim::initialize()
     m_camera = new OscCameraCHAI(m_chaiWorld, "camera", this);
     m_chaiWorld->addChild(m_camera->object());
 
+    // parent of all spheres, which are drawn together
+    m_pSphereBatch = new cSphereBatch();
+    m_chaiWorld->addChild(m_pSphereBatch);
+
     // Create a light source and attach it to the camera so that it
     // moves with the point of view
     m_chaiLight0 = new cSpotLight(m_chaiWorld);
@@ -302,26 +878,140 @@ void VisualSim::initialize()
 
 void VisualSim::step()
 {
-    // Start GLUT
-	int argc=0;
-    glutInit(&argc, NULL);
-    initGlutWindow();
-    glutMainLoop();
+    // Incoming OSC messages are parsed on their own thread so that
+    // message load and frame time do not hold each other up.
+    m_recvThread = std::thread(VisualSim::receive, this);
+
+    if (visual_headless)
+        runHeadless();
+    else {
+        // Start GLUT
+        int argc=0;
+        glutInit(&argc, NULL);
+        initGlutWindow();
+        glutMainLoop();
+    }
 
     // Don't return call step() again, since glutMainLoop() does not
-    // exit, so if it has exited it means we are done.  The simulation
-    // step is instead executed in updateDisplay(), which is called at
-    // regular intervals.  Incoming OSC messages are also parsed
-    // there.
+    // exit, so if it has exited it means we are done.  Frames are
+    // instead requested in updateDisplay(), which is called at
+    // regular intervals.
     m_bDone = true;
+    m_recvThread.join();
 }
 
-void VisualSim::draw()
+void VisualSim::runHeadless()
 {
-    VisualSim* me = VisualSim::m_pGlobalContext;
+#ifdef HAVE_OSMESA
+    m_nWidth = visual_width;
+    m_nHeight = visual_height;
+
+    OSMesaContext ctx = OSMesaCreateContextExt(OSMESA_RGBA, 24, 8, 0, NULL);
+    std::vector<unsigned char> buffer(m_nWidth * m_nHeight * 4);
+    if (!ctx || !OSMesaMakeCurrent(ctx, &buffer[0], GL_UNSIGNED_BYTE,
+                                   m_nWidth, m_nHeight))
+    {
+        printf("[%s] Unable to create offscreen rendering context.\n",
+               type_str());
+        if (ctx)
+            OSMesaDestroyContext(ctx);
+        return;
+    }
+#ifdef GLEW_VERSION
+    glewInit();
+#endif
+    glViewport(0, 0, m_nWidth, m_nHeight);
+
+    printf("[%s] Rendering offscreen at %dx%d, %d fps.\n", type_str(),
+           m_nWidth, m_nHeight, visual_fps);
+
+    cPrecisionClock clock;
+    double renderTime = 0;
+    while (!m_bDone)
+    {
+        clock.reset();
+        clock.start();
+
+        // Frames being recorded are written at a constant rate,
+        // otherwise there is nothing to do while the scene is still.
+        if (visual_frames || needsFrame())
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_sceneMutex);
+                beginFrame();
+                render();
+                m_capture.capture(m_nWidth, m_nHeight);
+                glFinish();
+            }
+            double seconds = clock.getCurrentTimeSeconds();
+            renderTime += seconds;
 
+            if (visual_frames && !writeFrame(&buffer[0]))
+                visual_frames = NULL;
+
+            endFrame(seconds);
+        }
+
+        int left_ms = visual_timestep_ms
+            - (int)(clock.getCurrentTimeSeconds()*1000);
+        if (left_ms > 0)
+            Sleep(left_ms);
+    }
+
+    if (m_nFrames > 0)
+        printf("[%s] Rendered %u frames, average %.3f ms per frame.\n",
+               type_str(), m_nFrames, renderTime * 1000 / m_nFrames);
+
+    OSMesaDestroyContext(ctx);
+#else
+    printf("[%s] Headless rendering is not available, DIMPLE was "
+           "built without OSMesa.\n", type_str());
+#endif
+}
+
+bool VisualSim::writeFrame(const unsigned char *rgba)
+{
+    FILE *f = m_pFrameFile;
+
+    // A printf-style pattern gives one file per frame, checked when
+    // parsing the command line to hold a single integer conversion.
+    bool sequence = FrameCapture::patternConversions(visual_frames) == 1;
+    if (sequence) {
+        char filename[1024];
+        snprintf(filename, sizeof(filename), visual_frames, (int)m_nFrames);
+        f = fopen(filename, "wb");
+    }
+    else if (!f) {
+        if (strcmp(visual_frames, "-") == 0)
+            f = stdout;
+        else
+            f = fopen(visual_frames, "wb");
+        m_pFrameFile = f;
+    }
+
+    if (!f) {
+        printf("[%s] Unable to open %s for writing frames.\n",
+               type_str(), visual_frames);
+        return false;
+    }
+
+    bool ok = FrameCapture::writePPM(f, rgba, m_nWidth, m_nHeight);
+
+    if (sequence)
+        ok = (fclose(f) == 0) && ok;
+    else
+        fflush(f);
+
+    if (!ok)
+        printf("[%s] Error writing frame %u.\n", type_str(), m_nFrames);
+
+    return ok;
+}
+
+void VisualSim::render()
+{
     // set the background color of the world
-    cColorf color = me->m_chaiWorld->getBackgroundColor();
+    cColorf color = m_chaiWorld->getBackgroundColor();
     glClearColor(color.getR(), color.getG(), color.getB(), color.getA());
 
     // clear the color and depth buffers
@@ -333,16 +1023,76 @@ void VisualSim::draw()
         syncPoses();
     */
 
-    // render world
-    me->m_chaiWorld->updateShadowMaps(false, false);
-    me->m_camera->object()->renderView(me->m_nWidth, me->m_nHeight);
+    selectLevels();
+
+    // render world, re-using the shadow maps of the previous frame
+    // if nothing has moved since
+    if (m_bShadowsDirty) {
+        m_chaiWorld->updateShadowMaps(false, false);
+        m_bShadowsDirty = false;
+    }
+    m_camera->object()->renderView(m_nWidth, m_nHeight);
 
     // check for any OpenGL errors
     GLenum err;
     err = glGetError();
     if (err != GL_NO_ERROR) printf("Error:  %s\n", gluErrorString(err));
+}
+
+void VisualSim::selectLevels()
+{
+    if (m_lodMeshes.empty())
+        return;
+
+    // Pixels covered by a unit length at unit distance
+    cCamera *cam = m_camera->object();
+    double scale = (m_nHeight / 2.0) / cTanDeg(cam->getFieldViewAngleDeg() / 2.0);
+    cVector3d eye(cam->getLocalPos());
+
+    std::set<OscMeshCHAI*>::iterator it;
+    for (it = m_lodMeshes.begin(); it != m_lodMeshes.end(); it++)
+    {
+        cMultiMesh *mesh = (*it)->object();
+        cVector3d vmin(mesh->getBoundaryMin()), vmax(mesh->getBoundaryMax());
+        double radius = (vmax - vmin).length() / 2;
+        cVector3d center(mesh->getLocalPos()
+                         + cMul(mesh->getLocalRot(), (vmin + vmax) / 2));
+        double distance = (center - eye).length();
+
+        // Each level has half the triangles of the one before, so
+        // drop a level each time the size on screen halves.
+        int level = 0;
+        if (distance > radius) {
+            double pixels = 2 * radius * scale / distance;
+            double limit = VISUAL_LOD_PIXELS;
+            while (pixels < limit && level < (*it)->numLevels()) {
+                level++;
+                limit /= 2;
+            }
+        }
+
+        if ((*it)->setLevel(level))
+            m_bShadowsDirty = true;
+    }
+}
+
+void VisualSim::draw()
+{
+    VisualSim* me = VisualSim::m_pGlobalContext;
+
+    cPrecisionClock clock;
+    clock.start();
+
+    {
+        std::lock_guard<std::mutex> lock(me->m_sceneMutex);
+        me->beginFrame();
+        me->render();
+        me->m_capture.capture(me->m_nWidth, me->m_nHeight);
+    }
 
     glutSwapBuffers();
+
+    me->endFrame(clock.getCurrentTimeSeconds());
 }
 
 void VisualSim::on_log()
@@ -377,6 +1127,7 @@ void VisualSim::key(unsigned char key, int x, int y)
         }
         case ('w'):
         {
+            std::lock_guard<std::mutex> lock(me->m_sceneMutex);
             me->sendtotype(Simulation::ST_HAPTICS, false,
                            "/world/reset_workspace", "");
         }
@@ -388,6 +1139,7 @@ void VisualSim::reshape(int w, int h)
     VisualSim* me = VisualSim::m_pGlobalContext;
 
     // update the size of the viewport
+    me->m_bRedraw = true;
     me->m_nWidth = w;
     me->m_nHeight = h;
     glViewport(0, 0, w, h);
@@ -416,22 +1168,21 @@ void VisualSim::CameraProjection::set(cCamera *cam, int width, int height) {
     windowHeight = height;
 }
 
-cVector3d VisualSim::CameraProjection::projectOnWindowRay(const cVector3d& vec, int x, int y)
+bool VisualSim::CameraProjection::windowRay(int x, int y, cVector3d &pos, cVector3d &dir)
 {
-    /* This function returns the closest point from some vector onto
-     * the ray cast from the camera at the x,y position in window
-     * coordinates.  Needed for dragging objects around with the mouse
-     * on the plane parallel to the camera plane. */
+    /* This function computes the ray cast from the camera at the x,y
+     * position in window coordinates. */
     /* Adapted from Chai3d's selectWorld. */
 
-    // store values
+    // store values, the window size is adjusted for passive stereo
+    // without changing the frozen projection
+    int windowWidth = this->windowWidth;
+    int windowHeight = this->windowHeight;
     int windowPosX = x;
     int windowPosY = y;
     double scaleFactorX = 1.0;
     double scaleFactorY = 1.0;
 
-    cVector3d pos, dir;
-
     // adjust values when passive stereo is used
     if (stereoMode == C_STEREO_PASSIVE_LEFT_RIGHT)
     {
@@ -472,7 +1223,7 @@ cVector3d VisualSim::CameraProjection::projectOnWindowRay(const cVector3d& vec,
     if (!orthographicView)
     {
         // make sure we have a legitimate field of view
-        if (fabs(fieldViewAngleDeg) < 0.001f) { return vec; }
+        if (fabs(fieldViewAngleDeg) < 0.001f) { return false; }
 
         // compute the ray that leaves the eye point at the appropriate angle
         //
@@ -508,6 +1259,20 @@ cVector3d VisualSim::CameraProjection::projectOnWindowRay(const cVector3d& vec,
         dir = cNegate(globalRot.getCol0());
     }
 
+    return true;
+}
+
+cVector3d VisualSim::CameraProjection::projectOnWindowRay(const cVector3d& vec, int x, int y)
+{
+    /* This function returns the closest point from some vector onto
+     * the ray cast from the camera at the x,y position in window
+     * coordinates.  Needed for dragging objects around with the mouse
+     * on the plane parallel to the camera plane. */
+
+    cVector3d pos, dir;
+    if (!windowRay(x, y, pos, dir))
+        return vec;
+
     /* new location is the cloest point on the line perpendicular to
      * the camera plane */
     return cProjectPointOnLine(vec, pos, dir);
@@ -516,6 +1281,7 @@ cVector3d VisualSim::CameraProjection::projectOnWindowRay(const cVector3d& vec,
 void VisualSim::mouseClick(int button, int state, int x, int y)
 {
     VisualSim* me = VisualSim::m_pGlobalContext;
+    std::lock_guard<std::mutex> lock(me->m_sceneMutex);
 
     // mouse button down
     if (state == GLUT_DOWN)
@@ -527,17 +1293,26 @@ void VisualSim::mouseClick(int button, int state, int x, int y)
         settings.m_checkHapticObjects = true;
         settings.m_ignoreShapes = false;
 
-        // update my m_globalPos and m_globalRot variables
-        me->m_chaiWorld->computeGlobalPositions(false);
+        // Only the camera's frame is needed to cast the ray, objects
+        // are found through the pick tree rather than by traversing
+        // the world.
+        cCamera *cam = me->m_camera->object();
+        cam->computeGlobalPositions(true, me->m_chaiWorld->getGlobalPos(),
+                                    me->m_chaiWorld->getGlobalRot());
+
+        // Freeze camera frame for interactive calculations
+        CameraProjection& proj = *me->m_cameraProj;
+        proj.set(cam, me->m_nWidth, me->m_nHeight);
 
         // detect for any collision between mouse and scene
-        bool hit = me->m_camera->object()->
-            selectWorld(x, me->m_nHeight-y, me->m_nWidth, me->m_nHeight, recorder, settings);
+        cVector3d rayPos, rayDir;
+        bool hit = proj.windowRay(x, me->m_nHeight-y, rayPos, rayDir)
+            && me->m_pickTree.pick(rayPos, rayDir, recorder, settings);
         OscObject *obj = nullptr;
         if (hit && recorder.m_nearestCollision.m_object)
         {
             me->m_selectionPlane = 0;
-            OscVisualVirtdevCHAI* vdev = dynamic_cast<OscVisualVirtdevCHAI*>(me->world_objects["device"]);
+            OscVisualVirtdevCHAI* vdev = dynamic_cast<OscVisualVirtdevCHAI*>(me->find_object("device"));
             if (vdev)
                 me->m_selectionPlane = vdev->getSelectionPlane(
                     recorder.m_nearestCollision.m_object);
@@ -553,10 +1328,6 @@ void VisualSim::mouseClick(int button, int state, int x, int y)
             // TODO: Problem if selected object is deleted!
             me->m_selectedObject = obj;
 
-            // Freeze camera frame for interactive calculations
-            CameraProjection& proj = *me->m_cameraProj;
-            proj.set(me->m_camera->object(), me->m_nWidth, me->m_nHeight);
-
             cVector3d pos;
             if (obj == (OscObject*)me->m_camera)
                 pos = me->m_camera->getLookat();
@@ -585,12 +1356,18 @@ int OscVisualVirtdevCHAI::getSelectionPlane(cGenericObject *obj)
 void VisualSim::mouseMotion(int x, int y)
 {
     VisualSim* me = VisualSim::m_pGlobalContext;
+    std::lock_guard<std::mutex> lock(me->m_sceneMutex);
 
     if (!me->m_selectedObject)
         return;
 
+    me->m_bRedraw = true;
+
     if (me->m_selectedObject == (OscObject*)me->m_camera)
     {
+        // The lights move with the camera.
+        me->m_bShadowsDirty = true;
+
         cVector3d vec1 = me->m_selectionOffset;
         cVector3d vec2 = me->m_camera->getLookat() - me->m_cameraProj->projectOnWindowRay(
             me->m_camera->getLookat(), x, me->m_nHeight-y);
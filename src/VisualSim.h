@@ -5,15 +5,67 @@
 
 #include "Simulation.h"
 #include "HapticsSim.h"
+#include "SphereBatch.h"
+#include "FrameCapture.h"
 
 #include <world/CWorld.h>
 #include <display/CCamera.h>
 #include <lighting/CSpotLight.h>
 #include <widgets/CLabel.h>
 
+#include <unordered_map>
+#include <set>
+#include <vector>
+#include <atomic>
+
 class OscCameraCHAI;
 class VisualVirtdevFactory;
 
+//! A bounding volume hierarchy over the objects of the visual world,
+//! used to find the object under the mouse without traversing the
+//! whole scene.  Leaves hold boxes enlarged by a margin, so an object
+//! moving a little does not change the tree.
+class PickTree
+{
+  public:
+    PickTree();
+
+    //! Insert or move an object according to its position and
+    //! bounding radius.
+    void update(CHAIObject *obj);
+
+    //! Remove an object from the tree.
+    void remove(CHAIObject *obj);
+
+    //! Record the nearest collision of a ray with the objects whose
+    //! boxes it crosses.  Returns true if anything was hit.
+    bool pick(const cVector3d &pos, const cVector3d &dir,
+              cCollisionRecorder &recorder, cCollisionSettings &settings);
+
+  protected:
+    struct Node {
+        double lo[3], hi[3];
+        int parent;
+        int child[2];       //! -1 for leaves
+        CHAIObject *obj;
+    };
+
+    int alloc();
+    void insertLeaf(int leaf);
+    void removeLeaf(int leaf);
+    void refit(int n);
+
+    std::vector<Node> m_nodes;
+    std::vector<int> m_freeNodes;
+    int m_nRoot;
+
+    //! Objects tested on every pick, such as the virtual device.
+    std::vector<CHAIObject*> m_always;
+
+    std::vector<int> m_stack;
+    std::vector<std::pair<double, CHAIObject*> > m_candidates;
+};
+
 class VisualSim : public Simulation
 {
   public:
@@ -22,11 +74,43 @@ class VisualSim : public Simulation
 
     cWorld *world() { return m_chaiWorld; }
     OscCameraCHAI *camera() { return m_camera; }
+    cSphereBatch *sphereBatch() { return m_pSphereBatch; }
+    PickTree& pickTree() { return m_pickTree; }
+    CHAIShapePool& shapes() { return m_shapes; }
     cSpotLight *light(unsigned int i);
 
+    //! Record a new position and/or rotation for an object, to be
+    //! applied by the render thread at the start of the next frame.
+    void set_pose(CHAIObject *obj, const cVector3d *pos, const cMatrix3d *rot);
+
+    //! Forget any pending pose for an object being destroyed.
+    void clear_pose(CHAIObject *obj);
+
+    //! Track meshes whose level of detail is chosen on each frame.
+    void add_lod_mesh(OscMeshCHAI *mesh) { m_lodMeshes.insert(mesh); }
+    void remove_lod_mesh(OscMeshCHAI *mesh) { m_lodMeshes.erase(mesh); }
+
     //! Message to append to log (displayed in window)
     OSCSTRING(VisualSim, log);
 
+    //! Average time taken to draw a frame, in milliseconds.
+    OSCSCALAR(VisualSim, frame_time) {};
+
+    //! How far behind the physics objects are shown, in seconds, to
+    //! interpolate between poses.  0 disables this.
+    OSCSCALAR(VisualSim, render_delay) {};
+
+    //! The capture is started by the receive thread once the message
+    //! has been handled, since starting waits for the last capture's
+    //! encoder and must not hold up the renderer.
+    virtual void on_capture_start(const char *target) {
+        m_capture.stop();
+        m_captureTarget = target;
+        m_bCaptureStart = true;
+    }
+    virtual void on_capture_stop()
+      { m_bCaptureStart = false; m_capture.stop(); }
+
   protected:
     virtual void initialize();
     virtual void step();
@@ -34,6 +118,39 @@ class VisualSim : public Simulation
     void initGlutWindow();
     static void updateDisplay(int data);
     static void draw();
+
+    //! Function for the message receive thread.
+    static void* receive(void* param);
+
+    //! Dispatch pending messages, returning true if any were handled.
+    bool processMessages();
+
+    //! True if a queued message only sets the pose of an object.
+    bool is_pose_message(const char *path);
+
+    //! Apply the poses received since the last frame (render thread).
+    void beginFrame();
+
+    //! True if anything has changed since the last frame.
+    bool needsFrame();
+
+    //! Milliseconds until the next frame while the scene is moving.
+    int frameInterval();
+
+    //! Account for the time taken by a frame and report it.
+    void endFrame(double seconds);
+
+    //! Render the world into the current GL context.
+    void render();
+
+    //! Choose each mesh's level of detail by its size on screen.
+    void selectLevels();
+
+    //! Render offscreen at visual_fps until the simulation is done.
+    void runHeadless();
+
+    //! Write an RGBA frame, bottom row first, to visual_frames as PPM.
+    bool writeFrame(const unsigned char *rgba);
     static void key(unsigned char key, int x, int y);
     static void reshape(int w, int h);
     static void mouseClick(int button, int state, int x, int y);
@@ -48,6 +165,10 @@ class VisualSim : public Simulation
     cSpotLight *m_chaiLight1;       //! a light source
 
     OscCameraCHAI *m_camera;        //! an OSC-controllable camera
+    cSphereBatch *m_pSphereBatch;   //! draws all spheres in one pass
+    std::set<OscMeshCHAI*> m_lodMeshes;  //! meshes with levels of detail
+    PickTree m_pickTree;            //! objects under the mouse
+    CHAIShapePool m_shapes;         //! shapes of destroyed objects
 
     /** GLUT callback functions require a pointer to the VisualSim
      ** object, but do not have a user-specified data parameter.  On
@@ -67,6 +188,69 @@ class VisualSim : public Simulation
     cLabel* m_logLabel;
 
     bool m_bFullScreen;
+
+    FILE *m_pFrameFile;       //! stream for --frames without a pattern
+    unsigned int m_nFrames;   //! number of frames rendered
+
+    FrameCapture m_capture;   //! frames recorded by /world/capture
+    std::string m_captureTarget;  //! capture to start (receive thread)
+    bool m_bCaptureStart;
+
+    /** Messages are dispatched on m_recvThread.  Pose updates, which
+     ** are most of the traffic, only write to m_poses and do not wait
+     ** for the renderer; all other messages hold m_sceneMutex, which
+     ** the render thread also holds while it draws a frame. */
+    std::thread m_recvThread;
+    std::mutex m_sceneMutex;
+
+    struct Pose {
+        cVector3d pos;
+        cMatrix3d rot;
+        bool bPos, bRot;
+        double time;         //! on m_timeClock, or -1 to show at once
+        Pose() : bPos(false), bRot(false), time(-1) {}
+    };
+    typedef std::unordered_map<CHAIObject*, Pose> PoseMap;
+    PoseMap m_poses;         //! written by the receive thread
+    PoseMap m_framePoses;    //! swapped in and applied at frame start
+    std::mutex m_poseMutex;
+
+    //! True if anything that casts or receives shadows, or a light,
+    //! may have moved since the shadow maps were last rendered.
+    //! Protected by m_sceneMutex.
+    bool m_bShadowsDirty;
+
+    //! True if the scene changed other than by buffered poses since
+    //! the last frame.
+    std::atomic<bool> m_bRedraw;
+
+    double m_fFrameTime;      //! recent average time per frame, seconds
+
+    /** Stamped poses are shown render_delay seconds behind the
+     ** newest ones, each object moving from where it was shown when
+     ** its latest sample arrived (a) to that sample (b).  Tracks only
+     ** exist while an object is still moving towards its latest
+     ** sample, and belong to the render thread. */
+    struct Track {
+        Pose a, b;
+    };
+    typedef std::unordered_map<CHAIObject*, Track> TrackMap;
+    TrackMap m_tracks;
+    bool m_bInterpolating;
+
+    //! The pose of a track at time t.
+    static void interpolate(const Track &track, double t, Pose &pose);
+
+    //! Handler for /world/time, the simulation time of the poses that
+    //! follow it from the same source (receive thread).
+    static int time_handler(const char *path, const char *types, lo_arg **argv,
+                            int argc, void *data, void *user_data);
+
+    cPrecisionClock m_timeClock;       //! clock for pose stamps
+    double m_fPoseTime;                //! stamp for set_pose()
+    std::vector<double> m_streamTimes; //! last stamp of each source
+    double m_fTimeOffset;              //! sender time minus our time
+    bool m_bTimeOffset;
 };
 
 class VisualPrismFactory : public PrismFactory
@@ -28,14 +28,24 @@
 #include "VisualSim.h"
 #include "InterfaceSim.h"
 
+// Highest frame rate accepted, so that frames are at least 1 ms apart.
+#define MAX_FPS 1000
+
 /** Defaults for global variables **/
 int visual_fps = 30;
 int visual_timestep_ms = (int)((1.0/visual_fps)*1000.0);
+int visual_fps_max = 60;
+bool visual_headless = false;
+int visual_width = 512;
+int visual_height = 512;
+const char *visual_frames = NULL;
 int physics_timestep_ms = 10;
 int haptics_timestep_ms = 1;
+bool haptics_timing = false;
 int msg_queue_size = DEFAULT_QUEUE_SIZE*1024;
 bool force_enabled = true;
 const char *interface_port_str = "7774";
+const char *mesh_cache_dir = NULL;
 
 static struct {
     const char *visual, *haptics, *physics;
@@ -67,7 +77,27 @@ void help()
            "             to 7774.  Ports for physics, haptics and visual\n"
            "             simulations are consecutive following this number,\n"
            "             respectively.\n\n");
-    printf("--noforce (-n)  Disable force output to haptic device.\n");
+    printf("--noforce (-n)  Disable force output to haptic device.\n\n");
+    printf("--mesh-cache (-m)  Directory in which to cache loaded meshes and\n"
+           "                   their collision trees, or \"none\" to disable.\n"
+           "                   Defaults to $XDG_CACHE_HOME/dimple.\n\n");
+    printf("--headless (-H)  Render the visual simulation offscreen instead\n"
+           "                 of in a window.  May be followed by `=WxH' to\n"
+           "                 specify the frame size, default 512x512.\n"
+           "                 Requires DIMPLE to be built with OSMesa.\n\n");
+    printf("--fps (-f)  Frame rate of the visual simulation.  Default is %d.\n\n",
+           visual_fps);
+    printf("--max-fps (-M)  Highest frame rate of the visual simulation\n"
+           "                while the scene is moving.  Nothing is drawn\n"
+           "                while it is still.  Default is %d.\n\n",
+           visual_fps_max);
+    printf("--frames (-F)  Write rendered frames as PPM images.  If the\n"
+           "               argument contains a printf-style integer format,\n"
+           "               e.g. frames/%%05d.ppm, one file is written per\n"
+           "               frame, otherwise frames are streamed to a single\n"
+           "               file or pipe.  Only used with --headless.\n\n");
+    printf("--timing (-t)  Print the mean and longest haptic step time\n"
+           "               once per second.\n");
 }
 
 void parse_command_line(int argc, char* argv[])
@@ -83,13 +113,19 @@ void parse_command_line(int argc, char* argv[])
         { "port",       required_argument, 0, 'p' },
         { "connect",    required_argument, 0, 'c' },
         { "noforce",    no_argument,       0, 'n' },
+        { "mesh-cache", required_argument, 0, 'm' },
+        { "headless",   optional_argument, 0, 'H' },
+        { "fps",        required_argument, 0, 'f' },
+        { "frames",     required_argument, 0, 'F' },
+        { "max-fps",    required_argument, 0, 'M' },
+        { "timing",     no_argument,       0, 't' },
         {0, 0, 0, 0}
     };
 
     while (c!=-1) {
         int option_index = 0;
 
-        c = getopt_long (argc, argv, "hu:q:s:p:c:n",
+        c = getopt_long (argc, argv, "hu:q:s:p:c:nm:H::f:F:M:t",
                          long_options, &option_index);
 
         switch (c) {
@@ -132,6 +168,48 @@ void parse_command_line(int argc, char* argv[])
         case 'n':
             force_enabled = false;
             break;
+        case 'm':
+            mesh_cache_dir = optarg;
+            break;
+        case 'H':
+            visual_headless = true;
+            if (optarg && (sscanf(optarg, "%dx%d", &visual_width,
+                                  &visual_height) != 2
+                           || visual_width <= 0 || visual_height <= 0)) {
+                printf("Error parsing --headless option, "
+                       "size must be given as WxH.\n");
+                exit(1);
+            }
+            break;
+        case 'f':
+            if (optarg==0 || atoi(optarg)<=0 || atoi(optarg)>MAX_FPS) {
+                printf("Error parsing --fps option, "
+                       "must be an integer from 1 to %d.\n", MAX_FPS);
+                exit(1);
+            }
+            visual_fps = atoi(optarg);
+            visual_timestep_ms = (int)((1.0/visual_fps)*1000.0);
+            break;
+        case 'F':
+            // The pattern is given to snprintf for each frame.
+            if (optarg==0 || FrameCapture::patternConversions(optarg) < 0) {
+                printf("Error parsing --frames option, "
+                       "may only contain one %%d conversion.\n");
+                exit(1);
+            }
+            visual_frames = optarg;
+            break;
+        case 'M':
+            if (optarg==0 || atoi(optarg)<=0 || atoi(optarg)>MAX_FPS) {
+                printf("Error parsing --max-fps option, "
+                       "must be an integer from 1 to %d.\n", MAX_FPS);
+                exit(1);
+            }
+            visual_fps_max = atoi(optarg);
+            break;
+        case 't':
+            haptics_timing = true;
+            break;
         case 'h':
             help();
             exit(0);
@@ -188,6 +266,12 @@ int main(int argc, char* argv[])
      parse_command_line(argc, argv);
 #endif
 
+#ifndef WIN32
+     // A stream or capture whose reader has exited must give a write
+     // error rather than end the whole process.
+     signal(SIGPIPE, SIG_IGN);
+#endif
+
      unsigned int interface_port = atoi(interface_port_str);
 
      char address_send_url_fmt[256];
@@ -35,9 +35,16 @@
 
 extern int visual_fps;
 extern int visual_timestep_ms;
+extern int visual_fps_max;
+extern bool visual_headless;
+extern int visual_width;
+extern int visual_height;
+extern const char *visual_frames;
 extern int physics_timestep_ms;
 extern int haptics_timestep_ms;
+extern bool haptics_timing;
 extern int msg_queue_size;
+extern const char *mesh_cache_dir;
 
 /** Miscellaneous macros **/
 
@@ -0,0 +1,86 @@
+#!/bin/sh
+
+# This script assumes Dimple is already running, and that no oscdump
+# is listening on port 7778, since it receives the answers itself.
+
+# Create several thousand spheres with create_many, in two messages
+# since one holds about 2000, and check that every one of them was
+# created by asking for all their radii at once.
+
+if [ x$1 = x ]; then
+    COUNT=4000
+else
+    COUNT=$1
+fi
+
+python - $COUNT <<'END'
+import socket, struct, sys
+
+def osc_string(s):
+    b = s.encode() + b'\0'
+    return b + b'\0' * (-len(b) % 4)
+
+def osc_message(path, types, *args):
+    msg = osc_string(path) + osc_string(',' + types)
+    for t, a in zip(types, args):
+        if t == 's':
+            msg += osc_string(a)
+        elif t == 'i':
+            msg += struct.pack('>i', a)
+        elif t == 'b':
+            msg += struct.pack('>i', len(a)) + a + b'\0' * (-len(a) % 4)
+    return msg
+
+def messages(data):
+    if data.startswith(b'#bundle\0'):
+        data = data[16:]
+        while data:
+            size = struct.unpack('>i', data[:4])[0]
+            for m in messages(data[4:4 + size]):
+                yield m
+            data = data[4 + size:]
+    else:
+        yield data
+
+count = int(sys.argv[1])
+per_message = 2000
+
+sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+sock.bind(('', 7778))
+sock.settimeout(5)
+dimple = ('localhost', 7774)
+
+sock.sendto(osc_message('/world/clear', ''), dimple)
+
+for first in range(0, count, per_message):
+    records = b''
+    for i in range(first, min(first + per_message, count)):
+        records += struct.pack('>ffff', (i % 64) * 0.01,
+                               (i // 64) * 0.01, 0, 0.004)
+    sock.sendto(osc_message('/world/sphere/create_many', 'sbi',
+                            'ball', records, first), dimple)
+
+sock.sendto(osc_message('/world/ball*/radius/get', ''), dimple)
+
+# Each record of the answer is a handle and the radius.
+answer = osc_string('/world/all/radius')
+data = None
+while data is None:
+    try:
+        packet = sock.recv(1 << 17)
+    except socket.timeout:
+        print('FAIL: no answer to /world/ball*/radius/get')
+        sys.exit(1)
+    for m in messages(packet):
+        if m.startswith(answer):
+            data = m
+
+blob = data[len(answer) + len(osc_string(',sb'))
+            + len(osc_string('ball*')):]
+created = struct.unpack('>i', blob[:4])[0] // 8
+if created == count:
+    print('PASS: %d spheres created' % created)
+else:
+    print('FAIL: %d of %d spheres created' % (created, count))
+    sys.exit(1)
+END
@@ -0,0 +1,42 @@
+#!/bin/sh
+
+# This test file relies on the programs 'oscdump' and 'oscsend' which
+# are available as part of the LibLo distribution.
+
+# This script assumes Dimple is already running.
+
+# Creates a grid of SIZE x SIZE static prisms (default 16x16) for the
+# cursor to touch, as a load test for haptic rendering of prisms.  If
+# the second argument is "mesh", the grid is made of meshes of the
+# same boxes (test/box.obj) instead.  Run Dimple with --timing and
+# compare the haptic step times printed for both at several sizes,
+# e.g. "manyprisms.sh 8", "manyprisms.sh 8 mesh", "manyprisms.sh 32".
+
+# Disable path mangling in MSYS2
+export MSYS2_ARG_CONV_EXCL="/world"
+
+# Listen on port 7778.  We'll assume this is the only oscdump instance
+# running, and we don't want to run it if it's already running in
+# another terminal.
+if ! ((ps -A 2>/dev/null || ps -W 2>/dev/null || ps aux 2>/dev/null) | grep oscdump >/dev/null 2>&1 ); then (oscdump 7778 &); fi
+
+oscsend localhost 7774 /world/clear
+
+if [ x$1 = x ]; then
+    SIZE=16
+else
+    SIZE=$1
+fi
+
+BOX=$(readlink -f $(dirname "$0")/box.obj)
+
+for i in $(seq 0 $(($SIZE * $SIZE - 1))); do
+    POS=$(python -c "print('%f %f' % ((($i % $SIZE)-(($SIZE-1)/2.0))*(1.0 / $SIZE), (($i // $SIZE)-(($SIZE-1)/2.0))*(1.0 / $SIZE)))")
+    if [ x$2 = xmesh ]; then
+        oscsend localhost 7774 /world/mesh/create ssfff p$i $BOX $POS 0
+    else
+        oscsend localhost 7774 /world/prism/create sfff p$i $POS 0
+    fi
+    oscsend localhost 7774 /world/p$i/size fff $(python -c "print('%f %f 0.02' % (0.8 / $SIZE, 0.8 / $SIZE))")
+    oscsend localhost 7774 /world/fixed/create sss c$i p$i world
+done
@@ -29,8 +29,25 @@ else
     SIZE=$1
 fi
 
-for i in $(seq 0 $(($SIZE * $SIZE - 1))); do
-    POS=$(python -c "print (($i % $SIZE)-(($SIZE-1)/2.0))*(0.5 / $SIZE), (($i / $SIZE)-(($SIZE-1)/2.0))*(0.5 / $SIZE)")
-    oscsend localhost 7774 /world/sphere/create sfff s$i $POS 0
-done
+# Create all the spheres s0, s1, ... with a single message.  oscsend
+# cannot build its blob of records, so it is sent from Python; one
+# message holds up to about 2000 spheres.
+python - $SIZE <<'END'
+import socket, struct, sys
+
+def osc_string(s):
+    b = s.encode() + b'\0'
+    return b + b'\0' * (-len(b) % 4)
+
+size = int(sys.argv[1])
+records = b''
+for i in range(size * size):
+    x = ((i % size) - (size - 1) / 2.0) * (0.5 / size)
+    y = ((i // size) - (size - 1) / 2.0) * (0.5 / size)
+    records += struct.pack('>ffff', x, y, 0, 0.01)
+
+msg = (osc_string('/world/sphere/create_many') + osc_string(',sb')
+       + osc_string('s') + struct.pack('>i', len(records)) + records)
+socket.socket(socket.AF_INET, socket.SOCK_DGRAM).sendto(msg, ('localhost', 7774))
+END
 